@@ -15,382 +15,4384 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/* For mremap().  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  1
+#endif
 #include "cuckoo_hash.h"
 #include "xprobes.h"
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
 #include <assert.h>
+#ifdef HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include <unistd.h>
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+
+/*
+  Choices.  An element is stored with its hash pair (hash1, hash2)
+  ordered so that hash1 selects the bin it is in, and the pair gives
+  its alternative bins:
+
+    - with two choices, hash2 selects the other bin, and the element
+      moves there as (hash2, hash1);
+
+    - with three choices, the bins are selected by hash1, hash2 and
+      hash1 ^ hash2, and the element moves around as (hash2, hash1 ^
+      hash2) and (hash1 ^ hash2, hash1), which give the same three;
+
+    - with four choices, hash2 stays fixed, and the bins are selected
+      by hash1 XORed with 0, A, B and A ^ B, where A is odd and B is
+      even but not a multiple of four, both derived from hash2, so
+      that the bins differ in tables of more than two bins.
+
+  So the alternatives are always computed from the pair alone.  As a
+  pair with hash1 == hash2 marks an empty slot, compute_hash() makes
+  sure that no pair of the key is like that.
+*/
+static inline
+uint32_t
+offset_a(uint32_t h2)
+{
+  /* Finalization mix of MurmurHash3.  */
+  h2 ^= h2 >> 16;
+  h2 *= 0x85ebca6b;
+  h2 ^= h2 >> 13;
+  h2 *= 0xc2b2ae35;
+  h2 ^= h2 >> 16;
+
+  return h2 | 1;
+}
+
+
+static inline
+uint32_t
+offset_b(uint32_t a)
+{
+  return ((a >> 16 | a << 16) & ~3U) | 2;
+}
+
+
+/*
+  Return in *a1 and *a2 the pair of the element with the pair (h1, h2)
+  when moved to its i-th alternative bin, 0 < i < choices.
+*/
+static inline
+void
+alt_pair(unsigned int choices, uint32_t h1, uint32_t h2, unsigned int i,
+         uint32_t *a1, uint32_t *a2)
+{
+  if (choices == 2)
+    {
+      *a1 = h2;
+      *a2 = h1;
+    }
+  else if (choices == 3)
+    {
+      *a1 = (i == 1 ? h2 : h1 ^ h2);
+      *a2 = (i == 1 ? h1 ^ h2 : h1);
+    }
+  else
+    {
+      uint32_t a = offset_a(h2);
+      *a1 = h1 ^ (i == 1 ? a : i == 2 ? offset_b(a) : a ^ offset_b(a));
+      *a2 = h2;
+    }
+}
+
+
+static inline
+bool
+pair_collides4(uint32_t h1, uint32_t h2)
+{
+  uint32_t a = offset_a(h2), b = offset_b(a);
+
+  return (h1 == h2 || (h1 ^ a) == h2 || (h1 ^ b) == h2
+          || (h1 ^ a ^ b) == h2);
+}
 
 
 static inline
 void
-compute_hash(const void *key, size_t key_len,
+compute_hash(const struct cuckoo_hash *hash, const void *key, size_t key_len,
              uint32_t *h1, uint32_t *h2)
 {
-  extern void hashlittle2(const void *key, size_t length,
-                          uint32_t *pc, uint32_t *pb);
+  *h1 = hash->seed1;
+  *h2 = hash->seed2;
+  hash->hash_function(key, key_len, h1, h2);
+  if (*h1 == *h2)
+    {
+      *h2 = ~*h2;
+
+      XPROBES_SITE(cuckoo_hash, compute_hash_equal,
+                   (const void *, size_t, uint32_t),
+                   (key, key_len, *h1));
+    }
+
+  if (__builtin_expect(hash->choices == 3, 0))
+    {
+      /* hash1 ^ hash2 must differ from both.  */
+      if (*h1 == 0)
+        *h1 = (*h2 != 1 ? 1 : 2);
+      if (*h2 == 0)
+        *h2 = (*h1 != 1 ? 1 : 2);
+    }
+  else if (__builtin_expect(hash->choices == 4, 0))
+    {
+      while (pair_collides4(*h1, *h2))
+        *h2 = *h2 * 0x9e3779b1 + 1;
+    }
+}
+
+
+static inline
+uint64_t
+mix_seed(uint64_t x)
+{
+  /* splitmix64 finalizer.  */
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+
+  return x;
+}
+
+
+/*
+  Return an unpredictable seed.  salt tells apart the seeds picked at
+  the same time.  Compact tables use it too.
+*/
+uint64_t
+_cuckoo_hash_random_seed(const void *salt)
+{
+  static uint64_t counter;
+
+  uint64_t seed = 0;
+#ifdef HAVE_GETRANDOM
+  if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed))
+    seed = 0;
+#endif
+  if (seed == 0)
+    {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      seed = (mix_seed(((uint64_t) ts.tv_sec << 32) ^ ts.tv_nsec)
+              ^ mix_seed((uintptr_t) salt)
+              ^ mix_seed(__sync_add_and_fetch(&counter, 1)));
+    }
+
+  return seed;
+}
+
+
+/*
+  Pick a new unpredictable seed for the hash, different from the
+  current one.  Keys crafted against one seed then don't collide under
+  the other.
+*/
+static
+void
+new_seed(struct cuckoo_hash *hash)
+{
+  uint64_t seed = _cuckoo_hash_random_seed(hash);
+
+  uint32_t seed1 = (uint32_t) seed;
+  if (seed1 == hash->seed1)
+    seed1 = ~seed1;
+
+  hash->seed1 = seed1;
+  hash->seed2 = (uint32_t) (seed >> 32);
+}
+
+
+struct _cuckoo_hash_elem
+{
+  uint32_t hash1;
+  uint32_t hash2;
+};
+
+
+/*
+  Element in flight during insertion: the item together with its
+  hashes, as it would be stored in the slot.
+*/
+struct entry
+{
+  struct cuckoo_hash_item hash_item;
+  uint32_t hash1;
+  uint32_t hash2;
+};
+
+
+/*
+  Hashes are allocated aligned to the cache line size so that hashes
+  of a bin never straddle two lines.
+*/
+#define CACHE_LINE_SIZE  64
+
+
+/*
+  Mapped storage.  Sizes are rounded to the page size, or to the huge
+  page size for CUCKOO_HASH_STORAGE_HUGETLB, even when the mapping
+  falls back to normal pages, so that the size of any mapping can be
+  computed back from the table size.
+*/
+#ifdef HAVE_MMAP
+
+/* Default huge page size on x86-64, the one MAP_HUGETLB maps.  */
+#define HUGE_PAGE_SIZE  ((size_t) 2 << 20)
+
+
+static
+size_t
+map_size(const struct cuckoo_hash *hash, size_t size)
+{
+  size_t page = (hash->storage == CUCKOO_HASH_STORAGE_HUGETLB
+                 ? HUGE_PAGE_SIZE : (size_t) sysconf(_SC_PAGESIZE));
+
+  return (size + page - 1) & ~(page - 1);
+}
+
+
+static
+void *
+map_alloc(const struct cuckoo_hash *hash, size_t size)
+{
+  void *ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (hash->storage == CUCKOO_HASH_STORAGE_HUGETLB)
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  if (ptr == MAP_FAILED)
+    {
+      /* No huge page pool, try transparent huge pages instead.  */
+      ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (ptr == MAP_FAILED)
+        return NULL;
+
+#ifdef MADV_HUGEPAGE
+      madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+    }
+
+  return ptr;
+}
+
+#endif  /* HAVE_MMAP */
+
+
+static inline
+bool
+mapped(const struct cuckoo_hash *hash)
+{
+#ifdef HAVE_MMAP
+  return (hash->storage != CUCKOO_HASH_STORAGE_MALLOC);
+#else
+  (void) hash;
+  return false;
+#endif
+}
+
+
+/*
+  Allocate the block with the user allocator if there's one, and with
+  posix_memalign() otherwise.
+*/
+static
+void *
+mem_alloc(const struct cuckoo_hash *hash, size_t size)
+{
+  if (hash->allocator.alloc)
+    return hash->allocator.alloc(hash->allocator.context, size);
+
+  void *ptr;
+  if (posix_memalign(&ptr, CACHE_LINE_SIZE, size) != 0)
+    return NULL;
+
+  return ptr;
+}
+
+
+static
+void
+mem_free(const struct cuckoo_hash *hash, void *ptr, size_t size)
+{
+  if (! ptr)
+    return;
+
+  if (hash->allocator.free)
+    hash->allocator.free(hash->allocator.context, ptr, size);
+  else
+    free(ptr);
+}
+
+
+static
+void *
+table_alloc(const struct cuckoo_hash *hash, size_t size)
+{
+#ifdef HAVE_MMAP
+  if (mapped(hash))
+    return map_alloc(hash, map_size(hash, size));
+#endif
+
+  return mem_alloc(hash, size);
+}
+
+
+static
+void
+table_free(const struct cuckoo_hash *hash, void *ptr, size_t size)
+{
+#ifdef HAVE_MMAP
+  if (mapped(hash))
+    {
+      if (ptr)
+        munmap(ptr, map_size(hash, size));
+      return;
+    }
+#endif
+
+  mem_free(hash, ptr, size);
+}
+
+
+/*
+  Resize the block like realloc().  Mappings are resized with
+  mremap(), which moves the pages instead of copying them.  So are
+  large malloc()ed blocks by realloc() of glibc, which keeps their
+  offset in the page and thus their alignment; only a block that
+  realloc() moved to an unaligned address is copied once more.
+*/
+static
+void *
+table_resize(const struct cuckoo_hash *hash, void *ptr,
+             size_t old_size, size_t size)
+{
+#if defined(HAVE_MMAP) && defined(HAVE_MREMAP)
+  if (mapped(hash))
+    {
+      void *res = mremap(ptr, map_size(hash, old_size), map_size(hash, size),
+                         MREMAP_MAYMOVE);
+      if (res != MAP_FAILED)
+        return res;
+    }
+#endif
+
+  if (! mapped(hash) && hash->allocator.realloc)
+    return hash->allocator.realloc(hash->allocator.context, ptr,
+                                   old_size, size);
+
+  if (! mapped(hash) && ! hash->allocator.alloc)
+    {
+      void *res = realloc(ptr, size);
+      if (! res)
+        return NULL;
+
+      if ((uintptr_t) res % CACHE_LINE_SIZE == 0)
+        return res;
+
+      /* The old block is gone, an unaligned one is only slower.  */
+      void *aligned = mem_alloc(hash, size);
+      if (! aligned)
+        return res;
+
+      memcpy(aligned, res, old_size < size ? old_size : size);
+      free(res);
+
+      return aligned;
+    }
+
+  void *res = table_alloc(hash, size);
+  if (! res)
+    return NULL;
+
+  memcpy(res, ptr, old_size < size ? old_size : size);
+  table_free(hash, ptr, old_size);
+
+  return res;
+}
+
+
+/*
+  Bitmap of migrated bins of the old table of 2^power bins.
+*/
+static inline
+size_t
+migrated_size(unsigned char power)
+{
+  return ((1UL << power) + CHAR_BIT - 1) / CHAR_BIT;
+}
+
+
+static
+void
+free_arrays(const struct cuckoo_hash *hash, struct _cuckoo_hash_elem *table,
+            struct cuckoo_hash_item *items, size_t count)
+{
+  table_free(hash, table, count * sizeof(*table));
+  table_free(hash, items, count * hash->item_size);
+}
+
+
+/*
+  Free the table, and the old one during incremental growth.
+*/
+static
+void
+free_tables(const struct cuckoo_hash *hash)
+{
+  size_t count = (size_t) hash->bin_size << hash->power;
+  free_arrays(hash, hash->table, hash->items, count);
+  if (hash->old_table)
+    {
+      free_arrays(hash, hash->old_table, hash->old_items, count / 2);
+      mem_free(hash, hash->migrated, migrated_size(hash->power - 1));
+    }
+}
+
+
+static
+void
+clear_stash(struct cuckoo_hash *hash)
+{
+  memset(hash->stash, 0, sizeof(hash->stash));
+  hash->stash_count = 0;
+}
+
+
+/*
+  Concurrent mode.  Parts of the table readers look at have versions,
+  which the writer bumps before and after changing the part, so that
+  a version is odd while the part is being changed, and readers check
+  that the versions of the parts they have read didn't change
+  meanwhile (a seqlock per part).  Bins share VERSION_STRIPES
+  versions, the stash has a version of its own, and table_version
+  covers the fields of struct cuckoo_hash that change when the table
+  grows or is rebuilt.  A bracket never nests into another one of the
+  same version.
+
+  With several writers, the versions double as locks: a writer locks
+  a version by making it odd with a compare-and-swap, and unlocks it
+  by making it even again, so readers see locked parts as being
+  changed.  Writers lock the versions in the order of their addresses
+  (the stash version after all bin versions), so they don't deadlock.
+
+  Tables replaced by new ones are retired, and freed only when no
+  reader may read them anymore.  Writers advance epoch after retiring
+  tables, and readers record the epoch in their struct
+  cuckoo_hash_reader when they start a lookup, and clear it when they
+  are done, so tables retired at epoch E may still be read only by the
+  readers that record an epoch of at most E.
+*/
+#define VERSION_STRIPES  1024
+
+
+/*
+  Failed attempts of a lookup after which it yields the CPU, as the
+  writer may have been preempted in the middle of a change.
+*/
+#define READ_SPINS  64
+
+
+/*
+  Arrays of a table of count slots replaced at epoch.
+*/
+struct retired
+{
+  struct retired *next;
+  struct _cuckoo_hash_elem *table;
+  struct cuckoo_hash_item *items;
+  size_t count;
+  uint64_t epoch;
+};
+
+
+struct grow_job;
+
+
+struct _cuckoo_hash_sync
+{
+  /* Read by every lookup, rarely written.  */
+  uint32_t table_version;
+  uint32_t stash_version;
+  uint64_t epoch;
+
+  /* Checked by writers waiting for a lock.  */
+  struct grow_job *grow;
+
+  /* lock protects readers and retired.  */
+  bool lock __attribute__((__aligned__(CACHE_LINE_SIZE)));
+  struct cuckoo_hash_reader *readers;
+  struct retired *retired;
+  unsigned int helpers;
+
+  uint32_t versions[VERSION_STRIPES]
+    __attribute__((__aligned__(CACHE_LINE_SIZE)));
+};
+
+
+static inline
+void
+write_begin(uint32_t *version)
+{
+  __atomic_store_n(version, __atomic_load_n(version, __ATOMIC_RELAXED) + 1,
+                   __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+static inline
+void
+write_end(uint32_t *version)
+{
+  __atomic_store_n(version, __atomic_load_n(version, __ATOMIC_RELAXED) + 1,
+                   __ATOMIC_RELEASE);
+}
+
+
+static inline
+uint32_t
+read_begin(const uint32_t *version)
+{
+  return __atomic_load_n(version, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+  Return true if the data read since read_begin() returned seen is
+  consistent.
+*/
+static inline
+bool
+read_valid(const uint32_t *version, uint32_t seen)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  return (__atomic_load_n(version, __ATOMIC_RELAXED) == seen);
+}
+
+
+static inline
+uint32_t *
+bin_version(struct _cuckoo_hash_sync *sync, uint32_t index)
+{
+  return &sync->versions[index % VERSION_STRIPES];
+}
+
+
+/*
+  Bracket a change of the slot elem, or of the stash, of a table that
+  may be concurrent.
+*/
+static inline
+void
+slot_write_begin(const struct cuckoo_hash *hash,
+                 const struct _cuckoo_hash_elem *elem)
+{
+  if (__builtin_expect(hash->sync != NULL, 0))
+    write_begin(bin_version(hash->sync,
+                            (elem - hash->table) / hash->bin_size));
+}
+
+
+static inline
+void
+slot_write_end(const struct cuckoo_hash *hash,
+               const struct _cuckoo_hash_elem *elem)
+{
+  if (__builtin_expect(hash->sync != NULL, 0))
+    write_end(bin_version(hash->sync,
+                          (elem - hash->table) / hash->bin_size));
+}
+
+
+static inline
+void
+stash_write_begin(const struct cuckoo_hash *hash)
+{
+  if (__builtin_expect(hash->sync != NULL, 0))
+    write_begin(&hash->sync->stash_version);
+}
+
+
+static inline
+void
+stash_write_end(const struct cuckoo_hash *hash)
+{
+  if (__builtin_expect(hash->sync != NULL, 0))
+    write_end(&hash->sync->stash_version);
+}
+
+
+/*
+  Growth with several writers.  The writer that grows the table locks
+  all versions, and writers that wait for any of them meanwhile help
+  it copy the old table to the new one, GROW_CHUNK slots at a time.
+*/
+#define GROW_CHUNK  4096
+
+
+struct grow_job
+{
+  const struct _cuckoo_hash_elem *old_table;
+  const unsigned char *old_items;
+  struct _cuckoo_hash_elem *table;
+  unsigned char *items;
+  size_t count;
+  size_t new_count;
+  size_t item_size;
+  size_t next;
+  size_t done;
+};
+
+
+/*
+  Replicate chunks of the old table until there are none left.
+*/
+static
+void
+grow_copy(struct grow_job *job)
+{
+  for (;;)
+    {
+      size_t beg = __atomic_fetch_add(&job->next, GROW_CHUNK,
+                                      __ATOMIC_RELAXED);
+      if (beg >= job->count)
+        return;
+
+      size_t n = job->count - beg;
+      if (n > GROW_CHUNK)
+        n = GROW_CHUNK;
+      for (size_t i = beg; i < job->new_count; i += job->count)
+        {
+          memcpy(job->table + i, job->old_table + beg,
+                 n * sizeof(*job->table));
+          memcpy(job->items + i * job->item_size,
+                 job->old_items + beg * job->item_size, n * job->item_size);
+        }
+
+      __atomic_fetch_add(&job->done, n, __ATOMIC_RELEASE);
+    }
+}
+
+
+/*
+  Help the growth in progress, if any.  The job lives as long as
+  helpers is nonzero.
+*/
+static
+void
+help_grow(struct _cuckoo_hash_sync *sync)
+{
+  __atomic_fetch_add(&sync->helpers, 1, __ATOMIC_SEQ_CST);
+  struct grow_job *job = __atomic_load_n(&sync->grow, __ATOMIC_SEQ_CST);
+  if (job)
+    grow_copy(job);
+  __atomic_fetch_sub(&sync->helpers, 1, __ATOMIC_RELEASE);
+}
+
+
+static inline
+void
+lock_version(struct _cuckoo_hash_sync *sync, uint32_t *version)
+{
+  for (unsigned int spins = 1; ; ++spins)
+    {
+      uint32_t seen = __atomic_load_n(version, __ATOMIC_RELAXED);
+      if (! (seen & 1)
+          && __atomic_compare_exchange_n(version, &seen, seen + 1, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+          /* Order the odd version before the changes, as write_begin().  */
+          __atomic_thread_fence(__ATOMIC_RELEASE);
+          return;
+        }
+
+      if (__atomic_load_n(&sync->grow, __ATOMIC_RELAXED))
+        help_grow(sync);
+      else if (spins % READ_SPINS == 0)
+        sched_yield();
+    }
+}
+
+
+/*
+  Versions locked by a writer: those of up to four bins and of the
+  stash.
+*/
+struct lock_set
+{
+  uint32_t *versions[5];
+  unsigned int count;
+};
+
+
+/*
+  Lock the versions of the n bins with the given indexes in the order
+  of addresses, each once.
+*/
+static
+void
+lock_bins(struct _cuckoo_hash_sync *sync, struct lock_set *set,
+          const uint32_t *bins, unsigned int n)
+{
+  set->count = 0;
+  for (unsigned int i = 0; i < n; ++i)
+    {
+      uint32_t *version = bin_version(sync, bins[i]);
+      unsigned int j = set->count;
+      while (j > 0 && set->versions[j - 1] > version)
+        --j;
+      if (j > 0 && set->versions[j - 1] == version)
+        continue;
+
+      memmove(&set->versions[j + 1], &set->versions[j],
+              (set->count - j) * sizeof(set->versions[0]));
+      set->versions[j] = version;
+      ++set->count;
+    }
+
+  for (unsigned int i = 0; i < set->count; ++i)
+    lock_version(sync, set->versions[i]);
+}
+
+
+/*
+  Lock the stash version too, always after the bins.
+*/
+static inline
+void
+lock_stash(struct _cuckoo_hash_sync *sync, struct lock_set *set)
+{
+  lock_version(sync, &sync->stash_version);
+  set->versions[set->count++] = &sync->stash_version;
+}
+
+
+static inline
+void
+unlock_set(struct lock_set *set)
+{
+  for (unsigned int i = 0; i < set->count; ++i)
+    write_end(set->versions[i]);
+}
+
+
+static
+void
+sync_lock(struct _cuckoo_hash_sync *sync)
+{
+  while (__atomic_test_and_set(&sync->lock, __ATOMIC_ACQUIRE))
+    sched_yield();
+}
+
+
+static
+void
+sync_unlock(struct _cuckoo_hash_sync *sync)
+{
+  __atomic_clear(&sync->lock, __ATOMIC_RELEASE);
+}
+
+
+void
+cuckoo_hash_reader_register(struct cuckoo_hash *hash,
+                            struct cuckoo_hash_reader *reader)
+{
+  struct _cuckoo_hash_sync *sync = hash->sync;
+  if (! sync)
+    return;
+
+  reader->_epoch = 0;
+  sync_lock(sync);
+  reader->_next = sync->readers;
+  sync->readers = reader;
+  sync_unlock(sync);
+}
+
+
+void
+cuckoo_hash_reader_unregister(struct cuckoo_hash *hash,
+                              struct cuckoo_hash_reader *reader)
+{
+  struct _cuckoo_hash_sync *sync = hash->sync;
+  if (! sync)
+    return;
+
+  sync_lock(sync);
+  struct cuckoo_hash_reader **link = &sync->readers;
+  while (*link != reader)
+    link = &(*link)->_next;
+  *link = reader->_next;
+  sync_unlock(sync);
+}
+
+
+static inline
+void
+reader_enter(struct _cuckoo_hash_sync *sync,
+             struct cuckoo_hash_reader *reader)
+{
+  __atomic_store_n(&reader->_epoch,
+                   __atomic_load_n(&sync->epoch, __ATOMIC_ACQUIRE),
+                   __ATOMIC_RELAXED);
+  /* Pairs with the fence in oldest_reader().  */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+static inline
+void
+reader_exit(struct cuckoo_hash_reader *reader)
+{
+  __atomic_store_n(&reader->_epoch, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+  Return the oldest epoch recorded by the readers, or UINT64_MAX if
+  none is in a lookup.  Readers that are not seen in a lookup here
+  will see everything published before.  Called with the lock held.
+*/
+static
+uint64_t
+oldest_reader(struct _cuckoo_hash_sync *sync)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  uint64_t oldest = UINT64_MAX;
+  for (struct cuckoo_hash_reader *reader = sync->readers;
+       reader != NULL;
+       reader = reader->_next)
+    {
+      uint64_t epoch = __atomic_load_n(&reader->_epoch, __ATOMIC_ACQUIRE);
+      if (epoch != 0 && epoch < oldest)
+        oldest = epoch;
+    }
+
+  return oldest;
+}
+
+
+/*
+  Advance the epoch, and return the one before.
+*/
+static inline
+uint64_t
+advance_epoch(struct _cuckoo_hash_sync *sync)
+{
+  return __atomic_fetch_add(&sync->epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+
+static
+void
+free_retired(const struct cuckoo_hash *hash, struct retired *retired)
+{
+  while (retired)
+    {
+      struct retired *next = retired->next;
+      free_arrays(hash, retired->table, retired->items, retired->count);
+      mem_free(hash, retired, sizeof(*retired));
+      retired = next;
+    }
+}
+
+
+/*
+  Free retired tables that no reader may read anymore.
+*/
+static
+void
+reclaim(const struct cuckoo_hash *hash)
+{
+  struct _cuckoo_hash_sync *sync = hash->sync;
+  if (! __atomic_load_n(&sync->retired, __ATOMIC_RELAXED))
+    return;
+
+  struct retired *freed = NULL;
+  sync_lock(sync);
+  uint64_t oldest = oldest_reader(sync);
+  struct retired **link = &sync->retired;
+  while (*link)
+    {
+      struct retired *retired = *link;
+      if (retired->epoch < oldest)
+        {
+          *link = retired->next;
+          retired->next = freed;
+          freed = retired;
+        }
+      else
+        {
+          link = &retired->next;
+        }
+    }
+  sync_unlock(sync);
+
+  free_retired(hash, freed);
+}
+
+
+void
+cuckoo_hash_synchronize(struct cuckoo_hash *hash)
+{
+  struct _cuckoo_hash_sync *sync = hash->sync;
+  if (! sync)
+    return;
+
+  uint64_t epoch = advance_epoch(sync);
+  for (;;)
+    {
+      sync_lock(sync);
+      uint64_t oldest = oldest_reader(sync);
+      sync_unlock(sync);
+      if (oldest > epoch)
+        break;
+
+      sched_yield();
+    }
+
+  reclaim(hash);
+}
+
+
+/*
+  Retire the arrays of a table of count slots, which must be
+  unreachable from the hash already, with the record retired.
+*/
+static
+void
+retire(struct cuckoo_hash *hash, struct retired *retired,
+       struct _cuckoo_hash_elem *table, struct cuckoo_hash_item *items,
+       size_t count)
+{
+  struct _cuckoo_hash_sync *sync = hash->sync;
+  retired->table = table;
+  retired->items = items;
+  retired->count = count;
+  retired->epoch = advance_epoch(sync);
+
+  sync_lock(sync);
+  retired->next = sync->retired;
+  sync->retired = retired;
+  sync_unlock(sync);
+
+  reclaim(hash);
+}
+
+
+/*
+  Same as retire(), but allocate the record, and should that fail,
+  wait for the readers and free the arrays at once.  For the single
+  writer only, as the wait would never end inside a lookup.
+*/
+static
+void
+retire_arrays(struct cuckoo_hash *hash, struct _cuckoo_hash_elem *table,
+              struct cuckoo_hash_item *items, size_t count)
+{
+  struct retired *retired = mem_alloc(hash, sizeof(*retired));
+  if (retired)
+    {
+      retire(hash, retired, table, items, count);
+    }
+  else
+    {
+      cuckoo_hash_synchronize(hash);
+      free_arrays(hash, table, items, count);
+    }
+}
+
+
+static
+bool
+sync_init(struct cuckoo_hash *hash)
+{
+  hash->sync = mem_alloc(hash, sizeof(*hash->sync));
+  if (! hash->sync)
+    return false;
+
+  memset(hash->sync, 0, sizeof(*hash->sync));
+  /* Zero epoch marks readers that are not in a lookup.  */
+  hash->sync->epoch = 1;
+
+  return true;
+}
+
+
+/*
+  Free the concurrent state together with the retired tables.  No
+  reader may be in a lookup.
+*/
+static
+void
+sync_destroy(const struct cuckoo_hash *hash)
+{
+  free_retired(hash, hash->sync->retired);
+  mem_free(hash, hash->sync, sizeof(*hash->sync));
+}
+
+
+/*
+  Replace the hash with fresh, a copy of it with tables of its own,
+  and free the tables of the hash.  A concurrent table is replaced at
+  once, and its tables are retired.  fresh must have been built with
+  no sync, so that readers don't retry because of it.
+*/
+static
+void
+replace_tables(struct cuckoo_hash *hash, struct cuckoo_hash *fresh)
+{
+  struct _cuckoo_hash_sync *sync = hash->sync;
+  if (! sync)
+    {
+      free_tables(hash);
+      *hash = *fresh;
+
+      return;
+    }
+
+  struct _cuckoo_hash_elem *table = hash->table;
+  struct cuckoo_hash_item *items = hash->items;
+  size_t count = (size_t) hash->bin_size << hash->power;
+
+  fresh->sync = sync;
+  write_begin(&sync->table_version);
+  *hash = *fresh;
+  write_end(&sync->table_version);
+
+  retire_arrays(hash, table, items, count);
+}
+
+
+/*
+  Key arena.  With the copy_keys option, keys are copied into chunks
+  owned by the table, so that they are packed densely instead of being
+  scattered over the heap.  Keys of up to ARENA_MAX_KEY bytes are
+  rounded up to ARENA_ALIGN and carved from the chunks, and freed
+  blocks are kept on a free list per block size for reuse by keys of
+  the same size.  Longer keys are allocated one by one.
+*/
+#define ARENA_ALIGN  8
+#define ARENA_MAX_KEY  512
+#define ARENA_CLASSES  (ARENA_MAX_KEY / ARENA_ALIGN)
+#define ARENA_CHUNK_SIZE  (64 * 1024)
+
+
+struct arena_chunk
+{
+  struct arena_chunk *next;
+  size_t size;
+  unsigned char data[];
+};
+
+
+struct _cuckoo_hash_arena
+{
+  struct arena_chunk *chunks;
+  unsigned char *top;
+  size_t left;
+  void *free_list[ARENA_CLASSES];
+  size_t size;
+  size_t used;
+  size_t large;
+};
+
+
+static inline
+unsigned int
+arena_class(size_t key_len)
+{
+  return (key_len == 0 ? 0 : (key_len - 1) / ARENA_ALIGN);
+}
+
+
+static inline
+size_t
+arena_block_size(unsigned int class)
+{
+  return (size_t) (class + 1) * ARENA_ALIGN;
+}
+
+
+static inline
+void
+arena_push(struct _cuckoo_hash_arena *arena, unsigned int class, void *block)
+{
+  *(void **) block = arena->free_list[class];
+  arena->free_list[class] = block;
+}
+
+
+static
+struct arena_chunk *
+arena_add_chunk(const struct cuckoo_hash *hash, size_t size)
+{
+  struct _cuckoo_hash_arena *arena = hash->arena;
+  struct arena_chunk *chunk = mem_alloc(hash, sizeof(*chunk) + size);
+  if (! chunk)
+    return NULL;
+
+  chunk->next = arena->chunks;
+  chunk->size = size;
+  arena->chunks = chunk;
+  arena->size += size;
+
+  return chunk;
+}
+
+
+static
+void
+arena_free_chunks(const struct cuckoo_hash *hash, struct arena_chunk *chunk)
+{
+  while (chunk)
+    {
+      struct arena_chunk *next = chunk->next;
+      mem_free(hash, chunk, sizeof(*chunk) + chunk->size);
+      chunk = next;
+    }
+}
+
+
+/*
+  Copy the key into the arena.  Return the copy, or NULL if memory is
+  exhausted.
+*/
+static
+const void *
+arena_copy(const struct cuckoo_hash *hash, const void *key, size_t key_len)
+{
+  struct _cuckoo_hash_arena *arena = hash->arena;
+  void *block;
+  if (key_len > ARENA_MAX_KEY)
+    {
+      block = mem_alloc(hash, key_len);
+      if (! block)
+        return NULL;
+
+      ++arena->large;
+    }
+  else
+    {
+      unsigned int class = arena_class(key_len);
+      size_t size = arena_block_size(class);
+      block = arena->free_list[class];
+      if (block)
+        {
+          arena->free_list[class] = *(void **) block;
+        }
+      else
+        {
+          if (arena->left < size)
+            {
+              struct arena_chunk *chunk =
+                arena_add_chunk(hash, ARENA_CHUNK_SIZE);
+              if (! chunk)
+                return NULL;
+
+              /* Keep the tail of the previous chunk for shorter keys.  */
+              if (arena->left >= ARENA_ALIGN)
+                arena_push(arena, arena->left / ARENA_ALIGN - 1, arena->top);
+              arena->top = chunk->data;
+              arena->left = chunk->size;
+            }
+
+          block = arena->top;
+          arena->top += size;
+          arena->left -= size;
+        }
+      arena->used += size;
+    }
+
+  memcpy(block, key, key_len);
+
+  return block;
+}
+
+
+static
+void
+arena_free(const struct cuckoo_hash *hash, const void *key, size_t key_len)
+{
+  struct _cuckoo_hash_arena *arena = hash->arena;
+  if (key_len > ARENA_MAX_KEY)
+    {
+      mem_free(hash, (void *) key, key_len);
+      --arena->large;
+    }
+  else
+    {
+      unsigned int class = arena_class(key_len);
+      arena_push(arena, class, (void *) key);
+      arena->used -= arena_block_size(class);
+    }
+}
+
+
+static
+bool
+arena_init(struct cuckoo_hash *hash)
+{
+  hash->arena = mem_alloc(hash, sizeof(*hash->arena));
+  if (! hash->arena)
+    return false;
+
+  memset(hash->arena, 0, sizeof(*hash->arena));
+
+  return true;
+}
+
+
+static
+void
+arena_destroy(const struct cuckoo_hash *hash)
+{
+  struct _cuckoo_hash_arena *arena = hash->arena;
+  if (arena->large != 0)
+    {
+      for (struct cuckoo_hash_item *it = cuckoo_hash_next(hash, NULL);
+           it != NULL;
+           it = cuckoo_hash_next(hash, it))
+        {
+          if (it->key_len > ARENA_MAX_KEY)
+            mem_free(hash, (void *) it->key, it->key_len);
+        }
+    }
+
+  arena_free_chunks(hash, arena->chunks);
+  mem_free(hash, arena, sizeof(*arena));
+}
+
+
+/*
+  Move the keys into a single chunk when most of the arena is free
+  blocks.  If memory is exhausted, the arena is left as is.
+*/
+static
+void
+arena_compact(struct cuckoo_hash *hash)
+{
+  struct _cuckoo_hash_arena *arena = hash->arena;
+  if (arena->used >= arena->size / 2)
+    return;
+
+  struct arena_chunk *old_chunks = arena->chunks;
+  size_t old_size = arena->size;
+  arena->chunks = NULL;
+  arena->size = 0;
+  if (arena->used != 0 && ! arena_add_chunk(hash, arena->used))
+    {
+      arena->chunks = old_chunks;
+      arena->size = old_size;
+      return;
+    }
+
+  unsigned char *top = (arena->chunks ? arena->chunks->data : NULL);
+  for (struct cuckoo_hash_item *it = cuckoo_hash_next(hash, NULL);
+       it != NULL;
+       it = cuckoo_hash_next(hash, it))
+    {
+      if (it->key_len <= ARENA_MAX_KEY)
+        {
+          memcpy(top, it->key, it->key_len);
+          it->key = top;
+          top += arena_block_size(arena_class(it->key_len));
+        }
+    }
+
+  arena_free_chunks(hash, old_chunks);
+  memset(arena->free_list, 0, sizeof(arena->free_list));
+  arena->top = top;
+  arena->left = 0;
+}
+
+
+/*
+  Allocate empty table for the current power and bin size.
+*/
+static
+bool
+alloc_table(struct cuckoo_hash *hash)
+{
+  size_t count = (size_t) hash->bin_size << hash->power;
+  hash->table = table_alloc(hash, count * sizeof(*hash->table));
+  hash->items = table_alloc(hash, count * hash->item_size);
+  hash->old_table = NULL;
+  hash->old_items = NULL;
+  hash->migrated = NULL;
+  if (! hash->table || ! hash->items)
+    {
+      free_arrays(hash, hash->table, hash->items, count);
+      return false;
+    }
+
+  /* Fresh mappings are zero-filled already.  */
+  if (! mapped(hash))
+    memset(hash->table, 0, count * sizeof(*hash->table));
+
+  return true;
+}
+
+
+bool
+cuckoo_hash_init(struct cuckoo_hash *hash, unsigned char power)
+{
+  return cuckoo_hash_init_with(hash, power, NULL);
+}
+
+
+/*
+  Tables with bins of four slots fill up to about 97% before inserts
+  fail, and with bins of eight slots, which still fit into a cache
+  line, up to about 99%.  More choices push these further.  Presized
+  tables aim at lower loads so that they don't have to grow after all.
+*/
+#define BIN4_MAX_LOAD  0.9
+#define BIN8_MAX_LOAD  0.97
+#define MAX_POWER  31
+
+
+/*
+  Highest load presized tables aim at, by bin size (2, 4, 8, 16) and
+  number of choices (2, 3, 4).
+*/
+static const double max_loads[4][3] = {
+  { 0.8, 0.95, 0.97 },
+  { BIN4_MAX_LOAD, 0.98, 0.99 },
+  { BIN8_MAX_LOAD, 0.99, 0.99 },
+  { 0.98, 0.99, 0.99 }
+};
+
+
+static inline
+double
+max_load(unsigned int bin_size, unsigned int choices)
+{
+  return max_loads[__builtin_ctz(bin_size) - 1][choices - 2];
+}
+
+
+/*
+  Compute the power of the table with bins of bin_size slots that
+  holds count elements at the given load, or at the highest load such
+  bins reach.  Return false if the load is out of range or the table
+  would be too large.
+*/
+static
+bool
+power_for(size_t count, double load, unsigned int bin_size,
+          unsigned int choices, unsigned char *power)
+{
+  if (! (load > 0 && load <= 1))
+    return false;
+
+  if (load > max_load(bin_size, choices))
+    load = max_load(bin_size, choices);
+
+  double bins = (double) count / load / bin_size;
+  unsigned char p = 1;
+  while ((double) ((size_t) 1 << p) < bins)
+    {
+      if (++p > MAX_POWER)
+        return false;
+    }
+
+  *power = p;
+
+  return true;
+}
+
+
+/*
+  Pick the bin size, unless *bin_size is set already, and the power of
+  the table with the given choices for count elements at the load.
+*/
+static
+bool
+size_for(size_t count, double load, unsigned int choices,
+         unsigned int *bin_size, unsigned char *power)
+{
+  if (*bin_size == 0)
+    *bin_size = (load <= max_load(4, choices) ? 4 : 8);
+
+  return power_for(count, load, *bin_size, choices, power);
+}
+
+
+static inline
+bool
+valid_shape(const struct cuckoo_hash_options *options)
+{
+  unsigned int bin_size = options->bin_size;
+  if (! ((bin_size == 0 || bin_size == 2 || bin_size == 4
+          || bin_size == 8 || bin_size == 16)
+         && (options->choices == 0
+             || (options->choices >= 2 && options->choices <= 4))))
+    return false;
+
+  const struct cuckoo_hash_growth *growth = options->growth;
+  if (! growth)
+    return true;
+
+  unsigned int factor = growth->factor;
+
+  return (growth->max_load >= 0 && growth->max_load <= 1
+          && (factor == 0 || factor == 2
+              || (options->migrate_step == 0
+                  && (factor == 4 || factor == 8 || factor == 16))));
+}
+
+
+/*
+  Return the load presized tables with the growth policy aim at
+  instead of load.
+*/
+static inline
+double
+capped_load(double load, const struct cuckoo_hash_growth *growth)
+{
+  if (growth && growth->max_load > 0 && load > growth->max_load)
+    return growth->max_load;
+
+  return load;
+}
+
+
+static
+bool
+init(struct cuckoo_hash *hash, unsigned char power, unsigned int bin_size,
+     const struct cuckoo_hash_options *options)
+{
+  static const struct cuckoo_hash_options default_options;
+  if (! options)
+    options = &default_options;
+
+  if (power == 0)
+    power = 1;
+
+  if (! valid_shape(options))
+    return false;
+
+  hash->hash_function = (options->hash_function
+                         ? options->hash_function : cuckoo_hash_lookup3);
+  if (options->seed != 0)
+    {
+      hash->seed1 = (uint32_t) options->seed;
+      hash->seed2 = (uint32_t) (options->seed >> 32);
+    }
+  else
+    {
+      hash->seed1 = 0;
+      new_seed(hash);
+    }
+  hash->power = power;
+  hash->bin_size = bin_size;
+  hash->fixed_bin_size = (options->bin_size != 0);
+  hash->choices = (options->choices != 0 ? options->choices : 2);
+  hash->count = 0;
+  hash->unmigrated = 0;
+  hash->migrate_cursor = 0;
+  hash->migrate_step = options->migrate_step;
+  hash->shrink_load = options->shrink_load;
+  hash->shrink_pending = false;
+  clear_stash(hash);
+#ifdef HAVE_MMAP
+  hash->storage = options->storage;
+#else
+  hash->storage = CUCKOO_HASH_STORAGE_MALLOC;
+#endif
+  static const struct cuckoo_hash_allocator default_allocator;
+  hash->allocator = (options->allocator
+                     ? *options->allocator : default_allocator);
+  static const struct cuckoo_hash_growth default_growth;
+  hash->growth = (options->growth ? *options->growth : default_growth);
+  if (hash->growth.factor == 0)
+    hash->growth.factor = 2;
+  if (options->allocator)
+    hash->storage = CUCKOO_HASH_STORAGE_MALLOC;
+
+  hash->arena = NULL;
+  hash->sync = NULL;
+  if (options->inline_keys > CUCKOO_HASH_INLINE_KEYS_MAX)
+    return false;
+  if (options->concurrent
+      && (options->migrate_step != 0 || options->copy_keys))
+    return false;
+  hash->inline_keys = (options->inline_keys + 7) & ~7U;
+  hash->item_size = sizeof(struct cuckoo_hash_item) + hash->inline_keys;
+
+  if (! alloc_table(hash))
+    return false;
+
+  if ((options->copy_keys && ! arena_init(hash))
+      || (options->concurrent && ! sync_init(hash)))
+    {
+      free_tables(hash);
+      return false;
+    }
+
+  XPROBES_SITE(cuckoo_hash, init,
+               (const struct cuckoo_hash *),
+               (hash));
+
+  return true;
+}
+
+
+bool
+cuckoo_hash_init_with(struct cuckoo_hash *hash, unsigned char power,
+                      const struct cuckoo_hash_options *options)
+{
+  unsigned int bin_size = (options && options->bin_size != 0
+                           ? options->bin_size : 4);
+
+  return init(hash, power, bin_size, options);
+}
+
+
+bool
+cuckoo_hash_init_for(struct cuckoo_hash *hash, size_t count, double load,
+                     const struct cuckoo_hash_options *options)
+{
+  static const struct cuckoo_hash_options default_options;
+  if (! options)
+    options = &default_options;
+
+  if (! valid_shape(options))
+    return false;
+
+  unsigned int choices = (options->choices != 0 ? options->choices : 2);
+  unsigned int bin_size = options->bin_size;
+  unsigned char power;
+  if (! size_for(count, capped_load(load, options->growth), choices,
+                 &bin_size, &power))
+    return false;
+
+  return init(hash, power, bin_size, options);
+}
+
+
+void
+cuckoo_hash_destroy(const struct cuckoo_hash *hash)
+{
+  XPROBES_SITE(cuckoo_hash, destroy,
+               (const struct cuckoo_hash *),
+               (hash));
+
+  if (hash->arena)
+    arena_destroy(hash);
+  if (hash->sync)
+    sync_destroy(hash);
+  free_tables(hash);
+}
+
+
+static inline
+struct _cuckoo_hash_elem *
+bin_at(const struct cuckoo_hash *hash, uint32_t index)
+{
+  return (hash->table + index * hash->bin_size);
+}
+
+
+/*
+  Slots of the items arrays are item_size bytes apart, as inline keys
+  follow the items.
+*/
+static inline
+struct cuckoo_hash_item *
+slot_item(const struct cuckoo_hash *hash, struct cuckoo_hash_item *items,
+          size_t pos)
+{
+  return (struct cuckoo_hash_item *) ((char *) items + pos * hash->item_size);
+}
+
+
+static inline
+size_t
+slot_pos(const struct cuckoo_hash *hash, const struct cuckoo_hash_item *items,
+         const struct cuckoo_hash_item *hash_item)
+{
+  return ((const char *) hash_item - (const char *) items) / hash->item_size;
+}
+
+
+static inline
+unsigned char *
+inline_key(const struct cuckoo_hash_item *hash_item)
+{
+  return (unsigned char *) (hash_item + 1);
+}
+
+
+static inline
+struct cuckoo_hash_item *
+item_at(const struct cuckoo_hash *hash, const struct _cuckoo_hash_elem *elem)
+{
+  return slot_item(hash, hash->items, elem - hash->table);
+}
+
+
+/*
+  Compare the key with the inline copy, which is zero padded to a
+  multiple of eight bytes, a word at a time.
+*/
+static inline
+bool
+inline_key_equal(const unsigned char *copy, const unsigned char *key,
+                 size_t key_len)
+{
+  uint64_t a, b;
+  for (; key_len >= sizeof(a); key_len -= sizeof(a))
+    {
+      memcpy(&a, copy, sizeof(a));
+      memcpy(&b, key, sizeof(b));
+      if (a != b)
+        return false;
+
+      copy += sizeof(a);
+      key += sizeof(b);
+    }
+
+  if (key_len == 0)
+    return true;
+
+  memcpy(&a, copy, sizeof(a));
+  b = 0;
+  memcpy(&b, key, key_len);
+
+  return (a == b);
+}
+
+
+/*
+  Incremental growth.  While the table grows incrementally, power is
+  already that of the new table, and the old table has half as many
+  bins.  Old bin i is migrated by copying it to both new bins i and
+  i + old bin count, the same way grow_table() copies the whole table.
+  New bins are valid only once their old bin has been migrated, until
+  then their elements are looked up in the old table.
+*/
+static inline
+uint32_t
+old_index(const struct cuckoo_hash *hash, uint32_t index)
+{
+  return index & ((1U << (hash->power - 1)) - 1);
+}
+
+
+static inline
+bool
+bin_migrated(const struct cuckoo_hash *hash, uint32_t old)
+{
+  return (hash->migrated[old / CHAR_BIT] >> (old % CHAR_BIT)) & 1;
+}
+
+
+/*
+  Return the bin with the given index and store the items of its slots
+  to *items.  During incremental growth the bin may still be in the
+  old table.
+*/
+static inline
+struct _cuckoo_hash_elem *
+locate_bin(const struct cuckoo_hash *hash, uint32_t index,
+           struct cuckoo_hash_item **items)
+{
+  size_t offset;
+  if (__builtin_expect(hash->old_table != NULL, 0))
+    {
+      uint32_t old = old_index(hash, index);
+      if (! bin_migrated(hash, old))
+        {
+          offset = (size_t) old * hash->bin_size;
+          *items = slot_item(hash, hash->old_items, offset);
+          return hash->old_table + offset;
+        }
+    }
+
+  offset = (size_t) index * hash->bin_size;
+  *items = slot_item(hash, hash->items, offset);
+  return hash->table + offset;
+}
+
+
+static inline
+bool
+in_old_items(const struct cuckoo_hash *hash,
+             const struct cuckoo_hash_item *hash_item)
+{
+  size_t old_count = (size_t) hash->bin_size << (hash->power - 1);
+
+  return (hash->old_items != NULL
+          && ((uintptr_t) hash_item - (uintptr_t) hash->old_items
+              < old_count * hash->item_size));
+}
+
+
+static
+void
+migrate_bin(struct cuckoo_hash *hash, uint32_t old)
+{
+  size_t size = hash->bin_size;
+  size_t from = old * size;
+  size_t to = from + ((size_t) size << (hash->power - 1));
+
+  memcpy(hash->table + from, hash->old_table + from,
+         size * sizeof(*hash->table));
+  memcpy(hash->table + to, hash->old_table + from,
+         size * sizeof(*hash->table));
+  memcpy(slot_item(hash, hash->items, from),
+         slot_item(hash, hash->old_items, from), size * hash->item_size);
+  memcpy(slot_item(hash, hash->items, to),
+         slot_item(hash, hash->old_items, from), size * hash->item_size);
+
+  hash->migrated[old / CHAR_BIT] |= 1U << (old % CHAR_BIT);
+  if (--hash->unmigrated == 0)
+    {
+      free_arrays(hash, hash->old_table, hash->old_items,
+                  (size_t) hash->bin_size << (hash->power - 1));
+      mem_free(hash, hash->migrated, migrated_size(hash->power - 1));
+      hash->old_table = NULL;
+      hash->old_items = NULL;
+      hash->migrated = NULL;
+
+      XPROBES_SITE(cuckoo_hash, migrate_done,
+                   (const struct cuckoo_hash *),
+                   (hash));
+    }
+}
+
+
+/*
+  Make sure the bin with the given index is in the new table.
+*/
+static inline
+void
+ensure_migrated(struct cuckoo_hash *hash, uint32_t index)
+{
+  if (hash->old_table)
+    {
+      uint32_t old = old_index(hash, index);
+      if (! bin_migrated(hash, old))
+        migrate_bin(hash, old);
+    }
+}
+
+
+size_t
+cuckoo_hash_migrate(struct cuckoo_hash *hash, size_t bins)
+{
+  while (bins > 0 && hash->old_table)
+    {
+      /* Bins before the cursor are all migrated.  */
+      uint32_t old = hash->migrate_cursor++;
+      if (! bin_migrated(hash, old))
+        {
+          migrate_bin(hash, old);
+          --bins;
+        }
+    }
+
+  return hash->unmigrated;
+}
+
+
+static inline
+void
+finish_migration(struct cuckoo_hash *hash)
+{
+  cuckoo_hash_migrate(hash, SIZE_MAX);
+}
+
+
+static inline
+void
+store(const struct cuckoo_hash *hash, struct _cuckoo_hash_elem *elem,
+      const struct entry *entry)
+{
+  elem->hash1 = entry->hash1;
+  elem->hash2 = entry->hash2;
+  struct cuckoo_hash_item *hash_item = item_at(hash, elem);
+  *hash_item = entry->hash_item;
+
+  size_t key_len = hash_item->key_len;
+  if (key_len <= hash->inline_keys && hash->inline_keys != 0)
+    {
+      unsigned char *copy = inline_key(hash_item);
+      memcpy(copy, hash_item->key, key_len);
+      memset(copy + key_len, 0, hash->inline_keys - key_len);
+    }
+}
+
+
+static inline
+void
+load(const struct cuckoo_hash *hash, const struct _cuckoo_hash_elem *elem,
+     struct entry *entry)
+{
+  entry->hash1 = elem->hash1;
+  entry->hash2 = elem->hash2;
+  entry->hash_item = *item_at(hash, elem);
+}
+
+
+/*
+  The stash holds elements that found no place in the table, until
+  the table grows.  Like table slots, stash slots are empty when
+  hash1 == hash2.  Elements may be stored with their hashes in either
+  order.
+*/
+static
+bool
+stash_put(struct cuckoo_hash *hash, const struct entry *entry)
+{
+  if (hash->stash_count == CUCKOO_HASH_STASH_SIZE)
+    return false;
+
+  for (unsigned int i = 0; i < CUCKOO_HASH_STASH_SIZE; ++i)
+    {
+      struct _cuckoo_hash_stash *slot = &hash->stash[i];
+      if (slot->hash1 == slot->hash2)
+        {
+          stash_write_begin(hash);
+          slot->hash_item = entry->hash_item;
+          slot->hash1 = entry->hash1;
+          slot->hash2 = entry->hash2;
+          ++hash->stash_count;
+          stash_write_end(hash);
+
+          XPROBES_SITE(cuckoo_hash, insert_stash,
+                       (const struct cuckoo_hash *),
+                       (hash));
+
+          return true;
+        }
+    }
+
+  return false;
+}
+
+
+/*
+  Return the index of the stash slot holding hash_item, or -1 if it is
+  not in the stash.
+*/
+static inline
+int
+stash_index(const struct cuckoo_hash *hash,
+            const struct cuckoo_hash_item *hash_item)
+{
+  uintptr_t offset = ((uintptr_t) hash_item
+                      - (uintptr_t) &hash->stash[0].hash_item);
+  if (offset >= sizeof(hash->stash))
+    return -1;
+
+  return offset / sizeof(hash->stash[0]);
+}
+
+
+static inline
+bool
+same_key_hashes(const struct cuckoo_hash *hash, uint32_t s1, uint32_t s2,
+                uint32_t h1, uint32_t h2)
+{
+  if (s1 == h1 && s2 == h2)
+    return true;
+
+  for (unsigned int i = 1; i < hash->choices; ++i)
+    {
+      uint32_t a1, a2;
+      alt_pair(hash->choices, h1, h2, i, &a1, &a2);
+      if (s1 == a1 && s2 == a2)
+        return true;
+    }
+
+  return false;
+}
+
+
+static
+struct cuckoo_hash_item *
+lookup_stash(const struct cuckoo_hash *hash, const void *key, size_t key_len,
+             uint32_t h1, uint32_t h2)
+{
+  for (unsigned int i = 0; i < CUCKOO_HASH_STASH_SIZE; ++i)
+    {
+      const struct _cuckoo_hash_stash *slot = &hash->stash[i];
+      if (slot->hash1 != slot->hash2
+          && same_key_hashes(hash, slot->hash1, slot->hash2, h1, h2)
+          && slot->hash_item.key_len == key_len
+          && memcmp(slot->hash_item.key, key, key_len) == 0)
+        return (struct cuckoo_hash_item *) &slot->hash_item;
+    }
+
+  return NULL;
+}
+
+
+/*
+  Bin scanning.  scan_match() returns the bit mask of those of the
+  first count slots (count <= SCAN_MAX) of the bin that hold the hash
+  pair (h1, h2).  scan_free() returns the bit mask of slots that may
+  be overwritten, i.e., that are either empty (hash1 == hash2), or
+  hold a stale copy left after the table has grown (hash1 doesn't
+  select the bin index).
+
+  Both have a portable scalar implementation, and SSE2/AVX2 ones that
+  compare several slots at once.  The implementation is selected at
+  runtime, once for the whole lookup, so that scanning is inlined into
+  the lookup loop.
+*/
+#define SCAN_MAX  32
+
+
+typedef uint32_t scan_match_func(const struct _cuckoo_hash_elem *bin,
+                                 unsigned int count,
+                                 uint32_t h1, uint32_t h2);
+
+typedef uint32_t scan_free_func(const struct _cuckoo_hash_elem *bin,
+                                unsigned int count,
+                                uint32_t mask, uint32_t index);
+
+
+static inline
+uint32_t
+scan_match_scalar(const struct _cuckoo_hash_elem *bin, unsigned int count,
+                  uint32_t h1, uint32_t h2)
+{
+  uint32_t res = 0;
+  for (unsigned int i = 0; i < count; ++i)
+    {
+      if (bin[i].hash2 == h2 && bin[i].hash1 == h1)
+        res |= 1U << i;
+    }
+
+  return res;
+}
+
+
+static inline
+uint32_t
+scan_free_scalar(const struct _cuckoo_hash_elem *bin, unsigned int count,
+                 uint32_t mask, uint32_t index)
+{
+  uint32_t res = 0;
+  for (unsigned int i = 0; i < count; ++i)
+    {
+      if (bin[i].hash1 == bin[i].hash2 || (bin[i].hash1 & mask) != index)
+        res |= 1U << i;
+    }
+
+  return res;
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+/*
+  Slot hashes are loaded as 64-bit lanes with hash1 in the lower half.
+  The result of a 32-bit comparison is moved to the upper half of the
+  lane, where _mm_movemask_pd() picks it up, one bit per slot.
+*/
+
+__attribute__((__target__("sse2")))
+static inline
+uint32_t
+scan_match_sse2(const struct _cuckoo_hash_elem *bin, unsigned int count,
+                uint32_t h1, uint32_t h2)
+{
+  const __m128i pair = _mm_set_epi32(h2, h1, h2, h1);
+
+  uint32_t res = 0;
+  unsigned int i = 0;
+  for (; i + 2 <= count; i += 2)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *) (bin + i));
+      __m128i eq = _mm_cmpeq_epi32(v, pair);
+      eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+      res |= (uint32_t) _mm_movemask_pd(_mm_castsi128_pd(eq)) << i;
+    }
+  if (i < count)
+    res |= scan_match_scalar(bin + i, count - i, h1, h2) << i;
+
+  return res;
+}
+
+
+__attribute__((__target__("sse2")))
+static inline
+uint32_t
+scan_free_sse2(const struct _cuckoo_hash_elem *bin, unsigned int count,
+               uint32_t mask, uint32_t index)
+{
+  const __m128i m = _mm_set1_epi32(mask);
+  const __m128i idx = _mm_set1_epi32(index);
+
+  uint32_t res = 0;
+  unsigned int i = 0;
+  for (; i + 2 <= count; i += 2)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *) (bin + i));
+      __m128i empty =
+        _mm_cmpeq_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+      __m128i valid = _mm_cmpeq_epi32(_mm_and_si128(v, m), idx);
+      __m128i used = _mm_andnot_si128(empty, valid);
+      used = _mm_shuffle_epi32(used, _MM_SHUFFLE(2, 2, 0, 0));
+      res |= (~(uint32_t) _mm_movemask_pd(_mm_castsi128_pd(used)) & 0x3) << i;
+    }
+  if (i < count)
+    res |= scan_free_scalar(bin + i, count - i, mask, index) << i;
+
+  return res;
+}
+
+
+__attribute__((__target__("avx2")))
+static inline
+uint32_t
+scan_match_avx2(const struct _cuckoo_hash_elem *bin, unsigned int count,
+                uint32_t h1, uint32_t h2)
+{
+  const __m256i pair =
+    _mm256_set1_epi64x((int64_t) (((uint64_t) h2 << 32) | h1));
+
+  uint32_t res = 0;
+  unsigned int i = 0;
+  for (; i + 4 <= count; i += 4)
+    {
+      __m256i v = _mm256_loadu_si256((const __m256i *) (bin + i));
+      __m256i eq = _mm256_cmpeq_epi64(v, pair);
+      res |= (uint32_t) _mm256_movemask_pd(_mm256_castsi256_pd(eq)) << i;
+    }
+  if (i < count)
+    res |= scan_match_scalar(bin + i, count - i, h1, h2) << i;
+
+  return res;
+}
+
+
+__attribute__((__target__("avx2")))
+static inline
+uint32_t
+scan_free_avx2(const struct _cuckoo_hash_elem *bin, unsigned int count,
+               uint32_t mask, uint32_t index)
+{
+  const __m256i m = _mm256_set1_epi32(mask);
+  const __m256i idx = _mm256_set1_epi32(index);
+
+  uint32_t res = 0;
+  unsigned int i = 0;
+  for (; i + 4 <= count; i += 4)
+    {
+      __m256i v = _mm256_loadu_si256((const __m256i *) (bin + i));
+      __m256i empty =
+        _mm256_cmpeq_epi32(v,
+                           _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+      __m256i valid = _mm256_cmpeq_epi32(_mm256_and_si256(v, m), idx);
+      __m256i used = _mm256_andnot_si256(empty, valid);
+      used = _mm256_shuffle_epi32(used, _MM_SHUFFLE(2, 2, 0, 0));
+      res |= ((~(uint32_t) _mm256_movemask_pd(_mm256_castsi256_pd(used))
+               & 0xf) << i);
+    }
+  if (i < count)
+    res |= scan_free_scalar(bin + i, count - i, mask, index) << i;
+
+  return res;
+}
+
+#endif  /* HAVE_X86_SIMD */
+
+
+/*
+  Return the item of the bin holding the key with hash pair (h1, h2),
+  or NULL.  items are the items of the bin slots.
+*/
+static inline __attribute__((__always_inline__))
+struct cuckoo_hash_item *
+lookup_bin(const struct cuckoo_hash *hash, struct _cuckoo_hash_elem *bin,
+           struct cuckoo_hash_item *items,
+           const void *key, size_t key_len, uint32_t h1, uint32_t h2,
+           scan_match_func *scan_match)
+{
+  for (unsigned int base = 0; base < hash->bin_size; base += SCAN_MAX)
+    {
+      unsigned int count = hash->bin_size - base;
+      if (count > SCAN_MAX)
+        count = SCAN_MAX;
+
+      uint32_t match = scan_match(bin + base, count, h1, h2);
+      while (match != 0)
+        {
+          struct cuckoo_hash_item *hash_item =
+            slot_item(hash, items, base + (ffs(match) - 1));
+          if (hash_item->key_len == key_len
+              && (key_len <= hash->inline_keys
+                  ? inline_key_equal(inline_key(hash_item), key, key_len)
+                  : memcmp(hash_item->key, key, key_len) == 0))
+            return hash_item;
+
+          match &= match - 1;
+        }
+    }
+
+  return NULL;
+}
+
+
+/*
+  Return the first slot of the bin with the given index that may be
+  overwritten, or NULL if the bin is full.
+*/
+static inline __attribute__((__always_inline__))
+struct _cuckoo_hash_elem *
+free_slot(const struct cuckoo_hash *hash, uint32_t index, uint32_t mask,
+          scan_free_func *scan_free)
+{
+  struct _cuckoo_hash_elem *bin = bin_at(hash, index);
+  for (unsigned int base = 0; base < hash->bin_size; base += SCAN_MAX)
+    {
+      unsigned int count = hash->bin_size - base;
+      if (count > SCAN_MAX)
+        count = SCAN_MAX;
+
+      uint32_t avail = scan_free(bin + base, count, mask, index);
+      if (avail != 0)
+        return bin + base + (ffs(avail) - 1);
+    }
+
+  return NULL;
+}
+
+
+static inline __attribute__((__always_inline__))
+struct cuckoo_hash_item *
+lookup_with(const struct cuckoo_hash *hash, const void *key, size_t key_len,
+            uint32_t h1, uint32_t h2, scan_match_func *scan_match)
+{
+  uint32_t mask = (1U << hash->power) - 1;
+  unsigned int choices = hash->choices;
+
+  struct _cuckoo_hash_elem *bin;
+  struct cuckoo_hash_item *items, *hash_item;
+
+  bin = locate_bin(hash, (h1 & mask), &items);
+  hash_item = lookup_bin(hash, bin, items, key, key_len, h1, h2, scan_match);
+  if (hash_item)
+    {
+      XPROBES_SITE(cuckoo_hash, lookup_hash1,
+                   (const struct cuckoo_hash *, int),
+                   (hash, slot_pos(hash, items, hash_item)));
+
+      return hash_item;
+    }
+
+  for (unsigned int i = 1; i < choices; ++i)
+    {
+      uint32_t a1, a2;
+      alt_pair(choices, h1, h2, i, &a1, &a2);
+      bin = locate_bin(hash, (a1 & mask), &items);
+      hash_item = lookup_bin(hash, bin, items, key, key_len, a1, a2,
+                             scan_match);
+      if (hash_item)
+        {
+          XPROBES_SITE(cuckoo_hash, lookup_hash2,
+                       (const struct cuckoo_hash *, int),
+                       (hash, (i * hash->bin_size
+                               + slot_pos(hash, items, hash_item))));
+
+          return hash_item;
+        }
+    }
+
+  if (__builtin_expect(hash->stash_count != 0, 0))
+    {
+      hash_item = lookup_stash(hash, key, key_len, h1, h2);
+      if (hash_item)
+        return hash_item;
+    }
+
+  XPROBES_SITE(cuckoo_hash, lookup_not_found,
+               (const struct cuckoo_hash *, int),
+               (hash, hash->choices * hash->bin_size));
+
+  return NULL;
+}
+
+
+typedef struct cuckoo_hash_item *
+lookup_func(const struct cuckoo_hash *hash, const void *key, size_t key_len,
+            uint32_t h1, uint32_t h2);
+
+
+static
+struct cuckoo_hash_item *
+lookup_scalar(const struct cuckoo_hash *hash, const void *key, size_t key_len,
+              uint32_t h1, uint32_t h2)
+{
+  return lookup_with(hash, key, key_len, h1, h2, scan_match_scalar);
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((__target__("sse2")))
+static
+struct cuckoo_hash_item *
+lookup_sse2(const struct cuckoo_hash *hash, const void *key, size_t key_len,
+            uint32_t h1, uint32_t h2)
+{
+  return lookup_with(hash, key, key_len, h1, h2, scan_match_sse2);
+}
+
+
+__attribute__((__target__("avx2")))
+static
+struct cuckoo_hash_item *
+lookup_avx2(const struct cuckoo_hash *hash, const void *key, size_t key_len,
+            uint32_t h1, uint32_t h2)
+{
+  return lookup_with(hash, key, key_len, h1, h2, scan_match_avx2);
+}
+
+#endif  /* HAVE_X86_SIMD */
+
+
+static lookup_func *lookup = lookup_scalar;
+static scan_free_func *scan_free = scan_free_scalar;
+
+
+#ifdef HAVE_X86_SIMD
+
+static __attribute__((__constructor__))
+void
+select_scan(void)
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    {
+      lookup = lookup_avx2;
+      scan_free = scan_free_avx2;
+    }
+  else if (__builtin_cpu_supports("sse2"))
+    {
+      lookup = lookup_sse2;
+      scan_free = scan_free_sse2;
+    }
+}
+
+#endif  /* HAVE_X86_SIMD */
+
+
+struct cuckoo_hash_item *
+cuckoo_hash_lookup(const struct cuckoo_hash *hash,
+                   const void *key, size_t key_len)
+{
+  uint32_t h1, h2;
+  compute_hash(hash, key, key_len, &h1, &h2);
+
+  return lookup(hash, key, key_len, h1, h2);
+}
+
+
+struct cuckoo_hash_hashval
+cuckoo_hash_hash(const struct cuckoo_hash *hash,
+                 const void *key, size_t key_len)
+{
+  struct cuckoo_hash_hashval hashval;
+  compute_hash(hash, key, key_len, &hashval._h1, &hashval._h2);
+  hashval._seed = hash->seed1;
+
+  return hashval;
+}
+
+
+/*
+  Get hashes from the hash value, unless the hash was reseeded since
+  the value was computed, in which case hash the key again.
+*/
+static inline
+void
+hashval_get(const struct cuckoo_hash *hash, const void *key, size_t key_len,
+            const struct cuckoo_hash_hashval *hashval,
+            uint32_t *h1, uint32_t *h2)
+{
+  if (hashval->_seed == hash->seed1)
+    {
+      *h1 = hashval->_h1;
+      *h2 = hashval->_h2;
+    }
+  else
+    {
+      compute_hash(hash, key, key_len, h1, h2);
+    }
+}
+
+
+struct cuckoo_hash_item *
+cuckoo_hash_lookup_hashed(const struct cuckoo_hash *hash,
+                          const void *key, size_t key_len,
+                          struct cuckoo_hash_hashval hashval)
+{
+  uint32_t h1, h2;
+  hashval_get(hash, key, key_len, &hashval, &h1, &h2);
+
+  return lookup(hash, key, key_len, h1, h2);
+}
+
+
+static inline
+void
+prefetch_bins(const struct cuckoo_hash *hash, uint32_t h1, uint32_t h2)
+{
+  uint32_t mask = (1U << hash->power) - 1;
+  struct cuckoo_hash_item *items;
+
+  __builtin_prefetch(locate_bin(hash, (h1 & mask), &items));
+  for (unsigned int i = 1; i < hash->choices; ++i)
+    {
+      uint32_t a1, a2;
+      alt_pair(hash->choices, h1, h2, i, &a1, &a2);
+      __builtin_prefetch(locate_bin(hash, (a1 & mask), &items));
+    }
+}
+
+
+/*
+  Prefetch items that the hashes in the bin say may hold the key.
+  Bins are expected to be in the cache already.
+*/
+static inline
+void
+prefetch_items(const struct cuckoo_hash *hash, uint32_t h1, uint32_t h2)
+{
+  uint32_t mask = (1U << hash->power) - 1;
+  struct cuckoo_hash_item *items;
+
+  struct _cuckoo_hash_elem *elem = locate_bin(hash, (h1 & mask), &items);
+  for (unsigned int i = 0; i < hash->bin_size; ++i)
+    {
+      if (elem[i].hash2 == h2 && elem[i].hash1 == h1)
+        __builtin_prefetch(slot_item(hash, items, i));
+    }
+
+  for (unsigned int j = 1; j < hash->choices; ++j)
+    {
+      uint32_t a1, a2;
+      alt_pair(hash->choices, h1, h2, j, &a1, &a2);
+      elem = locate_bin(hash, (a1 & mask), &items);
+      for (unsigned int i = 0; i < hash->bin_size; ++i)
+        {
+          if (elem[i].hash2 == a2 && elem[i].hash1 == a1)
+            __builtin_prefetch(slot_item(hash, items, i));
+        }
+    }
+}
+
+
+void
+cuckoo_hash_prefetch_hashed(const struct cuckoo_hash *hash,
+                            struct cuckoo_hash_hashval hashval)
+{
+  /* Prefetching with a stale hash value is merely useless.  */
+  prefetch_bins(hash, hashval._h1, hashval._h2);
+}
+
+
+/*
+  Number of keys that cuckoo_hash_lookup_batch() has in flight.  It
+  should be large enough to cover memory latency, but the lines it
+  prefetches should still fit into L1.
+*/
+#define BATCH_GROUP  16
+
+
+size_t
+cuckoo_hash_lookup_batch(const struct cuckoo_hash *hash,
+                         const void *const keys[], const size_t key_lens[],
+                         size_t n, struct cuckoo_hash_item *items[])
+{
+  uint32_t h1[BATCH_GROUP], h2[BATCH_GROUP];
+  size_t found = 0;
+
+  for (size_t beg = 0; beg < n; beg += BATCH_GROUP)
+    {
+      size_t count = n - beg;
+      if (count > BATCH_GROUP)
+        count = BATCH_GROUP;
+
+      /* Keys of the next group are hashed on the next iteration.  */
+      for (size_t i = beg + count; i < n && i < beg + 2 * count; ++i)
+        __builtin_prefetch(keys[i]);
+
+      for (size_t i = 0; i < count; ++i)
+        {
+          compute_hash(hash, keys[beg + i], key_lens[beg + i],
+                       &h1[i], &h2[i]);
+          prefetch_bins(hash, h1[i], h2[i]);
+        }
+
+      for (size_t i = 0; i < count; ++i)
+        prefetch_items(hash, h1[i], h2[i]);
+
+      for (size_t i = 0; i < count; ++i)
+        {
+          items[beg + i] = lookup(hash, keys[beg + i], key_lens[beg + i],
+                                  h1[i], h2[i]);
+          if (items[beg + i])
+            ++found;
+        }
+    }
+
+  return found;
+}
+
+
+/*
+  Copy the slot item to *copy, unless the key has to be followed
+  through the pointer and the slot has changed since the version was
+  seen, as the pointer may not go with key_len then.  Return true if
+  the copy has the key.
+*/
+static inline
+bool
+copy_shared(const struct cuckoo_hash *view,
+            const struct cuckoo_hash_item *hash_item,
+            const uint32_t *version, uint32_t seen,
+            const void *key, size_t key_len, struct cuckoo_hash_item *copy)
+{
+  *copy = *hash_item;
+  /* Don't let the compiler read the slot again instead of the copy.  */
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  if (copy->key_len != key_len)
+    return false;
+
+  if (key_len <= view->inline_keys)
+    return inline_key_equal(inline_key(hash_item), key, key_len);
+
+  return (read_valid(version, seen)
+          && memcmp(copy->key, key, key_len) == 0);
+}
+
+
+/*
+  Copy the fields of the concurrent hash that change when the table is
+  replaced to *view, together with those needed to hash keys and to
+  search the table, and store the table version they go with to
+  *seen.  Return false if the table was being replaced meanwhile.
+*/
+static inline
+bool
+read_view(const struct cuckoo_hash *hash, struct cuckoo_hash *view,
+          uint32_t *seen)
+{
+  const uint32_t *version = &hash->sync->table_version;
+  *seen = read_begin(version);
+  if (*seen & 1)
+    return false;
+
+  view->table = hash->table;
+  view->items = hash->items;
+  view->hash_function = hash->hash_function;
+  view->seed1 = hash->seed1;
+  view->seed2 = hash->seed2;
+  view->old_table = NULL;
+  view->stash_count = hash->stash_count;
+  view->growth = hash->growth;
+  view->inline_keys = hash->inline_keys;
+  view->item_size = hash->item_size;
+  view->bin_size = hash->bin_size;
+  view->choices = hash->choices;
+  view->power = hash->power;
+
+  return read_valid(version, *seen);
+}
+
+
+/*
+  Store the bin indexes of the key with the pair (h1, h2) to bins, and
+  the pairs it has in them to pairs.
+*/
+static inline
+void
+key_bins(const struct cuckoo_hash *hash, uint32_t h1, uint32_t h2,
+         uint32_t bins[4], uint32_t pairs[4][2])
+{
+  uint32_t mask = (1U << hash->power) - 1;
+  for (unsigned int i = 0; i < hash->choices; ++i)
+    {
+      pairs[i][0] = h1;
+      pairs[i][1] = h2;
+      if (i > 0)
+        alt_pair(hash->choices, h1, h2, i, &pairs[i][0], &pairs[i][1]);
+      bins[i] = pairs[i][0] & mask;
+    }
+}
+
+
+/*
+  Make one attempt at cuckoo_hash_lookup_shared().  Return 1 if the
+  key is found, 0 if it is not, and -1 if the table has changed while
+  being read.
+*/
+static
+int
+try_lookup_shared(const struct cuckoo_hash *hash,
+                  const void *key, size_t key_len,
+                  struct cuckoo_hash_item *hash_item)
+{
+  struct _cuckoo_hash_sync *sync = hash->sync;
+  struct cuckoo_hash view;
+  uint32_t table_seen;
+  uint32_t stash_seen = read_begin(&sync->stash_version);
+  if ((stash_seen & 1) || ! read_view(hash, &view, &table_seen))
+    return -1;
+
+  uint32_t h1, h2;
+  compute_hash(&view, key, key_len, &h1, &h2);
+
+  /*
+    All bins are checked against their versions at the end, as an
+    element may move from a bin that hasn't been scanned yet to one
+    that has.
+  */
+  uint32_t bins[4], pairs[4][2], *versions[4], seen[4];
+  key_bins(&view, h1, h2, bins, pairs);
+  for (unsigned int i = 0; i < view.choices; ++i)
+    {
+      versions[i] = bin_version(sync, bins[i]);
+      seen[i] = read_begin(versions[i]);
+      if (seen[i] & 1)
+        return -1;
+    }
+
+  int found = 0;
+  for (unsigned int i = 0; i < view.choices && ! found; ++i)
+    {
+      size_t pos = (size_t) bins[i] * view.bin_size;
+      const struct _cuckoo_hash_elem *bin = view.table + pos;
+      for (unsigned int j = 0; j < view.bin_size && ! found; ++j)
+        {
+          if (bin[j].hash1 == pairs[i][0] && bin[j].hash2 == pairs[i][1]
+              && copy_shared(&view, slot_item(&view, view.items, pos + j),
+                             versions[i], seen[i], key, key_len, hash_item))
+            found = 1;
+        }
+    }
+
+  if (! found && view.stash_count != 0)
+    {
+      for (unsigned int i = 0; i < CUCKOO_HASH_STASH_SIZE && ! found; ++i)
+        {
+          const struct _cuckoo_hash_stash *slot = &hash->stash[i];
+          uint32_t s1 = slot->hash1, s2 = slot->hash2;
+          if (s1 == s2 || ! same_key_hashes(&view, s1, s2, h1, h2))
+            continue;
+
+          /* Stashed keys are compared through the pointer.  */
+          *hash_item = slot->hash_item;
+          __atomic_signal_fence(__ATOMIC_SEQ_CST);
+          if (hash_item->key_len == key_len
+              && read_valid(&sync->stash_version, stash_seen)
+              && memcmp(hash_item->key, key, key_len) == 0)
+            found = 1;
+        }
+    }
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  for (unsigned int i = 0; i < view.choices; ++i)
+    {
+      if (__atomic_load_n(versions[i], __ATOMIC_RELAXED) != seen[i])
+        return -1;
+    }
+  if (__atomic_load_n(&sync->stash_version, __ATOMIC_RELAXED) != stash_seen
+      || (__atomic_load_n(&sync->table_version, __ATOMIC_RELAXED)
+          != table_seen))
+    return -1;
+
+  return found;
+}
+
+
+bool
+cuckoo_hash_lookup_shared(const struct cuckoo_hash *hash,
+                          struct cuckoo_hash_reader *reader,
+                          const void *key, size_t key_len,
+                          struct cuckoo_hash_item *hash_item)
+{
+  struct _cuckoo_hash_sync *sync = hash->sync;
+  if (! sync)
+    {
+      struct cuckoo_hash_item *res = cuckoo_hash_lookup(hash, key, key_len);
+      if (res)
+        *hash_item = *res;
+
+      return (res != NULL);
+    }
+
+  reader_enter(sync, reader);
+
+  int found;
+  for (unsigned int tries = 1;
+       (found = try_lookup_shared(hash, key, key_len, hash_item)) < 0;
+       ++tries)
+    {
+      if (tries % READ_SPINS == 0)
+        sched_yield();
+    }
+
+  reader_exit(reader);
+
+  return found;
+}
+
+
+void
+cuckoo_hash_remove(struct cuckoo_hash *hash,
+                   const struct cuckoo_hash_item *hash_item)
+{
+  if (hash_item)
+    {
+      if (hash->arena)
+        arena_free(hash, hash_item->key, hash_item->key_len);
+
+      int i = stash_index(hash, hash_item);
+      if (i >= 0)
+        {
+          stash_write_begin(hash);
+          hash->stash[i].hash1 = hash->stash[i].hash2 = 0;
+          --hash->stash_count;
+          stash_write_end(hash);
+        }
+      else if (in_old_items(hash, hash_item))
+        {
+          struct _cuckoo_hash_elem *elem =
+            hash->old_table + slot_pos(hash, hash->old_items, hash_item);
+          elem->hash1 = elem->hash2 = 0;
+        }
+      else
+        {
+          struct _cuckoo_hash_elem *elem =
+            hash->table + slot_pos(hash, hash->items, hash_item);
+          slot_write_begin(hash, elem);
+          elem->hash1 = elem->hash2 = 0;
+          slot_write_end(hash, elem);
+        }
+      --hash->count;
+
+      /*
+        The item stays valid until the next insert, so shrinking is
+        left to it.
+      */
+      if (hash->count
+          < hash->shrink_load * ((size_t) hash->bin_size << hash->power))
+        hash->shrink_pending = true;
+
+      XPROBES_SITE(cuckoo_hash, remove,
+                   (const struct cuckoo_hash *),
+                   (hash));
+    }
+}
+
+
+/*
+  Start incremental growth: allocate the new table, and keep the
+  current one as the old table until all of its bins are migrated.
+*/
+static
+bool
+grow_table_incremental(struct cuckoo_hash *hash)
+{
+  finish_migration(hash);
+
+  size_t count = (size_t) hash->bin_size << hash->power;
+  uint32_t bin_count = 1U << hash->power;
+
+  struct _cuckoo_hash_elem *table =
+    table_alloc(hash, count * 2 * sizeof(*hash->table));
+  struct cuckoo_hash_item *items =
+    table_alloc(hash, count * 2 * hash->item_size);
+  unsigned char *migrated = mem_alloc(hash, migrated_size(hash->power));
+  if (! table || ! items || ! migrated)
+    {
+      free_arrays(hash, table, items, count * 2);
+      mem_free(hash, migrated, migrated_size(hash->power));
+      return false;
+    }
+  memset(migrated, 0, migrated_size(hash->power));
+
+  hash->old_table = hash->table;
+  hash->old_items = hash->items;
+  hash->migrated = migrated;
+  hash->unmigrated = bin_count;
+  hash->migrate_cursor = 0;
+  hash->table = table;
+  hash->items = items;
+  ++hash->power;
+
+  return true;
+}
+
+
+/*
+  Grow the table to 2^power bins by replicating it.  Every element
+  then is in its bin in exactly one of the copies, and the other
+  copies are stale.
+*/
+static
+bool
+grow_table_copy(struct cuckoo_hash *hash, unsigned char power);
+
+
+static
+bool
+grow_table_to(struct cuckoo_hash *hash, unsigned char power)
+{
+  if (hash->sync)
+    return grow_table_copy(hash, power);
+
+  size_t count = (size_t) hash->bin_size << hash->power;
+  size_t new_count = (size_t) hash->bin_size << power;
+
+  struct cuckoo_hash_item *items =
+    table_resize(hash, hash->items, count * hash->item_size,
+                 new_count * hash->item_size);
+  if (! items)
+    return false;
+
+  hash->items = items;
+
+  struct _cuckoo_hash_elem *table =
+    table_resize(hash, hash->table, count * sizeof(*hash->table),
+                 new_count * sizeof(*hash->table));
+  if (! table)
+    {
+      /*
+        Shrink items back so that their size matches the table again.
+        Shrinking a mapping doesn't fail, and should shrinking a
+        malloc()ed block fail, its larger size is harmless.
+      */
+      items = table_resize(hash, hash->items,
+                           new_count * hash->item_size,
+                           count * hash->item_size);
+      if (items)
+        hash->items = items;
+
+      return false;
+    }
+
+  hash->table = table;
+  for (size_t i = count; i < new_count; i += count)
+    {
+      memcpy(table + i, table, count * sizeof(*hash->table));
+      memcpy(slot_item(hash, items, i), items, count * hash->item_size);
+    }
+  hash->power = power;
+
+  return true;
+}
+
+
+/*
+  Same as grow_table_to() for concurrent tables.  Readers may still
+  read the table, so the new one is a copy, which is published at
+  once, and the old one is retired.
+*/
+static
+bool
+grow_table_copy(struct cuckoo_hash *hash, unsigned char power)
+{
+  size_t count = (size_t) hash->bin_size << hash->power;
+  size_t new_count = (size_t) hash->bin_size << power;
+
+  struct _cuckoo_hash_elem *table =
+    table_alloc(hash, new_count * sizeof(*hash->table));
+  struct cuckoo_hash_item *items =
+    table_alloc(hash, new_count * hash->item_size);
+  if (! table || ! items)
+    {
+      free_arrays(hash, table, items, new_count);
+      return false;
+    }
+
+  for (size_t i = 0; i < new_count; i += count)
+    {
+      memcpy(table + i, hash->table, count * sizeof(*hash->table));
+      memcpy(slot_item(hash, items, i), hash->items,
+             count * hash->item_size);
+    }
+
+  struct _cuckoo_hash_elem *old_table = hash->table;
+  struct cuckoo_hash_item *old_items = hash->items;
+
+  write_begin(&hash->sync->table_version);
+  hash->table = table;
+  hash->items = items;
+  hash->power = power;
+  write_end(&hash->sync->table_version);
+
+  retire_arrays(hash, old_table, old_items, count);
+
+  return true;
+}
+
+
+static
+bool
+grow_table(struct cuckoo_hash *hash)
+{
+  if (hash->migrate_step > 0)
+    return grow_table_incremental(hash);
+
+  unsigned char power = hash->power + __builtin_ctz(hash->growth.factor);
+  if (power > MAX_POWER)
+    return false;
+
+  return grow_table_to(hash, power);
+}
+
+
+static inline
+bool
+insert(struct cuckoo_hash *hash, struct entry *item, bool may_reseed);
+
+
+/*
+  Rehash all elements and the element in flight with a new seed into a
+  fresh table of the same size.  Elements are placed with insert(),
+  which may grow the fresh table should the new seed be no better.
+  On failure the hash is left intact.
+*/
+static
+bool
+reseed(struct cuckoo_hash *hash, struct entry *item)
+{
+  finish_migration(hash);
+
+  struct cuckoo_hash fresh = *hash;
+  new_seed(&fresh);
+  fresh.migrate_step = 0;
+  fresh.sync = NULL;
+  clear_stash(&fresh);
+  if (! alloc_table(&fresh))
+    return false;
+
+  for (struct cuckoo_hash_item *it = cuckoo_hash_next(hash, NULL);
+       it != NULL;
+       it = cuckoo_hash_next(hash, it))
+    {
+      struct entry entry = { .hash_item = *it };
+      compute_hash(&fresh, it->key, it->key_len,
+                   &entry.hash1, &entry.hash2);
+      if (! insert(&fresh, &entry, false))
+        goto fail;
+    }
+
+  compute_hash(&fresh, item->hash_item.key, item->hash_item.key_len,
+               &item->hash1, &item->hash2);
+  if (! insert(&fresh, item, false))
+    goto fail;
+
+  fresh.migrate_step = hash->migrate_step;
+  replace_tables(hash, &fresh);
+
+  XPROBES_SITE(cuckoo_hash, insert_reseed,
+               (const struct cuckoo_hash *),
+               (hash));
+
+  return true;
+
+fail:
+  free_tables(&fresh);
+
+  return false;
+}
+
+
+/*
+  Load factor below which failure to insert is attributed to bad luck
+  with the seed (or to keys crafted against it) rather than to the
+  table being full, and is handled by reseeding instead of growing.
+*/
+#define RESEED_LOAD_FACTOR  0.5
+
+
+static
+bool
+try_reseed(struct cuckoo_hash *hash, struct entry *item)
+{
+  if (hash->count
+      >= RESEED_LOAD_FACTOR * ((size_t) hash->bin_size << hash->power))
+    return false;
+
+  /* reseed() rehashes the item, restore it should reseeding fail.  */
+  struct entry saved = *item;
+  if (reseed(hash, item))
+    return true;
+
+  *item = saved;
+
+  return false;
+}
+
+
+/*
+  Insertion searches breadth-first for the shortest chain of moves
+  that frees a slot in one of the item's bins, and only then moves the
+  elements along it, last one first.  Every visited bin is a node,
+  its children are the alternative bins of the elements in it.  The
+  search is bounded by INSERT_MAX_NODES visited bins, which with bins
+  of four slots and two choices covers all chains of up to four moves,
+  and by max_depth of the growth policy.
+*/
+#define INSERT_MAX_NODES  1024
+
+
+struct bfs_node
+{
+  uint32_t bin;
+  /* Index of the parent node, or -1 for the item's own bins.  */
+  int parent;
+  /* Number of moves to this bin.  */
+  unsigned int depth;
+  /* Slot of the parent bin whose element moves to this bin.  */
+  unsigned int slot;
+  /*
+    Alternative of that element (or of the item, for its own bins)
+    that selects this bin, see alt_pair().
+  */
+  unsigned int choice;
+};
+
+
+static inline
+bool
+on_path(const struct bfs_node *nodes, int node, uint32_t bin)
+{
+  for (; node >= 0; node = nodes[node].parent)
+    {
+      if (nodes[node].bin == bin)
+        return true;
+    }
+
+  return false;
+}
+
+
+/*
+  Add the alternative bins of the elements of the bin of node i as
+  its children, and return the new node count.  The bin has no free
+  slots, so every element in it belongs there, and its pair gives the
+  alternative bins.
+*/
+static inline __attribute__((__always_inline__))
+size_t
+add_children(const struct cuckoo_hash *hash, struct bfs_node *nodes,
+             size_t i, size_t count, size_t max_nodes, uint32_t mask,
+             unsigned int choices)
+{
+  struct _cuckoo_hash_elem *beg = bin_at(hash, nodes[i].bin);
+  for (unsigned int j = 0; j < hash->bin_size && count < max_nodes; ++j)
+    {
+      for (unsigned int c = 1; c < choices && count < max_nodes; ++c)
+        {
+          uint32_t a1, a2;
+          alt_pair(choices, beg[j].hash1, beg[j].hash2, c, &a1, &a2);
+          uint32_t alt = a1 & mask;
+          if (on_path(nodes, i, alt))
+            continue;
+
+          __builtin_prefetch(bin_at(hash, alt));
+          nodes[count++] = (struct bfs_node) {
+            .bin = alt, .parent = i, .depth = nodes[i].depth + 1,
+            .slot = j, .choice = c
+          };
+        }
+    }
+
+  return count;
+}
+
+
+/*
+  Return the index of the node where the search found a free slot,
+  stored to *free_elem, or -1 if there's none within max_nodes.
+*/
+static
+int
+find_path(struct cuckoo_hash *hash, const struct entry *item,
+          struct bfs_node *nodes, size_t max_nodes,
+          struct _cuckoo_hash_elem **free_elem)
+{
+  uint32_t mask = (1U << hash->power) - 1;
+  unsigned int choices = hash->choices;
+  unsigned int max_depth = hash->growth.max_depth;
+  size_t count = 0;
+
+  for (unsigned int c = 0; c < choices; ++c)
+    {
+      uint32_t a1 = item->hash1, a2 = item->hash2;
+      if (c > 0)
+        alt_pair(choices, item->hash1, item->hash2, c, &a1, &a2);
+
+      size_t i = 0;
+      while (i < count && nodes[i].bin != (a1 & mask))
+        ++i;
+      if (i == count)
+        nodes[count++] = (struct bfs_node) {
+          .bin = a1 & mask, .parent = -1, .choice = c
+        };
+    }
+
+  for (size_t i = 0; i < count; ++i)
+    {
+      uint32_t bin = nodes[i].bin;
+      ensure_migrated(hash, bin);
+
+      struct _cuckoo_hash_elem *elem = free_slot(hash, bin, mask, scan_free);
+      if (elem)
+        {
+          *free_elem = elem;
+          return i;
+        }
+
+      if (max_depth != 0 && nodes[i].depth == max_depth)
+        continue;
+
+      /* Two choices are common enough to have the loop unrolled.  */
+      if (choices == 2)
+        count = add_children(hash, nodes, i, count, max_nodes, mask, 2);
+      else
+        count = add_children(hash, nodes, i, count, max_nodes, mask,
+                             choices);
+    }
+
+  return -1;
+}
+
+
+/*
+  Move elements along the path ending at node into the free slot elem
+  one by one, and put the item into the slot freed in its own bin.
+*/
+static
+void
+move_along(struct cuckoo_hash *hash, struct entry *item,
+           const struct bfs_node *nodes, int node,
+           struct _cuckoo_hash_elem *elem)
+{
+  for (; nodes[node].parent >= 0; node = nodes[node].parent)
+    {
+      struct _cuckoo_hash_elem *from =
+        bin_at(hash, nodes[nodes[node].parent].bin) + nodes[node].slot;
+
+      /* Copy the whole slot, so that the key isn't read again.  */
+      slot_write_begin(hash, elem);
+      alt_pair(hash->choices, from->hash1, from->hash2, nodes[node].choice,
+               &elem->hash1, &elem->hash2);
+      memcpy(item_at(hash, elem), item_at(hash, from), hash->item_size);
+      slot_write_end(hash, elem);
+
+      elem = from;
+    }
+
+  if (nodes[node].choice != 0)
+    alt_pair(hash->choices, item->hash1, item->hash2, nodes[node].choice,
+             &item->hash1, &item->hash2);
+  slot_write_begin(hash, elem);
+  store(hash, elem, item);
+  slot_write_end(hash, elem);
+}
+
+
+/*
+  Put the item into the table if there's a path to a free slot.
+  phase is passed to the probe.
+*/
+static
+bool
+place(struct cuckoo_hash *hash, struct entry *item,
+      int phase __attribute__((__unused__)))
+{
+  struct bfs_node nodes[INSERT_MAX_NODES];
+
+  size_t max_nodes = (size_t) hash->bin_size << hash->power;
+  if (max_nodes > INSERT_MAX_NODES)
+    max_nodes = INSERT_MAX_NODES;
+
+  struct _cuckoo_hash_elem *elem;
+  int node = find_path(hash, item, nodes, max_nodes, &elem);
+  if (node < 0)
+    return false;
+
+  XPROBES_SITE(cuckoo_hash, insert_done,
+               (const struct cuckoo_hash *,
+                int, size_t, size_t),
+               (hash, phase, nodes[node].depth, max_nodes));
+
+  move_along(hash, item, nodes, node, elem);
+
+  return true;
+}
+
+
+/*
+  Move stashed elements into the table, e.g., after it has grown.
+*/
+static
+void
+drain_stash(struct cuckoo_hash *hash)
+{
+  for (unsigned int i = 0;
+       i < CUCKOO_HASH_STASH_SIZE && hash->stash_count != 0;
+       ++i)
+    {
+      struct _cuckoo_hash_stash *slot = &hash->stash[i];
+      if (slot->hash1 == slot->hash2)
+        continue;
+
+      struct entry entry = {
+        .hash_item = slot->hash_item,
+        .hash1 = slot->hash1,
+        .hash2 = slot->hash2
+      };
+      if (place(hash, &entry, 1))
+        {
+          stash_write_begin(hash);
+          slot->hash1 = slot->hash2 = 0;
+          --hash->stash_count;
+          stash_write_end(hash);
+        }
+    }
+}
+
+
+/*
+  Insert the item.  If there's no path to a free slot, the item goes
+  to the stash, and only if the stash is full the table is reseeded or
+  grown.  The table grows at most once, after which the stash is
+  drained.  The table is left intact if the item can't be inserted.
+*/
+static inline
+bool
+insert(struct cuckoo_hash *hash, struct entry *item, bool may_reseed)
+{
+  if (place(hash, item, 0) || stash_put(hash, item))
+    return true;
+
+  if (may_reseed && try_reseed(hash, item))
+    return true;
+
+  if (! grow_table(hash))
+    return false;
+
+  drain_stash(hash);
+
+  return (place(hash, item, 1) || stash_put(hash, item));
+}
+
+
+/*
+  Rebuild the table with 2^power bins of bin_size slots.  Elements are
+  placed with insert() using their stored hashes, so no key is hashed
+  again.  On failure the hash is left intact.
+*/
+static
+bool
+rebuild(struct cuckoo_hash *hash, unsigned char power, unsigned int bin_size)
+{
+  finish_migration(hash);
+
+  struct cuckoo_hash fresh = *hash;
+  fresh.power = power;
+  fresh.bin_size = bin_size;
+  fresh.migrate_step = 0;
+  fresh.sync = NULL;
+  clear_stash(&fresh);
+  if (! alloc_table(&fresh))
+    return false;
+
+  for (struct cuckoo_hash_item *it = cuckoo_hash_next(hash, NULL);
+       it != NULL;
+       it = cuckoo_hash_next(hash, it))
+    {
+      struct entry entry;
+      int i = stash_index(hash, it);
+      if (i >= 0)
+        {
+          entry.hash_item = *it;
+          entry.hash1 = hash->stash[i].hash1;
+          entry.hash2 = hash->stash[i].hash2;
+        }
+      else
+        {
+          load(hash, hash->table + slot_pos(hash, hash->items, it), &entry);
+        }
+
+      if (! insert(&fresh, &entry, false))
+        {
+          free_tables(&fresh);
+          return false;
+        }
+    }
+
+  fresh.migrate_step = hash->migrate_step;
+  replace_tables(hash, &fresh);
+
+  XPROBES_SITE(cuckoo_hash, rebuild,
+               (const struct cuckoo_hash *),
+               (hash));
+
+  return true;
+}
+
+
+/*
+  Load factor a table is shrunk to by the shrink_load option: low
+  enough to take many inserts before growing again.
+*/
+#define SHRINK_TARGET_LOAD  0.5
+
+
+static
+bool
+shrink_to(struct cuckoo_hash *hash, double load)
+{
+  unsigned char power;
+  if (! power_for(hash->count, capped_load(load, &hash->growth),
+                  hash->bin_size, hash->choices, &power))
+    return false;
+
+  if (power >= hash->power)
+    return true;
+
+  if (! rebuild(hash, power, hash->bin_size))
+    return false;
+
+  if (hash->arena)
+    arena_compact(hash);
+
+  return true;
+}
+
+
+bool
+cuckoo_hash_shrink_to_fit(struct cuckoo_hash *hash)
+{
+  hash->shrink_pending = false;
+
+  return shrink_to(hash, 1);
+}
+
+
+bool
+cuckoo_hash_reserve(struct cuckoo_hash *hash, size_t count, double load)
+{
+  unsigned int bin_size = (hash->fixed_bin_size ? hash->bin_size : 0);
+  unsigned char power;
+  load = capped_load(load, &hash->growth);
+  if (! size_for(count, load, hash->choices, &bin_size, &power))
+    return false;
+
+  finish_migration(hash);
+
+  size_t size = (size_t) hash->bin_size << hash->power;
+  if (hash->count == 0)
+    {
+      /* An empty table is simply replaced if it's smaller.  */
+      if (((size_t) bin_size << power) < size
+          || (bin_size == hash->bin_size && power == hash->power))
+        return true;
+
+      struct cuckoo_hash fresh = *hash;
+      fresh.bin_size = bin_size;
+      fresh.power = power;
+      if (! alloc_table(&fresh))
+        return false;
+
+      replace_tables(hash, &fresh);
+
+      return true;
+    }
+
+  /* Otherwise only its power grows, the bin size stays.  */
+  if (! power_for(count, load, hash->bin_size, hash->choices, &power))
+    return false;
+  if (power <= hash->power)
+    return true;
+
+  if (! grow_table_to(hash, power))
+    return false;
+
+  drain_stash(hash);
+
+  return true;
+}
+
+
+static inline
+struct cuckoo_hash_item *
+insert_hashed(struct cuckoo_hash *hash,
+              const void *key, size_t key_len, void *value,
+              uint32_t h1, uint32_t h2)
+{
+  /*
+    Shrink and migrate before the lookup, as both move the item it
+    finds.  Failing to shrink is harmless.
+  */
+  if (hash->shrink_pending)
+    {
+      hash->shrink_pending = false;
+      shrink_to(hash, SHRINK_TARGET_LOAD);
+    }
+  cuckoo_hash_migrate(hash, hash->migrate_step);
+  if (__builtin_expect(hash->sync != NULL, 0))
+    reclaim(hash);
+
+  struct cuckoo_hash_item *item = lookup(hash, key, key_len, h1, h2);
+  if (item)
+    {
+      XPROBES_SITE(cuckoo_hash, insert_exists,
+                   (const struct cuckoo_hash *),
+                   (hash));
+
+      return item;
+    }
+
+  /* Failing to grow early is harmless too.  */
+  if (hash->growth.max_load > 0
+      && (hash->count + 1
+          > hash->growth.max_load * ((size_t) hash->bin_size << hash->power))
+      && grow_table(hash))
+    drain_stash(hash);
+
+  if (hash->arena)
+    {
+      key = arena_copy(hash, key, key_len);
+      if (! key)
+        return CUCKOO_HASH_FAILED;
+    }
+
+  struct entry entry = {
+    .hash_item = { .key = key, .key_len = key_len, .value = value },
+    .hash1 = h1,
+    .hash2 = h2
+  };
+
+  if (insert(hash, &entry, true))
+    {
+      ++hash->count;
+
+      return NULL;
+    }
+  else
+    {
+      assert(entry.hash_item.key == key);
+      assert(entry.hash_item.key_len == key_len);
+      assert(entry.hash_item.value == value);
+      assert(entry.hash1 == h1);
+      assert(entry.hash2 == h2);
+
+      if (hash->arena)
+        arena_free(hash, key, key_len);
+
+      return CUCKOO_HASH_FAILED;
+    }
+}
+
+
+struct cuckoo_hash_item *
+cuckoo_hash_insert(struct cuckoo_hash *hash,
+                   const void *key, size_t key_len, void *value)
+{
+  uint32_t h1, h2;
+  compute_hash(hash, key, key_len, &h1, &h2);
+
+  return insert_hashed(hash, key, key_len, value, h1, h2);
+}
+
+
+struct cuckoo_hash_item *
+cuckoo_hash_insert_hashed(struct cuckoo_hash *hash,
+                          const void *key, size_t key_len, void *value,
+                          struct cuckoo_hash_hashval hashval)
+{
+  uint32_t h1, h2;
+  hashval_get(hash, key, key_len, &hashval, &h1, &h2);
+
+  return insert_hashed(hash, key, key_len, value, h1, h2);
+}
+
+
+/*
+  Parallel build.  Keys are hashed by all threads, and then placed in
+  one round per choice: the round sorts the pending keys by the range
+  of bins their bin of that choice falls into, and every thread places
+  the keys of its range, so that no two threads write the same bin.
+  Keys whose bin is full stay pending for the next round, and those
+  left after the last one are inserted by the caller's thread as usual,
+  displacing elements across the ranges.
+
+  A key is compared only with the keys in the bin of the round.  Still
+  duplicates don't end up in the table: copies of a key go to the same
+  bins in the same order, and a bin that is full for the first copy is
+  full for the rest of them.
+*/
+
+
+/*
+  Below this many keys per thread the build takes fewer threads.
+*/
+#define BUILD_MIN_KEYS  4096
+
+
+/*
+  Load factor the built table is sized for, unless the growth policy
+  caps it lower.
+*/
+#define BUILD_LOAD  0.9
+
+
+#define BUILD_PREFETCH_AHEAD  8
+
+
+#define BUILD_MAX_THREADS  256
+
+
+struct build_entry
+{
+  uint32_t hash1;
+  uint32_t hash2;
+  size_t index;
+};
+
+
+/*
+  State shared by the threads of a build.  Entries pending in the
+  round are in from[0..count), and are sorted by range into to, where
+  range r starts at start[r].  Thread t counts the entries of range r
+  in its slice of from at offsets[t * nthreads + r].
+*/
+struct build
+{
+  struct cuckoo_hash *hash;
+  const struct cuckoo_hash_item *items;
+  struct build_entry *from;
+  struct build_entry *to;
+  size_t count;
+  size_t *offsets;
+  size_t *start;
+  size_t *placed;
+  size_t *pending;
+  unsigned int nthreads;
+  unsigned int choice;
+};
+
+
+static inline
+void
+build_slice(const struct build *build, unsigned int t,
+            size_t *beg, size_t *end)
+{
+  *beg = build->count * t / build->nthreads;
+  *end = build->count * (t + 1) / build->nthreads;
+}
+
+
+/*
+  Return the bin of the entry for the round, and its hash pair there.
+*/
+static inline
+uint32_t
+build_bin(const struct build *build, const struct build_entry *entry,
+          uint32_t *h1, uint32_t *h2)
+{
+  const struct cuckoo_hash *hash = build->hash;
+  *h1 = entry->hash1;
+  *h2 = entry->hash2;
+  if (build->choice > 0)
+    alt_pair(hash->choices, entry->hash1, entry->hash2, build->choice,
+             h1, h2);
+
+  return *h1 & ((1U << hash->power) - 1);
+}
+
+
+static inline
+unsigned int
+build_range(const struct build *build, uint32_t bin)
+{
+  return ((uint64_t) bin * build->nthreads) >> build->hash->power;
+}
+
+
+static
+void
+build_count(struct build *build, unsigned int t)
+{
+  size_t *counts = build->offsets + (size_t) t * build->nthreads;
+  memset(counts, 0, build->nthreads * sizeof(*counts));
+
+  size_t beg, end;
+  build_slice(build, t, &beg, &end);
+  for (size_t i = beg; i < end; ++i)
+    {
+      uint32_t h1, h2;
+      ++counts[build_range(build, build_bin(build, &build->from[i],
+                                            &h1, &h2))];
+    }
+}
+
+
+static
+void
+build_hash(struct build *build, unsigned int t)
+{
+  size_t beg, end;
+  build_slice(build, t, &beg, &end);
+  for (size_t i = beg; i < end; ++i)
+    {
+      const struct cuckoo_hash_item *item = &build->items[i];
+      struct build_entry *entry = &build->from[i];
+      compute_hash(build->hash, item->key, item->key_len,
+                   &entry->hash1, &entry->hash2);
+      entry->index = i;
+    }
+
+  build_count(build, t);
+}
+
+
+static
+void
+build_scatter(struct build *build, unsigned int t)
+{
+  size_t *offsets = build->offsets + (size_t) t * build->nthreads;
+
+  size_t beg, end;
+  build_slice(build, t, &beg, &end);
+  for (size_t i = beg; i < end; ++i)
+    {
+      uint32_t h1, h2;
+      unsigned int r = build_range(build, build_bin(build, &build->from[i],
+                                                    &h1, &h2));
+      build->to[offsets[r]++] = build->from[i];
+    }
+}
+
+
+/*
+  Place the entries of range t into the bins of the round, and keep
+  the rest at the beginning of the range.
+*/
+static
+void
+build_place(struct build *build, unsigned int t)
+{
+  struct cuckoo_hash *hash = build->hash;
+  uint32_t mask = (1U << hash->power) - 1;
+  struct build_entry *entries = build->to + build->start[t];
+  size_t count = build->start[t + 1] - build->start[t];
+  size_t placed = 0, pending = 0;
+  for (size_t j = 0; j < count; ++j)
+    {
+      uint32_t h1, h2;
+      if (j + BUILD_PREFETCH_AHEAD < count)
+        {
+          uint32_t bin = build_bin(build, &entries[j + BUILD_PREFETCH_AHEAD],
+                                   &h1, &h2);
+          __builtin_prefetch(bin_at(hash, bin));
+        }
+
+      uint32_t bin = build_bin(build, &entries[j], &h1, &h2);
+      struct _cuckoo_hash_elem *slots = bin_at(hash, bin);
+      const struct cuckoo_hash_item *item = &build->items[entries[j].index];
+      if (lookup_bin(hash, slots, item_at(hash, slots), item->key,
+                     item->key_len, h1, h2, scan_match_scalar))
+        continue;
+
+      struct _cuckoo_hash_elem *elem = free_slot(hash, bin, mask, scan_free);
+      if (elem)
+        {
+          struct entry entry = {
+            .hash_item = *item, .hash1 = h1, .hash2 = h2
+          };
+          store(hash, elem, &entry);
+          ++placed;
+        }
+      else
+        {
+          entries[pending++] = entries[j];
+        }
+    }
+
+  build->placed[t] = placed;
+  build->pending[t] = pending;
+}
+
+
+#ifdef HAVE_PTHREAD
+
+struct build_thread
+{
+  struct build *build;
+  void (*step)(struct build *, unsigned int);
+  unsigned int id;
+};
+
+
+static
+void *
+build_thread(void *arg)
+{
+  struct build_thread *thread = arg;
+  thread->step(thread->build, thread->id);
+
+  return NULL;
+}
+
+#endif  /* HAVE_PTHREAD */
+
+
+/*
+  Run the step for every thread id.  Ids no thread could be started
+  for are run by the caller.
+*/
+static
+void
+build_run(struct build *build, void (*step)(struct build *, unsigned int))
+{
+#ifdef HAVE_PTHREAD
+  struct build_thread threads[BUILD_MAX_THREADS];
+  pthread_t ids[BUILD_MAX_THREADS];
+  bool started[BUILD_MAX_THREADS];
+  for (unsigned int t = 1; t < build->nthreads; ++t)
+    {
+      threads[t] = (struct build_thread) {
+        .build = build, .step = step, .id = t
+      };
+      started[t] = (pthread_create(&ids[t], NULL, build_thread,
+                                   &threads[t]) == 0);
+    }
+
+  step(build, 0);
+
+  for (unsigned int t = 1; t < build->nthreads; ++t)
+    {
+      if (started[t])
+        pthread_join(ids[t], NULL);
+      else
+        step(build, t);
+    }
+#else  /* ! HAVE_PTHREAD */
+  for (unsigned int t = 0; t < build->nthreads; ++t)
+    step(build, t);
+#endif  /* ! HAVE_PTHREAD */
+}
+
+
+/*
+  Sort the pending entries by range for the round.
+*/
+static
+void
+build_sort(struct build *build)
+{
+  unsigned int nthreads = build->nthreads;
+  size_t offset = 0;
+  for (unsigned int r = 0; r < nthreads; ++r)
+    {
+      build->start[r] = offset;
+      for (unsigned int t = 0; t < nthreads; ++t)
+        {
+          size_t count = build->offsets[(size_t) t * nthreads + r];
+          build->offsets[(size_t) t * nthreads + r] = offset;
+          offset += count;
+        }
+    }
+  build->start[nthreads] = offset;
+
+  build_run(build, build_scatter);
+}
+
+
+bool
+cuckoo_hash_build_parallel(struct cuckoo_hash *hash,
+                           const struct cuckoo_hash_item items[], size_t n,
+                           unsigned int nthreads)
+{
+  if (nthreads == 0)
+    {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      nthreads = (cpus > 0 ? (unsigned int) cpus : 1);
+    }
+  if (nthreads > BUILD_MAX_THREADS)
+    nthreads = BUILD_MAX_THREADS;
+  if (nthreads > n / BUILD_MIN_KEYS)
+    nthreads = (n / BUILD_MIN_KEYS > 0 ? n / BUILD_MIN_KEYS : 1);
+
+  if (! cuckoo_hash_reserve(hash, hash->count + n, BUILD_LOAD))
+    return false;
+
+  if (nthreads > (1U << hash->power))
+    nthreads = 1U << hash->power;
 
-  /* Initial values are arbitrary.  */
-  *h1 = 0x3ac5d673;
-  *h2 = 0x6d7839d0;
-  hashlittle2(key, key_len, h1, h2);
-  if (*h1 != *h2)
+  struct build build = {
+    .hash = hash,
+    .items = items,
+    .count = n,
+    .nthreads = nthreads,
+    .choice = 0
+  };
+  /* Scratch memory comes from where the table's does.  */
+  size_t entries_size = n * sizeof(*build.from);
+  size_t offsets_size = (size_t) nthreads * nthreads * sizeof(*build.offsets);
+  size_t start_size = (nthreads + 1) * sizeof(*build.start);
+  size_t counts_size = nthreads * sizeof(*build.placed);
+  build.from = table_alloc(hash, entries_size);
+  build.to = table_alloc(hash, entries_size);
+  build.offsets = mem_alloc(hash, offsets_size);
+  build.start = mem_alloc(hash, start_size);
+  build.placed = mem_alloc(hash, counts_size);
+  build.pending = mem_alloc(hash, counts_size);
+  bool res = true;
+  if (! (build.from && build.to && build.offsets && build.start
+         && build.placed && build.pending))
     {
-      return;
+      /* Without the scratch memory, insert the items one by one.  */
+      for (size_t i = 0; i < n && res; ++i)
+        res = (cuckoo_hash_insert(hash, items[i].key, items[i].key_len,
+                                  items[i].value) != CUCKOO_HASH_FAILED);
+      goto out;
     }
-  else
+
+  build_run(&build, build_hash);
+
+  /*
+    Keys are compared only within bins, so a table that has elements
+    already, or copies keys into the arena, which can't be shared,
+    gets them all inserted the usual way.
+  */
+  if (hash->count == 0 && ! hash->arena)
     {
-      *h2 = ~*h2;
+      for (; build.choice < hash->choices && build.count > 0; ++build.choice)
+        {
+          if (build.choice > 0)
+            build_run(&build, build_count);
+          build_sort(&build);
+          build_run(&build, build_place);
 
-      XPROBES_SITE(cuckoo_hash, compute_hash_equal,
-                   (const void *, size_t, uint32_t),
-                   (key, key_len, *h1));
+          build.count = 0;
+          for (unsigned int t = 0; t < nthreads; ++t)
+            {
+              memmove(build.from + build.count, build.to + build.start[t],
+                      build.pending[t] * sizeof(*build.from));
+              build.count += build.pending[t];
+              hash->count += build.placed[t];
+            }
+        }
     }
-}
 
+  uint32_t seed1 = hash->seed1;
+  for (size_t i = 0; i < build.count && res; ++i)
+    {
+      const struct cuckoo_hash_item *item = &items[build.from[i].index];
+      uint32_t h1 = build.from[i].hash1, h2 = build.from[i].hash2;
+      if (hash->seed1 != seed1)
+        compute_hash(hash, item->key, item->key_len, &h1, &h2);
+      res = (insert_hashed(hash, item->key, item->key_len, item->value,
+                           h1, h2) != CUCKOO_HASH_FAILED);
+    }
 
-struct _cuckoo_hash_elem
-{
-  struct cuckoo_hash_item hash_item;
-  uint32_t hash1;
-  uint32_t hash2;
-};
+ out:
+  mem_free(hash, build.pending, counts_size);
+  mem_free(hash, build.placed, counts_size);
+  mem_free(hash, build.start, start_size);
+  mem_free(hash, build.offsets, offsets_size);
+  table_free(hash, build.to, entries_size);
+  table_free(hash, build.from, entries_size);
 
+  return res;
+}
 
-bool
-cuckoo_hash_init(struct cuckoo_hash *hash, unsigned char power)
-{
-  if (power == 0)
-    power = 1;
 
-  hash->power = power;
-  hash->bin_size = 4;
-  hash->count = 0;
-  hash->table = calloc((size_t) hash->bin_size << power, sizeof(*hash->table));
-  if (! hash->table)
-    return false;
+/*
+  Several writers.  A writer locks the bins of the key, and the stash
+  when it's not empty, and then the table is as if it were the only
+  writer.  Should the table have been replaced before the bins were
+  locked, it starts over.  Shared writers never add to the stash, so
+  it only empties.
 
-  XPROBES_SITE(cuckoo_hash, init,
-               (const struct cuckoo_hash *),
-               (hash));
+  When the bins are full, the writer unlocks them, and searches for a
+  path to a free slot without locks, as insert() does.  Then it moves
+  the elements along the path one by one, last one first, locking the
+  two bins of every move and checking that the move is still valid,
+  and starts over once the slot in the bin of the key is free.  Moves
+  clear the slot they move from, so that a path given up halfway
+  leaves no copies.
 
-  return true;
-}
+  The table grows when no path is found.  The writer that grows it
+  locks all bins, and copies the table together with the writers that
+  wait for the locks meanwhile, see grow_job.
+*/
 
 
-void
-cuckoo_hash_destroy(const struct cuckoo_hash *hash)
+/*
+  Lock the bins of the key, and the stash if it's not empty.  Return
+  false, with nothing locked, if the table has changed since it was
+  read under the table version seen.
+*/
+static
+bool
+lock_key(struct cuckoo_hash *hash, struct lock_set *set,
+         const uint32_t *bins, uint32_t seen)
 {
-  XPROBES_SITE(cuckoo_hash, destroy,
-               (const struct cuckoo_hash *),
-               (hash));
+  struct _cuckoo_hash_sync *sync = hash->sync;
+  lock_bins(sync, set, bins, hash->choices);
+
+  /* The table can't be replaced while any bin is locked.  */
+  if (__atomic_load_n(&sync->table_version, __ATOMIC_RELAXED) != seen)
+    {
+      unlock_set(set);
+      return false;
+    }
 
-  free(hash->table);
+  if (hash->stash_count != 0)
+    lock_stash(sync, set);
+
+  return true;
 }
 
 
 static inline
-struct _cuckoo_hash_elem *
-bin_at(const struct cuckoo_hash *hash, uint32_t index)
+bool
+slot_free(const struct _cuckoo_hash_elem *elem, uint32_t mask,
+          uint32_t index)
 {
-  return (hash->table + index * hash->bin_size);
+  return (elem->hash1 == elem->hash2 || (elem->hash1 & mask) != index);
 }
 
 
-static inline
-struct cuckoo_hash_item *
-lookup(const struct cuckoo_hash *hash, const void *key, size_t key_len,
-       uint32_t h1, uint32_t h2)
+/*
+  Make room for the item in its own bins of the table read into view
+  under the table version seen.  Return 1 when there is a free slot
+  there, 0 if there's no path to one, and -1 if the path has changed.
+*/
+static
+int
+make_room(struct cuckoo_hash *hash, struct cuckoo_hash *view, uint32_t seen,
+          const struct entry *item)
 {
-  uint32_t mask = (1U << hash->power) - 1;
+  struct _cuckoo_hash_sync *sync = hash->sync;
+  struct bfs_node nodes[INSERT_MAX_NODES];
 
-  struct _cuckoo_hash_elem *elem, *end;
+  size_t max_nodes = (size_t) view->bin_size << view->power;
+  if (max_nodes > INSERT_MAX_NODES)
+    max_nodes = INSERT_MAX_NODES;
 
-  elem = bin_at(hash, (h1 & mask));
-  end = elem + hash->bin_size;
-  while (elem != end)
+  struct _cuckoo_hash_elem *elem;
+  int node = find_path(view, item, nodes, max_nodes, &elem);
+  if (node < 0)
+    return 0;
+
+  uint32_t mask = (1U << view->power) - 1;
+  for (; nodes[node].parent >= 0; node = nodes[node].parent)
     {
-      if (elem->hash2 == h2 && elem->hash1 == h1
-          && elem->hash_item.key_len == key_len
-          && memcmp(elem->hash_item.key, key, key_len) == 0)
-        {
-          XPROBES_SITE(cuckoo_hash, lookup_hash1,
-                       (const struct cuckoo_hash *, int),
-                       (hash, hash->bin_size - (end - elem)));
+      uint32_t bins[2] = { nodes[nodes[node].parent].bin, nodes[node].bin };
+      struct _cuckoo_hash_elem *from =
+        bin_at(view, bins[0]) + nodes[node].slot;
+      struct lock_set set;
+      lock_bins(sync, &set, bins, 2);
 
-          return &elem->hash_item;
+      uint32_t a1 = 0, a2 = 0;
+      bool valid = (__atomic_load_n(&sync->table_version, __ATOMIC_RELAXED)
+                    == seen
+                    && ! slot_free(from, mask, bins[0])
+                    && slot_free(elem, mask, bins[1]));
+      if (valid)
+        {
+          alt_pair(view->choices, from->hash1, from->hash2,
+                   nodes[node].choice, &a1, &a2);
+          valid = ((a1 & mask) == bins[1]);
+        }
+      if (valid)
+        {
+          elem->hash1 = a1;
+          elem->hash2 = a2;
+          memcpy(item_at(view, elem), item_at(view, from), view->item_size);
+          from->hash1 = from->hash2 = 0;
         }
 
-      ++elem;
+      unlock_set(&set);
+      if (! valid)
+        return -1;
+
+      elem = from;
     }
 
-  elem = bin_at(hash, (h2 & mask));
-  end = elem + hash->bin_size;
-  while (elem != end)
+  return 1;
+}
+
+
+/*
+  Grow the table, unless it has grown since its power was the given
+  one.  Return false if it can't grow.
+*/
+static
+bool
+grow_shared(struct cuckoo_hash *hash, unsigned char power)
+{
+  struct _cuckoo_hash_sync *sync = hash->sync;
+  for (unsigned int i = 0; i < VERSION_STRIPES; ++i)
+    lock_version(sync, &sync->versions[i]);
+  lock_version(sync, &sync->stash_version);
+
+  struct _cuckoo_hash_elem *old_table = hash->table;
+  struct cuckoo_hash_item *old_items = hash->items;
+  size_t count = (size_t) hash->bin_size << hash->power;
+  struct retired *retired = NULL;
+  bool grown = false;
+  bool res = (hash->power != power);
+  unsigned char new_power = power + __builtin_ctz(hash->growth.factor);
+  if (! res && new_power <= MAX_POWER)
     {
-      if (elem->hash2 == h1 && elem->hash1 == h2
-          && elem->hash_item.key_len == key_len
-          && memcmp(elem->hash_item.key, key, key_len) == 0)
+      size_t new_count = (size_t) hash->bin_size << new_power;
+      struct _cuckoo_hash_elem *table =
+        table_alloc(hash, new_count * sizeof(*hash->table));
+      struct cuckoo_hash_item *items =
+        table_alloc(hash, new_count * hash->item_size);
+      retired = mem_alloc(hash, sizeof(*retired));
+      if (table && items && retired)
         {
-          XPROBES_SITE(cuckoo_hash, lookup_hash2,
-                       (const struct cuckoo_hash *, int),
-                       (hash, 2 * hash->bin_size - (end - elem)));
+          struct grow_job job = {
+            .old_table = old_table,
+            .old_items = (const unsigned char *) old_items,
+            .table = table,
+            .items = (unsigned char *) items,
+            .count = count,
+            .new_count = new_count,
+            .item_size = hash->item_size
+          };
+          __atomic_store_n(&sync->grow, &job, __ATOMIC_SEQ_CST);
+          grow_copy(&job);
+          while (__atomic_load_n(&job.done, __ATOMIC_ACQUIRE) < count)
+            sched_yield();
+          __atomic_store_n(&sync->grow, NULL, __ATOMIC_SEQ_CST);
+          while (__atomic_load_n(&sync->helpers, __ATOMIC_SEQ_CST) != 0)
+            sched_yield();
 
-          return &elem->hash_item;
-        }
+          /* All is locked, the stash is drained as by the only writer.  */
+          struct cuckoo_hash fresh = *hash;
+          fresh.table = table;
+          fresh.items = items;
+          fresh.power = new_power;
+          fresh.sync = NULL;
+          drain_stash(&fresh);
+          fresh.sync = sync;
 
-      ++elem;
+          write_begin(&sync->table_version);
+          *hash = fresh;
+          write_end(&sync->table_version);
+          grown = res = true;
+        }
+      else
+        {
+          free_arrays(hash, table, items, new_count);
+          mem_free(hash, retired, sizeof(*retired));
+        }
     }
 
-  XPROBES_SITE(cuckoo_hash, lookup_not_found,
-               (const struct cuckoo_hash *, int),
-               (hash, 2 * hash->bin_size));
+  write_end(&sync->stash_version);
+  for (unsigned int i = 0; i < VERSION_STRIPES; ++i)
+    write_end(&sync->versions[i]);
 
-  return NULL;
+  if (grown)
+    retire(hash, retired, old_table, old_items, count);
+
+  return res;
 }
 
 
+/*
+  Insert the key with the value, as cuckoo_hash_insert_shared() does.
+  With update, call it instead on the value of the key, or on the value
+  to insert when the key is not there, with its bins locked, and insert
+  only if it returns true.  It is called once: a missing key is only
+  passed to it when there's a free slot to insert to.
+*/
+static
 struct cuckoo_hash_item *
-cuckoo_hash_lookup(const struct cuckoo_hash *hash,
-                   const void *key, size_t key_len)
+insert_shared(struct cuckoo_hash *hash, const void *key, size_t key_len,
+              void *value, cuckoo_hash_update_function *update, void *ctx,
+              struct cuckoo_hash_item *hash_item)
 {
-  uint32_t h1, h2;
-  compute_hash(key, key_len, &h1, &h2);
+  bool grown_early = false;
+  for (;;)
+    {
+      struct cuckoo_hash view;
+      uint32_t seen;
+      if (! read_view(hash, &view, &seen))
+        continue;
 
-  return lookup(hash, key, key_len, h1, h2);
+      /* Failing to grow early is harmless.  */
+      if (view.growth.max_load > 0 && ! grown_early
+          && (__atomic_load_n(&hash->count, __ATOMIC_RELAXED) + 1
+              > view.growth.max_load * ((size_t) view.bin_size << view.power)))
+        {
+          grown_early = true;
+          grow_shared(hash, view.power);
+          continue;
+        }
+
+      struct entry entry = {
+        .hash_item = { .key = key, .key_len = key_len, .value = value }
+      };
+      compute_hash(&view, key, key_len, &entry.hash1, &entry.hash2);
+      uint32_t bins[4], pairs[4][2];
+      key_bins(&view, entry.hash1, entry.hash2, bins, pairs);
+
+      struct lock_set set;
+      if (! lock_key(hash, &set, bins, seen))
+        continue;
+
+      struct cuckoo_hash_item *res =
+        lookup(hash, key, key_len, entry.hash1, entry.hash2);
+      if (res)
+        {
+          if (update)
+            update(&res->value, true, ctx);
+          *hash_item = *res;
+          unlock_set(&set);
+
+          return hash_item;
+        }
+
+      uint32_t mask = (1U << view.power) - 1;
+      for (unsigned int i = 0; i < view.choices; ++i)
+        {
+          struct _cuckoo_hash_elem *elem =
+            free_slot(hash, bins[i], mask, scan_free);
+          if (elem)
+            {
+              if (update && ! update(&entry.hash_item.value, false, ctx))
+                {
+                  unlock_set(&set);
+                  return NULL;
+                }
+
+              entry.hash1 = pairs[i][0];
+              entry.hash2 = pairs[i][1];
+              store(hash, elem, &entry);
+              __atomic_fetch_add(&hash->count, 1, __ATOMIC_RELAXED);
+              unlock_set(&set);
+
+              return NULL;
+            }
+        }
+      unlock_set(&set);
+
+      if (make_room(hash, &view, seen, &entry) == 0
+          && ! grow_shared(hash, view.power))
+        return CUCKOO_HASH_FAILED;
+    }
 }
 
 
-void
-cuckoo_hash_remove(struct cuckoo_hash *hash,
-                   const struct cuckoo_hash_item *hash_item)
+struct cuckoo_hash_item *
+cuckoo_hash_insert_shared(struct cuckoo_hash *hash,
+                          struct cuckoo_hash_reader *reader,
+                          const void *key, size_t key_len, void *value,
+                          struct cuckoo_hash_item *hash_item)
 {
-  if (hash_item)
+  struct _cuckoo_hash_sync *sync = hash->sync;
+  if (! sync)
     {
-      struct _cuckoo_hash_elem *elem =
-        ((struct _cuckoo_hash_elem *)
-         ((char *) hash_item - offsetof(struct _cuckoo_hash_elem, hash_item)));
-      elem->hash1 = elem->hash2 = 0;
-      --hash->count;
+      struct cuckoo_hash_item *res =
+        cuckoo_hash_insert(hash, key, key_len, value);
+      if (res == NULL || res == CUCKOO_HASH_FAILED)
+        return res;
 
-      XPROBES_SITE(cuckoo_hash, remove,
-                   (const struct cuckoo_hash *),
-                   (hash));
+      *hash_item = *res;
+
+      return hash_item;
     }
+
+  reader_enter(sync, reader);
+  struct cuckoo_hash_item *res =
+    insert_shared(hash, key, key_len, value, NULL, NULL, hash_item);
+  reader_exit(reader);
+
+  /* Tables retired by this writer may be freed only now.  */
+  reclaim(hash);
+
+  return res;
 }
 
 
 static
 bool
-grow_table(struct cuckoo_hash *hash)
+remove_shared(struct cuckoo_hash *hash, const void *key, size_t key_len,
+              struct cuckoo_hash_item *hash_item)
 {
-  size_t size =
-    ((size_t) hash->bin_size << hash->power) * sizeof(*hash->table);
-  struct _cuckoo_hash_elem *table = realloc(hash->table, size * 2);
-  if (! table)
-    return false;
+  for (;;)
+    {
+      struct cuckoo_hash view;
+      uint32_t seen;
+      if (! read_view(hash, &view, &seen))
+        continue;
 
-  hash->table = table;
-  memcpy((char *) hash->table + size, hash->table, size);
-  ++hash->power;
+      uint32_t h1, h2, bins[4], pairs[4][2];
+      compute_hash(&view, key, key_len, &h1, &h2);
+      key_bins(&view, h1, h2, bins, pairs);
 
-  return true;
+      struct lock_set set;
+      if (! lock_key(hash, &set, bins, seen))
+        continue;
+
+      struct cuckoo_hash_item *res = lookup(hash, key, key_len, h1, h2);
+      if (res)
+        {
+          if (hash_item)
+            *hash_item = *res;
+
+          int i = stash_index(hash, res);
+          if (i >= 0)
+            {
+              hash->stash[i].hash1 = hash->stash[i].hash2 = 0;
+              --hash->stash_count;
+            }
+          else
+            {
+              struct _cuckoo_hash_elem *elem =
+                hash->table + slot_pos(hash, hash->items, res);
+              elem->hash1 = elem->hash2 = 0;
+            }
+          __atomic_fetch_sub(&hash->count, 1, __ATOMIC_RELAXED);
+        }
+      unlock_set(&set);
+
+      return (res != NULL);
+    }
 }
 
 
-static
 bool
-grow_bin_size(struct cuckoo_hash *hash)
+cuckoo_hash_remove_shared(struct cuckoo_hash *hash,
+                          struct cuckoo_hash_reader *reader,
+                          const void *key, size_t key_len,
+                          struct cuckoo_hash_item *hash_item)
 {
-  size_t size =
-    ((size_t) hash->bin_size << hash->power) * sizeof(*hash->table);
-  uint32_t bin_count = 1U << hash->power;
-  size_t add = bin_count * sizeof(*hash->table);
-  struct _cuckoo_hash_elem *table = realloc(hash->table, size + add);
-  if (! table)
-    return false;
-
-  hash->table = table;
-  for (uint32_t bin = bin_count - 1; bin > 0; --bin)
+  struct _cuckoo_hash_sync *sync = hash->sync;
+  if (! sync)
     {
-      struct _cuckoo_hash_elem *old = bin_at(hash, bin);
-      struct _cuckoo_hash_elem *new = old + bin;
-      memmove(new, old, hash->bin_size * sizeof(*hash->table));
-      memset(new + hash->bin_size, 0, sizeof(*hash->table));
+      struct cuckoo_hash_item *res = cuckoo_hash_lookup(hash, key, key_len);
+      if (res && hash_item)
+        *hash_item = *res;
+      cuckoo_hash_remove(hash, res);
+
+      return (res != NULL);
     }
-  memset(hash->table + hash->bin_size, 0, sizeof(*hash->table));
 
-  ++hash->bin_size;
+  reader_enter(sync, reader);
+  bool res = remove_shared(hash, key, key_len, hash_item);
+  reader_exit(reader);
 
-  return true;
+  return res;
 }
 
 
+/*
+  Update the value of the key, or insert it, as described for
+  cuckoo_hash_upsert_with().  Return false if the key couldn't be
+  inserted.
+*/
 static
 bool
-undo_insert(struct cuckoo_hash *hash, struct _cuckoo_hash_elem *item,
-            size_t max_depth, uint32_t offset, int phase)
+upsert(struct cuckoo_hash *hash, struct cuckoo_hash_reader *reader,
+       const void *key, size_t key_len,
+       cuckoo_hash_update_function *update, void *ctx)
 {
-  uint32_t mask = (1U << hash->power) - 1;
-
-  for (size_t depth = 0; depth < max_depth * phase; ++depth)
+  struct _cuckoo_hash_sync *sync = hash->sync;
+  if (! sync)
     {
-      if (offset-- == 0)
-        offset = hash->bin_size - 1;
-
-      uint32_t h2m = item->hash2 & mask;
-      struct _cuckoo_hash_elem *beg = bin_at(hash, h2m);
-
-      struct _cuckoo_hash_elem victim = beg[offset];
+      uint32_t h1, h2;
+      compute_hash(hash, key, key_len, &h1, &h2);
 
-      beg[offset].hash_item = item->hash_item;
-      beg[offset].hash1 = item->hash2;
-      beg[offset].hash2 = item->hash1;
-
-      uint32_t h1m = victim.hash1 & mask;
-      if (h1m != h2m)
+      struct cuckoo_hash_item *res = lookup(hash, key, key_len, h1, h2);
+      if (res)
         {
-          assert(depth >= max_depth);
-
-          XPROBES_SITE(cuckoo_hash, insert_undo_inserted,
-                       (const struct cuckoo_hash *,
-                        int, size_t, size_t),
-                       (hash, phase, depth, max_depth));
-
+          update(&res->value, true, ctx);
           return true;
         }
 
-      *item = victim;
+      void *value = NULL;
+      return (! update(&value, false, ctx)
+              || insert_hashed(hash, key, key_len, value, h1, h2) == NULL);
     }
 
-  XPROBES_SITE(cuckoo_hash, insert_undo,
-               (const struct cuckoo_hash *,
-                int, size_t),
-               (hash, phase, max_depth));
+  struct cuckoo_hash_item item;
+  reader_enter(sync, reader);
+  struct cuckoo_hash_item *res =
+    insert_shared(hash, key, key_len, NULL, update, ctx, &item);
+  reader_exit(reader);
 
-  return false;
+  reclaim(hash);
+
+  return (res != CUCKOO_HASH_FAILED);
 }
 
 
-static inline
 bool
-insert(struct cuckoo_hash *hash, struct _cuckoo_hash_elem *item)
+cuckoo_hash_upsert_with(struct cuckoo_hash *hash,
+                        struct cuckoo_hash_reader *reader,
+                        const void *key, size_t key_len,
+                        cuckoo_hash_update_function *fn, void *ctx)
 {
-  size_t max_depth = (size_t) hash->power << 5;
-  if (max_depth > (size_t) hash->bin_size << hash->power)
-    max_depth = (size_t) hash->bin_size << hash->power;
+  return upsert(hash, reader, key, key_len, fn, ctx);
+}
 
-  uint32_t offset = 0;
-  int phase = 0;
-  while (phase < 2)
-    {
-      uint32_t mask = (1U << hash->power) - 1;
 
-      for (size_t depth = 0; depth < max_depth; ++depth)
-        {
-          uint32_t h1m = item->hash1 & mask;
-          struct _cuckoo_hash_elem *beg = bin_at(hash, h1m);
-          struct _cuckoo_hash_elem *end = beg + hash->bin_size;
-          for (struct _cuckoo_hash_elem *elem = beg; elem != end; ++elem)
-            {
-              if (elem->hash1 == elem->hash2 || (elem->hash1 & mask) != h1m)
-                {
-                  *elem = *item;
+struct fetch_add
+{
+  uintptr_t delta;
+  uintptr_t old;
+};
 
-                  XPROBES_SITE(cuckoo_hash, insert_done,
-                               (const struct cuckoo_hash *,
-                                int, size_t, size_t),
-                               (hash, phase, depth, max_depth));
 
-                  return true;
-                }
-            }
+static
+bool
+fetch_add(void **value, bool found, void *ctx)
+{
+  (void) found;
 
-          struct _cuckoo_hash_elem victim = beg[offset];
+  struct fetch_add *add = ctx;
+  add->old = (uintptr_t) *value;
+  *value = (void *) (add->old + add->delta);
 
-          beg[offset] = *item;
+  return true;
+}
 
-          item->hash_item = victim.hash_item;
-          item->hash1 = victim.hash2;
-          item->hash2 = victim.hash1;
 
-          if (++offset == hash->bin_size)
-            offset = 0;
-        }
+bool
+cuckoo_hash_fetch_add(struct cuckoo_hash *hash,
+                      struct cuckoo_hash_reader *reader,
+                      const void *key, size_t key_len,
+                      uintptr_t delta, uintptr_t *old)
+{
+  struct fetch_add add = { .delta = delta, .old = 0 };
+  bool res = upsert(hash, reader, key, key_len, fetch_add, &add);
+  if (old)
+    *old = add.old;
 
-      ++phase;
+  return res;
+}
 
-      if (phase == 1)
-        {
-          if (grow_table(hash))
-            /* continue */;
-          else
-            break;
-        }
-    }
 
-  if (grow_bin_size(hash))
-    {
-      uint32_t mask = (1U << hash->power) - 1;
-      struct _cuckoo_hash_elem *last =
-        bin_at(hash, (item->hash1 & mask) + 1) - 1;
+struct compare_exchange
+{
+  void *expected;
+  void *desired;
+  bool exchanged;
+};
 
-      *last = *item;
 
-      XPROBES_SITE(cuckoo_hash, insert_grow_bin,
-                   (const struct cuckoo_hash *,
-                    int, size_t),
-                   (hash, phase, max_depth));
+static
+bool
+compare_exchange(void **value, bool found, void *ctx)
+{
+  (void) found;
 
-      return true;
-    }
-  else
+  struct compare_exchange *exchange = ctx;
+  if (*value != exchange->expected)
     {
-      return undo_insert(hash, item, max_depth, offset, phase);
+      exchange->expected = *value;
+      return false;
     }
+
+  *value = exchange->desired;
+  exchange->exchanged = true;
+
+  return true;
 }
 
 
-struct cuckoo_hash_item *
-cuckoo_hash_insert(struct cuckoo_hash *hash,
-                   const void *key, size_t key_len, void *value)
+bool
+cuckoo_hash_compare_exchange_value(struct cuckoo_hash *hash,
+                                   struct cuckoo_hash_reader *reader,
+                                   const void *key, size_t key_len,
+                                   void **expected, void *desired)
 {
-  uint32_t h1, h2;
-  compute_hash(key, key_len, &h1, &h2);
+  struct compare_exchange exchange = {
+    .expected = *expected,
+    .desired = desired,
+    .exchanged = false
+  };
+  if (! upsert(hash, reader, key, key_len, compare_exchange, &exchange))
+    return false;
 
-  struct cuckoo_hash_item *item = lookup(hash, key, key_len, h1, h2);
-  if (item)
-    {
-      XPROBES_SITE(cuckoo_hash, insert_exists,
-                   (const struct cuckoo_hash *),
-                   (hash));
+  *expected = exchange.expected;
 
-      return item;
-    }
+  return exchange.exchanged;
+}
 
-  struct _cuckoo_hash_elem elem = {
-    .hash_item = { .key = key, .key_len = key_len, .value = value },
-    .hash1 = h1,
-    .hash2 = h2
-  };
 
-  if (insert(hash, &elem))
+/*
+  Return the first valid item at or after slot pos of the table with
+  2^power bins, skipping bins that are not migrated (or, when old is
+  true, that are migrated).
+*/
+static
+struct cuckoo_hash_item *
+next_in(const struct cuckoo_hash *hash, const struct _cuckoo_hash_elem *table,
+        struct cuckoo_hash_item *items, unsigned char power, bool old,
+        size_t pos)
+{
+  uint32_t bin_count = 1U << power;
+  uint32_t mask = bin_count - 1;
+  for (uint32_t index = pos / hash->bin_size; index < bin_count; ++index)
     {
-      ++hash->count;
-
-      return NULL;
+      size_t end = (size_t) (index + 1) * hash->bin_size;
+      if (! hash->old_table
+          || bin_migrated(hash, old_index(hash, index)) != old)
+        {
+          for (; pos < end; ++pos)
+            {
+              /*
+                Test that the element is valid, i.e., its hash1
+                matches the bin index it resides in.
+              */
+              const struct _cuckoo_hash_elem *elem = &table[pos];
+              if (elem->hash1 != elem->hash2
+                  && (elem->hash1 & mask) == index)
+                return slot_item(hash, items, pos);
+            }
+        }
+      pos = end;
     }
-  else
-    {
-      assert(elem.hash_item.key == key);
-      assert(elem.hash_item.key_len == key_len);
-      assert(elem.hash_item.value == value);
-      assert(elem.hash1 == h1);
-      assert(elem.hash2 == h2);
 
-      return CUCKOO_HASH_FAILED;
-    }
+  return NULL;
 }
 
 
@@ -398,30 +4400,43 @@ struct cuckoo_hash_item *
 cuckoo_hash_next(const struct cuckoo_hash *hash,
                  const struct cuckoo_hash_item *hash_item)
 {
-  struct _cuckoo_hash_elem *elem =
-    (hash_item != NULL
-     ? ((struct _cuckoo_hash_elem *)
-        ((char *) hash_item - offsetof(struct _cuckoo_hash_elem, hash_item))
-        + 1)
-     : hash->table);
-
-  uint32_t bin_count = 1U << hash->power;
-  struct _cuckoo_hash_elem *end = bin_at(hash, bin_count);
-  uint32_t mask = bin_count - 1;
-  while (elem != end)
+  /*
+    The migrated bins of the new table are visited first, then the rest
+    of the old table during incremental growth, and then the stash.
+  */
+  struct cuckoo_hash_item *res;
+  int i = (hash_item != NULL ? stash_index(hash, hash_item) : -1);
+  if (i < 0)
     {
-      if (elem->hash1 != elem->hash2)
+      if (hash_item == NULL || ! in_old_items(hash, hash_item))
+        {
+          size_t pos = (hash_item != NULL
+                        ? slot_pos(hash, hash->items, hash_item) + 1 : 0);
+          res = next_in(hash, hash->table, hash->items, hash->power, false,
+                        pos);
+          if (res)
+            return res;
+
+          hash_item = NULL;
+        }
+
+      if (hash->old_table)
         {
-          /*
-            Test that the element is valid, i.e., its hash1 matches
-            the bin index it resides in.
-          */
-          struct _cuckoo_hash_elem *bin = bin_at(hash, (elem->hash1 & mask));
-          if (bin <= elem && elem < bin + hash->bin_size)
-            return &elem->hash_item;
+          size_t pos = (hash_item != NULL
+                        ? slot_pos(hash, hash->old_items, hash_item) + 1
+                        : 0);
+          res = next_in(hash, hash->old_table, hash->old_items,
+                        hash->power - 1, true, pos);
+          if (res)
+            return res;
         }
+    }
 
-      ++elem;
+  for (++i; i < CUCKOO_HASH_STASH_SIZE; ++i)
+    {
+      const struct _cuckoo_hash_stash *slot = &hash->stash[i];
+      if (slot->hash1 != slot->hash2)
+        return (struct cuckoo_hash_item *) &slot->hash_item;
     }
 
   return NULL;
@@ -19,6 +19,7 @@
 #define _CUCKOO_HASH_H 1
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 
 
@@ -33,14 +34,268 @@ struct cuckoo_hash_item
 };
 
 
+/*
+  Hash value of a key as computed by cuckoo_hash_hash().  Treat it as
+  opaque.
+*/
+struct cuckoo_hash_hashval
+{
+  uint32_t _h1;
+  uint32_t _h2;
+  uint32_t _seed;
+};
+
+
+/*
+  Hash function: compute two 32-bit hashes of the key.  On entry *h1
+  and *h2 hold the initial values, which the result should depend on
+  (this is the interface of Bob Jenkins' hashlittle2()).  The two
+  hashes should be independent.
+*/
+typedef void cuckoo_hash_function(const void *key, size_t key_len,
+                                  uint32_t *h1, uint32_t *h2);
+
+
+/*
+  Options for cuckoo_hash_init_with().  Zero-initialized options give
+  the defaults, so set only the fields you care about:
+
+    struct cuckoo_hash_options options = {
+      .hash_function = cuckoo_hash_crc32c
+    };
+
+  hash_function: the hash function, NULL means cuckoo_hash_lookup3.
+
+  seed: the initial values passed to the hash function.  Zero means
+  pick a random seed, which is what you want for tables filled with
+  keys from untrusted input: otherwise keys may be crafted to collide,
+  which makes inserts slow and the table grow without bound.  A table
+  also picks a new random seed and rehashes all keys when inserting
+  fails while it is still mostly empty.
+
+  migrate_step: nonzero makes the table grow incrementally.  Instead
+  of copying the whole table at once when it grows, the old table is
+  kept, and every insert migrates migrate_step bins from it to the new
+  one, together with the bins the insert itself touches.  Lookups
+  check both tables meanwhile.  This bounds the latency of inserts
+  into large tables, at the cost of keeping both tables allocated
+  until the migration is complete.  See also cuckoo_hash_migrate().
+
+  shrink_load: when removals bring the load factor below shrink_load,
+  the next insert shrinks the table to about half full.  Zero means
+  tables never shrink by themselves, see cuckoo_hash_shrink_to_fit().
+
+  storage: how the table memory is allocated.
+  CUCKOO_HASH_STORAGE_MALLOC, the default, uses posix_memalign().
+  CUCKOO_HASH_STORAGE_MMAP maps anonymous memory, asks for transparent
+  huge pages with madvise(MADV_HUGEPAGE), and grows the mappings with
+  mremap(), which moves pages instead of copying them.
+  CUCKOO_HASH_STORAGE_HUGETLB first tries to map pages from the huge
+  page pool (MAP_HUGETLB), and falls back to the former.  Huge pages
+  save TLB misses on lookups in large tables.  Mappings are rounded to
+  the page size (2MB for CUCKOO_HASH_STORAGE_HUGETLB), so use these
+  for large tables only.  Where mmap() isn't available, all storage
+  falls back to CUCKOO_HASH_STORAGE_MALLOC.
+
+  allocator: functions to allocate the table memory with, which
+  override storage.  NULL means use storage.  See struct
+  cuckoo_hash_allocator.
+
+  copy_keys: make cuckoo_hash_insert() copy keys into an arena owned
+  by the table, so that the caller doesn't have to keep them, and keys
+  are packed densely, which saves cache misses on lookups.  Item keys
+  then point to the copies.  cuckoo_hash_remove() reclaims the copy,
+  and cuckoo_hash_shrink_to_fit() and shrinking by shrink_load compact
+  the arena when it is mostly free.  The arena is allocated with
+  allocator when there's one.
+
+  inline_keys: keep a copy of keys of up to inline_keys bytes right
+  after the item in its slot, and compare keys with it, a word at a
+  time, instead of following the key pointer.  A lookup hit then
+  costs the cache line of the bin and that of the slot, and no access
+  to the key (and none to the value, if it fits into the value pointer
+  itself).  Longer keys are compared through the pointer.  The copy
+  is rounded up to a multiple of eight bytes, and makes every slot
+  that much larger, so set it to the length of most keys.  At most
+  CUCKOO_HASH_INLINE_KEYS_MAX, zero means don't copy.  Item keys
+  still point to the keys passed to cuckoo_hash_insert() (or to their
+  copies with copy_keys).
+
+  bin_size: number of slots in a bin, 2, 4, 8 or 16.  Zero means four,
+  or the size cuckoo_hash_init_for() picks for the load.  The hashes
+  of a bin of eight slots fill a cache line.  Bigger bins reach higher
+  loads, but lookups compare more hashes.
+
+  choices: number of bins every key may go to, 2, 3 or 4.  Zero means
+  two.  More choices reach higher loads with the same bins, e.g.,
+  about 99% instead of 97% with bins of four slots and three choices,
+  but lookups of absent keys check every bin.  Lookups of present keys
+  mostly stop at the first bins, as inserts fill them first.
+
+  growth: when and how the table grows, see struct cuckoo_hash_growth.
+  NULL means the defaults.  Growth factors other than two can't be
+  combined with migrate_step.
+
+  concurrent: let any number of threads look keys up with
+  cuckoo_hash_lookup_shared() while one thread at a time modifies the
+  table, or while any number of threads modify it with
+  cuckoo_hash_insert_shared() and cuckoo_hash_remove_shared(), see
+  there.  Can't be combined with migrate_step or copy_keys.
+*/
+enum cuckoo_hash_storage
+{
+  CUCKOO_HASH_STORAGE_MALLOC = 0,
+  CUCKOO_HASH_STORAGE_MMAP,
+  CUCKOO_HASH_STORAGE_HUGETLB
+};
+
+
+/*
+  Allocator for the table memory, for tables living in arenas or
+  NUMA-local pools.  alloc should return memory aligned to 64 bytes
+  (the cache line size) for the best lookup speed, though any
+  alignment suitable for pointers is correct.  realloc and free are
+  given the size of the block, which is what they were allocated with.
+  realloc may be NULL, then the table grows with alloc, memcpy() and
+  free.  All functions are passed context as the first argument.  The
+  table copies the structure, and allocates only from inside the
+  cuckoo_hash_* calls.
+*/
+struct cuckoo_hash_allocator
+{
+  void *(*alloc)(void *context, size_t size);
+  void *(*realloc)(void *context, void *ptr, size_t old_size, size_t size);
+  void (*free)(void *context, void *ptr, size_t size);
+  void *context;
+};
+
+
+/*
+  Growth policy.  Zero-initialized fields give the defaults.
+
+  max_load: grow the table before an insert that would bring the load
+  factor above max_load, so that inserts don't slow down as the table
+  fills up.  E.g., 0.85 suits tables that should insert fast, and 0.97
+  with bins of eight slots tables that should be small.  Zero means
+  grow only when an insert finds no room.  Presized tables are sized
+  for at most this load.
+
+  max_depth: the highest number of elements an insert moves to make
+  room.  Inserts that would move more grow the table instead, which
+  bounds their latency, and lowers the load the table reaches.  Zero
+  means no limit besides the bound on the search.
+
+  factor: how many times the table grows, 2, 4, 8 or 16.  Zero means
+  two.
+*/
+struct cuckoo_hash_growth
+{
+  double max_load;
+  unsigned int max_depth;
+  unsigned int factor;
+};
+
+
+#define CUCKOO_HASH_INLINE_KEYS_MAX  40
+
+
+struct cuckoo_hash_options
+{
+  cuckoo_hash_function *hash_function;
+  uint64_t seed;
+  unsigned int migrate_step;
+  double shrink_load;
+  enum cuckoo_hash_storage storage;
+  const struct cuckoo_hash_allocator *allocator;
+  bool copy_keys;
+  unsigned int inline_keys;
+  unsigned int bin_size;
+  unsigned int choices;
+  const struct cuckoo_hash_growth *growth;
+  bool concurrent;
+};
+
+
+/*
+  Reader of a concurrent table, see cuckoo_hash_lookup_shared().
+  Treat it as opaque.  It fills a cache line of its own, so that
+  readers don't slow each other down.
+*/
+struct cuckoo_hash_reader
+{
+  uint64_t _epoch;
+  struct cuckoo_hash_reader *_next;
+  unsigned char _pad[64 - sizeof(uint64_t) - sizeof(void *)];
+};
+
+
 struct _cuckoo_hash_elem;
+struct _cuckoo_hash_arena;
+struct _cuckoo_hash_sync;
+
+
+/*
+  Stash slot.  Treat it as opaque.
+*/
+struct _cuckoo_hash_stash
+{
+  struct cuckoo_hash_item hash_item;
+  uint32_t hash1;
+  uint32_t hash2;
+};
+
+
+#define CUCKOO_HASH_STASH_SIZE  4
 
 
+/*
+  The table is kept as two parallel arrays: table holds only the pair
+  of hashes of every slot, so that the hashes of a whole bin fit into
+  a single cache line, and items holds the elements themselves and is
+  accessed only when the hashes match.  Items are item_size bytes
+  apart, as each is followed by the inline copy of its key with the
+  inline_keys option.
+
+  While the table grows incrementally, old_table and old_items hold the
+  previous table, and migrated has a bit set for each of its bins that
+  has been copied to the new table.
+
+  Elements for which there's no room in the table go to the small
+  stash, which is checked by lookups only when it's not empty.  The
+  table grows only when the stash is full, and then the stash is
+  emptied into the table.
+
+  sync is the state shared with readers in the concurrent mode, NULL
+  otherwise.
+*/
 struct cuckoo_hash
 {
   struct _cuckoo_hash_elem *table;
+  struct cuckoo_hash_item *items;
+  cuckoo_hash_function *hash_function;
+  uint32_t seed1;
+  uint32_t seed2;
   size_t count;
+  struct _cuckoo_hash_elem *old_table;
+  struct cuckoo_hash_item *old_items;
+  unsigned char *migrated;
+  size_t unmigrated;
+  uint32_t migrate_cursor;
+  unsigned int migrate_step;
+  double shrink_load;
+  bool shrink_pending;
+  struct _cuckoo_hash_stash stash[CUCKOO_HASH_STASH_SIZE];
+  unsigned int stash_count;
+  enum cuckoo_hash_storage storage;
+  struct cuckoo_hash_allocator allocator;
+  struct cuckoo_hash_growth growth;
+  struct _cuckoo_hash_arena *arena;
+  struct _cuckoo_hash_sync *sync;
+  unsigned int inline_keys;
+  unsigned int item_size;
   unsigned int bin_size;
+  bool fixed_bin_size;
+  unsigned char choices;
   unsigned char power;
 };
 
@@ -54,7 +309,8 @@ extern "C" {
   cuckoo_hash_init(hash, power):
 
   Initialize the hash.  power controls the initial hash table size,
-  which is (bin_size << power), i.e., 4*2^power.  Zero means one.
+  which is (bin_size << power), i.e., 4*2^power by default.  Zero
+  means one.
 
   Return true on success, false if initialization failed (memory
   exhausted).
@@ -63,6 +319,65 @@ bool
 cuckoo_hash_init(struct cuckoo_hash *hash, unsigned char power);
 
 
+/*
+  cuckoo_hash_init_with(hash, power, options):
+
+  Same as cuckoo_hash_init(), but take the options described in struct
+  cuckoo_hash_options above.  options may be NULL, which is the same
+  as calling cuckoo_hash_init().  Return false also if inline_keys,
+  bin_size, choices or the growth policy is out of range.
+*/
+bool
+cuckoo_hash_init_with(struct cuckoo_hash *hash, unsigned char power,
+                      const struct cuckoo_hash_options *options);
+
+
+/*
+  cuckoo_hash_init_for(hash, count, load, options):
+
+  Same as cuckoo_hash_init_with(), but size the table to hold count
+  elements at the given load factor (0 < load <= 1) without growing.
+  Every bin size and number of choices has the highest load tables are
+  sized for, e.g., 0.9 for bins of four slots and two choices, 0.97
+  for bins of eight slots and two choices, and 0.98 for bins of four
+  slots and three choices.  Unless options set bin_size, loads above
+  that of bins of four slots get bins of eight slots.  Loads above
+  that of the bins are treated as that, as inserts start to fail
+  beyond it.
+
+  Return false also if load is out of range.
+*/
+bool
+cuckoo_hash_init_for(struct cuckoo_hash *hash, size_t count, double load,
+                     const struct cuckoo_hash_options *options);
+
+
+/*
+  Built-in hash functions.
+
+  cuckoo_hash_lookup3: Bob Jenkins' lookup3 hashlittle2(), the default.
+
+  cuckoo_hash_crc32c: CRC32C of the key in two lanes, computed with the
+  SSE4.2 crc32 instruction when the CPU has it.  Fast on short keys.
+
+  cuckoo_hash_mix64: 64-bit multiply-mix hash in the style of wyhash.
+  Fast on keys of any length on 64-bit CPUs.
+*/
+void
+cuckoo_hash_lookup3(const void *key, size_t key_len,
+                    uint32_t *h1, uint32_t *h2);
+
+
+void
+cuckoo_hash_crc32c(const void *key, size_t key_len,
+                   uint32_t *h1, uint32_t *h2);
+
+
+void
+cuckoo_hash_mix64(const void *key, size_t key_len,
+                  uint32_t *h1, uint32_t *h2);
+
+
 /*
   cuckoo_hash_destroy(hash):
 
@@ -72,6 +387,54 @@ void
 cuckoo_hash_destroy(const struct cuckoo_hash *hash);
 
 
+/*
+  cuckoo_hash_reserve(hash, count, load):
+
+  Grow the table so that it holds count elements at the given load
+  factor without growing, as cuckoo_hash_init_for() would size it.
+  This makes a bulk load of a known number of elements cheaper.  An
+  empty table is reallocated, and may also get bigger bins unless its
+  bin_size was set.  A nonempty one keeps its bin size, and is never
+  shrunk.
+
+  Return true on success, false if memory is exhausted or load is out
+  of range.
+*/
+bool
+cuckoo_hash_reserve(struct cuckoo_hash *hash, size_t count, double load);
+
+
+/*
+  cuckoo_hash_shrink_to_fit(hash):
+
+  Rebuild the table into the smallest one that holds its elements at
+  the highest load factor cuckoo_hash_init_for() sizes tables for with
+  the same bin size.  Keys are not hashed again.  Do this after
+  removing many elements to release memory and make iteration faster.
+  Pointers to the elements are invalidated, and so are pointers to the
+  keys with the copy_keys option, as the key arena is compacted too.
+
+  Return true on success, false if memory is exhausted, in which case
+  the table is left intact.
+*/
+bool
+cuckoo_hash_shrink_to_fit(struct cuckoo_hash *hash);
+
+
+/*
+  cuckoo_hash_migrate(hash, bins):
+
+  Migrate up to bins bins to the new table when the table grows
+  incrementally (see migrate_step in struct cuckoo_hash_options).
+  Inserts do this by themselves, call it to complete the migration
+  sooner, e.g., when idle.  Pass SIZE_MAX to complete it at once.
+
+  Return the number of bins left to migrate.
+*/
+size_t
+cuckoo_hash_migrate(struct cuckoo_hash *hash, size_t bins);
+
+
 /*
   cuckoo_hash_count(hash):
 
@@ -85,6 +448,29 @@ cuckoo_hash_count(struct cuckoo_hash *hash)
 }
 
 
+/*
+  cuckoo_hash_load_factor(hash):
+  cuckoo_hash_growth_policy(hash):
+
+  Return the load factor of the hash, and its growth policy, with
+  factor set to the one in effect.
+*/
+static inline
+double
+cuckoo_hash_load_factor(const struct cuckoo_hash *hash)
+{
+  return (double) hash->count / ((size_t) hash->bin_size << hash->power);
+}
+
+
+static inline
+const struct cuckoo_hash_growth *
+cuckoo_hash_growth_policy(const struct cuckoo_hash *hash)
+{
+  return &hash->growth;
+}
+
+
 /*
   cuckoo_hash_insert(hash, key, key_len, value):
 
@@ -115,6 +501,293 @@ cuckoo_hash_lookup(const struct cuckoo_hash *hash,
                    const void *key, size_t key_len);
 
 
+/*
+  cuckoo_hash_hash(hash, key, key_len):
+
+  Compute the hash value of the key for use with the *_hashed()
+  functions below, which then don't have to hash the key again.  This
+  pays off when the same key is passed to several operations, e.g.,
+  lookup followed by insert, or when the hash is kept next to the key.
+
+  The hash value is only meaningful for the table it was computed for,
+  as tables may hash keys differently.  When the table picks a new
+  seed, hash values computed before are detected as stale, and the
+  *_hashed() functions then hash the key themselves.
+*/
+struct cuckoo_hash_hashval
+cuckoo_hash_hash(const struct cuckoo_hash *hash,
+                 const void *key, size_t key_len);
+
+
+/*
+  cuckoo_hash_insert_hashed(hash, key, key_len, value, hashval):
+  cuckoo_hash_lookup_hashed(hash, key, key_len, hashval):
+
+  Same as cuckoo_hash_insert() and cuckoo_hash_lookup(), but use the
+  hash value of the key previously computed with cuckoo_hash_hash().
+  The key is still required to compare it with the keys in the hash.
+
+  There's no *_hashed() variant of cuckoo_hash_remove(), as it doesn't
+  hash the key.
+*/
+struct cuckoo_hash_item *
+cuckoo_hash_insert_hashed(struct cuckoo_hash *hash,
+                          const void *key, size_t key_len, void *value,
+                          struct cuckoo_hash_hashval hashval);
+
+
+struct cuckoo_hash_item *
+cuckoo_hash_lookup_hashed(const struct cuckoo_hash *hash,
+                          const void *key, size_t key_len,
+                          struct cuckoo_hash_hashval hashval);
+
+
+/*
+  cuckoo_hash_prefetch_hashed(hash, hashval):
+
+  Prefetch the bins where the key with the given hash value may
+  reside, so that a later cuckoo_hash_lookup_hashed() or
+  cuckoo_hash_insert_hashed() doesn't have to wait for memory.  Issue
+  it for several keys before looking any of them up.
+*/
+void
+cuckoo_hash_prefetch_hashed(const struct cuckoo_hash *hash,
+                            struct cuckoo_hash_hashval hashval);
+
+
+/*
+  cuckoo_hash_lookup_batch(hash, keys, key_lens, n, items):
+
+  Lookup n keys at once.  keys[i] and key_lens[i] give the i-th key,
+  and the result of its lookup, as would be returned by
+  cuckoo_hash_lookup(), is stored to items[i].
+
+  Keys are processed in small groups: all keys in a group are hashed
+  and their bins are prefetched before any of them is looked up, while
+  the keys of the next group are being prefetched, so that cache misses
+  of different keys overlap.  This is faster than a
+  loop of cuckoo_hash_lookup() calls when the table doesn't fit into
+  the cache.
+
+  Return the number of keys found.
+*/
+size_t
+cuckoo_hash_lookup_batch(const struct cuckoo_hash *hash,
+                         const void *const keys[], const size_t key_lens[],
+                         size_t n, struct cuckoo_hash_item *items[]);
+
+
+/*
+  cuckoo_hash_build_parallel(hash, items, n, nthreads):
+
+  Insert the n items, as a loop of cuckoo_hash_insert() calls would,
+  with nthreads threads, zero meaning one per online CPU.  The table is
+  first grown to hold the items at a load of 90%, or of max_load of
+  the growth policy if that's lower.  Then the keys are hashed in
+  parallel, split into ranges of bins, and placed into their ranges by
+  the threads at once, while the few keys that find their bins full
+  are inserted at the end by the calling thread.  Of the items with
+  the same key the first is kept.
+
+  Only the hashing is parallel when the table isn't empty, or copies
+  keys (copy_keys option).  Fewer threads are used for small n, and
+  without POSIX threads the build runs in the calling thread.  The
+  build takes 32 bytes of scratch memory per item on 64-bit systems,
+  allocated as the table is (allocator and storage options), and
+  falls back to single inserts when that can't be allocated.  No
+  other function, cuckoo_hash_lookup_shared() included, may be called
+  on the hash meanwhile.
+
+  Return true on success, false if memory is exhausted, in which case
+  only some of the items are inserted.
+*/
+bool
+cuckoo_hash_build_parallel(struct cuckoo_hash *hash,
+                           const struct cuckoo_hash_item items[], size_t n,
+                           unsigned int nthreads);
+
+
+/*
+  cuckoo_hash_reader_register(hash, reader):
+  cuckoo_hash_reader_unregister(hash, reader):
+
+  Register the reader with the concurrent hash before passing it to
+  the cuckoo_hash_*_shared() functions, and unregister it when done
+  with them, before the reader memory is released.  A reader is used by
+  one thread at a time, so give every thread a reader of its own.
+  Both may be called by any thread at any time, but not concurrently
+  with cuckoo_hash_destroy().  For tables that are not concurrent they
+  do nothing.
+*/
+void
+cuckoo_hash_reader_register(struct cuckoo_hash *hash,
+                            struct cuckoo_hash_reader *reader);
+
+
+void
+cuckoo_hash_reader_unregister(struct cuckoo_hash *hash,
+                              struct cuckoo_hash_reader *reader);
+
+
+/*
+  cuckoo_hash_lookup_shared(hash, reader, key, key_len, hash_item):
+
+  Lookup given key in the concurrent hash (see concurrent in struct
+  cuckoo_hash_options), and copy the element to *hash_item if it is
+  found.  Lookups may run in any number of threads, each with its own
+  reader, while one thread at a time calls the other cuckoo_hash_*
+  functions, which then are the only ones to access the table
+  directly.  Lookups take no locks and write no memory shared with
+  other threads besides the reader, so they scale with the number of
+  cores.
+
+  Every bin has a version, bumped twice by any change to the bin, and
+  a lookup reads the versions of the bins of the key before and after
+  scanning them, and retries if any has changed in between, e.g., when
+  an insert has moved an element from one bin of the key to another
+  meanwhile.  Bins share the versions, so a version is bumped also by
+  changes to other bins.  When the table grows or is rebuilt, the new
+  one is published at once, and the old one is freed only when every
+  lookup that may still read it is over.
+
+  The same holds for keys and values of removed elements: a lookup may
+  still compare the key, or return the value, until the writer calls
+  cuckoo_hash_synchronize().  Values assigned by the writer to
+  existing elements are seen by lookups either before or after the
+  assignment.
+
+  Return true if the key was found, false otherwise.  For tables that
+  are not concurrent this is cuckoo_hash_lookup(), and reader may be
+  NULL.
+*/
+bool
+cuckoo_hash_lookup_shared(const struct cuckoo_hash *hash,
+                          struct cuckoo_hash_reader *reader,
+                          const void *key, size_t key_len,
+                          struct cuckoo_hash_item *hash_item);
+
+
+/*
+  cuckoo_hash_insert_shared(hash, reader, key, key_len, value, hash_item):
+  cuckoo_hash_remove_shared(hash, reader, key, key_len, hash_item):
+
+  Insert and remove elements of the concurrent hash from any number of
+  threads at once, each with its own reader, while other threads look
+  keys up with cuckoo_hash_lookup_shared().  Meanwhile no other
+  cuckoo_hash_* function that changes the hash may be called, nor
+  cuckoo_hash_lookup() and cuckoo_hash_next(), as elements move.
+
+  A writer locks only the bins the key may be in, and when they are
+  full, the bins of every move that makes room there, one move at a
+  time, so writers of different keys seldom wait for each other.  The
+  table grows when there's no room, and the writers that wait for it
+  meanwhile help to copy it.  The stash isn't used by shared inserts,
+  nor is the table reseeded or shrunk by them.
+
+  cuckoo_hash_insert_shared() returns NULL on success, hash_item with
+  a copy of the existing element with the same key, or the constant
+  CUCKOO_HASH_FAILED when operation failed (memory exhausted).
+  cuckoo_hash_remove_shared() returns true if the key was found, and
+  copies the removed element to *hash_item unless hash_item is NULL.
+  As with lookups, keys and values of removed elements may be freed
+  only after cuckoo_hash_synchronize().
+
+  For tables that are not concurrent these are cuckoo_hash_insert(),
+  and cuckoo_hash_remove() of the key, and reader may be NULL.
+*/
+struct cuckoo_hash_item *
+cuckoo_hash_insert_shared(struct cuckoo_hash *hash,
+                          struct cuckoo_hash_reader *reader,
+                          const void *key, size_t key_len, void *value,
+                          struct cuckoo_hash_item *hash_item);
+
+
+bool
+cuckoo_hash_remove_shared(struct cuckoo_hash *hash,
+                          struct cuckoo_hash_reader *reader,
+                          const void *key, size_t key_len,
+                          struct cuckoo_hash_item *hash_item);
+
+
+/*
+  Update function for cuckoo_hash_upsert_with(): change *value in
+  place.  found tells whether the key is in the hash; when it isn't,
+  *value is NULL, and the function returns whether to insert the key
+  with the new value.  For existing keys the result is ignored.
+*/
+typedef bool cuckoo_hash_update_function(void **value, bool found,
+                                         void *ctx);
+
+
+/*
+  cuckoo_hash_upsert_with(hash, reader, key, key_len, fn, ctx):
+
+  Call fn(&value, found, ctx) on the value of the key, inserting the
+  key when it is missing and fn asks to, and do it atomically with
+  respect to other shared writes of the concurrent hash: fn runs with
+  the bins of the key locked, exactly once.  So fn must be short, and
+  must not call any cuckoo_hash_* function.  Lookups see the value
+  either before or after the update.  The key is hashed once.
+
+  Return false if the key couldn't be inserted (memory exhausted),
+  true otherwise.  The same rules as for cuckoo_hash_insert_shared()
+  apply, and for tables that are not concurrent this is a lookup
+  followed by an insert, and reader may be NULL.
+*/
+bool
+cuckoo_hash_upsert_with(struct cuckoo_hash *hash,
+                        struct cuckoo_hash_reader *reader,
+                        const void *key, size_t key_len,
+                        cuckoo_hash_update_function *fn, void *ctx);
+
+
+/*
+  cuckoo_hash_fetch_add(hash, reader, key, key_len, delta, old):
+
+  Treat the value of the key as an uintptr_t counter, add delta to it,
+  and store the previous value to *old unless old is NULL.  A missing
+  key is inserted with the value delta, as if it were there with zero.
+  Return false if the key couldn't be inserted (memory exhausted).
+  This is cuckoo_hash_upsert_with() with the addition as fn.
+*/
+bool
+cuckoo_hash_fetch_add(struct cuckoo_hash *hash,
+                      struct cuckoo_hash_reader *reader,
+                      const void *key, size_t key_len,
+                      uintptr_t delta, uintptr_t *old);
+
+
+/*
+  cuckoo_hash_compare_exchange_value(hash, reader, key, key_len,
+                                     expected, desired):
+
+  If the value of the key equals *expected, replace it with desired
+  and return true, otherwise store the value to *expected and return
+  false.  A missing key is taken to have the value NULL, so when
+  *expected is NULL, the key is inserted with the value desired.
+  Should that fail (memory exhausted), false is returned with
+  *expected still NULL.  This is cuckoo_hash_upsert_with() with the
+  comparison as fn.
+*/
+bool
+cuckoo_hash_compare_exchange_value(struct cuckoo_hash *hash,
+                                   struct cuckoo_hash_reader *reader,
+                                   const void *key, size_t key_len,
+                                   void **expected, void *desired);
+
+
+/*
+  cuckoo_hash_synchronize(hash):
+
+  Wait until lookups and shared writes of the concurrent hash that
+  have started before the call are over, and free the tables they
+  could read.  Call it after removing elements and before freeing
+  their keys or values.
+*/
+void
+cuckoo_hash_synchronize(struct cuckoo_hash *hash);
+
+
 /*
   cuckoo_hash_remove(hash, hash_item):
 
@@ -137,6 +810,10 @@ cuckoo_hash_lookup(const struct cuckoo_hash *hash,
     free(item->value);
 
   (that (void *) cast above is to cast away the const qualifier).
+
+  With the copy_keys option the key is owned by the hash, and is
+  released by cuckoo_hash_remove(): don't access item->key after the
+  call.
 */
 void
 cuckoo_hash_remove(struct cuckoo_hash *hash,
@@ -0,0 +1,401 @@
+/*
+  Copyright (C) 2010 Tomash Brechko.  All rights reserved.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cuckoo_hash_compact.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define BIN_SIZE  CUCKOO_HASH_COMPACT_BIN_SIZE
+#define CACHE_LINE_SIZE  64
+
+
+/*
+  Number of elements moved by an insert before the table grows.
+*/
+#define MAX_KICKS  500
+
+
+/*
+  Element in flight during insertion.
+*/
+struct entry
+{
+  struct cuckoo_hash_compact_item item;
+  void *value;
+};
+
+
+static inline
+uint32_t
+fingerprint(const struct cuckoo_hash_compact *hash,
+            const void *key, size_t key_len)
+{
+  uint32_t h1 = hash->seed1, h2 = hash->seed2;
+  hash->hash_function(key, key_len, &h1, &h2);
+
+  /* Zero marks empty slots.  */
+  return (h1 != 0 ? h1 : h2 | 1);
+}
+
+
+/*
+  Return the other bin of the element with the given fingerprint that
+  is in bin index.  The XORed value is odd, so the two bins differ.
+*/
+static inline
+uint32_t
+alt_bin(uint32_t index, uint32_t fp, uint32_t mask)
+{
+  /* Finalization mix of MurmurHash3.  */
+  fp ^= fp >> 16;
+  fp *= 0x85ebca6b;
+  fp ^= fp >> 13;
+  fp *= 0xc2b2ae35;
+  fp ^= fp >> 16;
+
+  return index ^ ((fp | 1) & mask);
+}
+
+
+static inline
+size_t
+slot_count(const struct cuckoo_hash_compact *hash)
+{
+  return (size_t) BIN_SIZE << hash->power;
+}
+
+
+static
+bool
+alloc_table(struct cuckoo_hash_compact *hash, bool set)
+{
+  size_t count = slot_count(hash);
+  void *items;
+  if (posix_memalign(&items, CACHE_LINE_SIZE, count * sizeof(*hash->items))
+      != 0)
+    return false;
+
+  hash->values = NULL;
+  if (! set)
+    {
+      hash->values = malloc(count * sizeof(*hash->values));
+      if (! hash->values)
+        {
+          free(items);
+          return false;
+        }
+    }
+
+  hash->items = items;
+  memset(hash->items, 0, count * sizeof(*hash->items));
+
+  return true;
+}
+
+
+bool
+cuckoo_hash_compact_init(struct cuckoo_hash_compact *hash,
+                         unsigned char power,
+                         const struct cuckoo_hash_compact_options *options)
+{
+  extern uint64_t _cuckoo_hash_random_seed(const void *salt);
+
+  static const struct cuckoo_hash_compact_options default_options;
+  if (! options)
+    options = &default_options;
+
+  if (power == 0)
+    power = 1;
+
+  hash->hash_function = (options->hash_function
+                         ? options->hash_function : cuckoo_hash_lookup3);
+  uint64_t seed = (options->seed != 0
+                   ? options->seed : _cuckoo_hash_random_seed(hash));
+  hash->seed1 = (uint32_t) seed;
+  hash->seed2 = (uint32_t) (seed >> 32);
+  hash->count = 0;
+  hash->power = power;
+
+  return alloc_table(hash, options->set);
+}
+
+
+void
+cuckoo_hash_compact_destroy(const struct cuckoo_hash_compact *hash)
+{
+  free(hash->items);
+  free(hash->values);
+}
+
+
+static inline
+struct cuckoo_hash_compact_item *
+lookup_bin(const struct cuckoo_hash_compact *hash, uint32_t index,
+           const void *key, uint32_t key_len, uint32_t fp)
+{
+  struct cuckoo_hash_compact_item *bin = hash->items + index * BIN_SIZE;
+  for (int i = 0; i < BIN_SIZE; ++i)
+    {
+      if (bin[i]._fingerprint == fp && bin[i].key_len == key_len
+          && memcmp(bin[i].key, key, key_len) == 0)
+        return &bin[i];
+    }
+
+  return NULL;
+}
+
+
+static inline
+struct cuckoo_hash_compact_item *
+lookup(const struct cuckoo_hash_compact *hash,
+       const void *key, uint32_t key_len, uint32_t fp)
+{
+  uint32_t mask = (1U << hash->power) - 1;
+  uint32_t index = fp & mask;
+
+  struct cuckoo_hash_compact_item *hash_item =
+    lookup_bin(hash, index, key, key_len, fp);
+  if (hash_item)
+    return hash_item;
+
+  return lookup_bin(hash, alt_bin(index, fp, mask), key, key_len, fp);
+}
+
+
+struct cuckoo_hash_compact_item *
+cuckoo_hash_compact_lookup(const struct cuckoo_hash_compact *hash,
+                           const void *key, size_t key_len)
+{
+  if (key_len > UINT32_MAX)
+    return NULL;
+
+  return lookup(hash, key, key_len, fingerprint(hash, key, key_len));
+}
+
+
+static inline
+bool
+store_free(struct cuckoo_hash_compact *hash, uint32_t index,
+           const struct entry *entry)
+{
+  size_t pos = (size_t) index * BIN_SIZE;
+  for (int i = 0; i < BIN_SIZE; ++i, ++pos)
+    {
+      if (hash->items[pos]._fingerprint == 0)
+        {
+          hash->items[pos] = entry->item;
+          if (hash->values)
+            hash->values[pos] = entry->value;
+
+          return true;
+        }
+    }
+
+  return false;
+}
+
+
+static inline
+void
+swap_slot(struct cuckoo_hash_compact *hash, size_t pos, struct entry *entry)
+{
+  struct cuckoo_hash_compact_item item = hash->items[pos];
+  hash->items[pos] = entry->item;
+  entry->item = item;
+
+  if (hash->values)
+    {
+      void *value = hash->values[pos];
+      hash->values[pos] = entry->value;
+      entry->value = value;
+    }
+}
+
+
+/*
+  Place the entry by a random walk: when both bins are full, an
+  element of one of them is kicked out to its other bin, and so on.
+  The walk follows the fingerprints, not the keys.  If no free slot is
+  found after MAX_KICKS moves, the moves are undone and false is
+  returned.
+*/
+static
+bool
+place(struct cuckoo_hash_compact *hash, struct entry *entry)
+{
+  uint32_t mask = (1U << hash->power) - 1;
+  uint32_t index = entry->item._fingerprint & mask;
+  if (store_free(hash, index, entry))
+    return true;
+
+  index = alt_bin(index, entry->item._fingerprint, mask);
+  if (store_free(hash, index, entry))
+    return true;
+
+  size_t path[MAX_KICKS];
+  int kicks;
+  for (kicks = 0; kicks < MAX_KICKS; ++kicks)
+    {
+      /* Pick the victim pseudo-randomly.  */
+      unsigned int slot = (entry->item._fingerprint >> 29) ^ kicks;
+      size_t pos = (size_t) index * BIN_SIZE + slot % BIN_SIZE;
+
+      swap_slot(hash, pos, entry);
+      path[kicks] = pos;
+
+      index = alt_bin(index, entry->item._fingerprint, mask);
+      if (store_free(hash, index, entry))
+        return true;
+    }
+
+  while (kicks-- > 0)
+    swap_slot(hash, path[kicks], entry);
+
+  return false;
+}
+
+
+/*
+  Whether both bins of the fingerprint, which are full, hold only
+  elements with the same fingerprint.  Those are in the same two bins
+  in a table of any size, so growing it doesn't help.
+*/
+static
+bool
+crowded(const struct cuckoo_hash_compact *hash, uint32_t fp)
+{
+  uint32_t mask = (1U << hash->power) - 1;
+  uint32_t index = fp & mask;
+  const struct cuckoo_hash_compact_item *bin1 =
+    hash->items + (size_t) index * BIN_SIZE;
+  const struct cuckoo_hash_compact_item *bin2 =
+    hash->items + (size_t) alt_bin(index, fp, mask) * BIN_SIZE;
+  for (int i = 0; i < BIN_SIZE; ++i)
+    {
+      if (bin1[i]._fingerprint != fp || bin2[i]._fingerprint != fp)
+        return false;
+    }
+
+  return true;
+}
+
+
+/*
+  Double the table, or grow it further should the elements not all
+  fit.  Elements are placed by their fingerprints, which give both of
+  their bins in a table of any size.  On failure the hash is left
+  intact.
+*/
+static
+bool
+grow_table(struct cuckoo_hash_compact *hash)
+{
+  struct cuckoo_hash_compact fresh = *hash;
+  for (;;)
+    {
+      if (fresh.power >= 31)
+        return false;
+
+      ++fresh.power;
+      if (! alloc_table(&fresh, hash->values == NULL))
+        return false;
+
+      size_t count = slot_count(hash);
+      size_t pos;
+      for (pos = 0; pos < count; ++pos)
+        {
+          if (hash->items[pos]._fingerprint == 0)
+            continue;
+
+          struct entry entry = {
+            .item = hash->items[pos],
+            .value = (hash->values ? hash->values[pos] : NULL)
+          };
+          if (! place(&fresh, &entry))
+            break;
+        }
+
+      if (pos == count)
+        break;
+
+      cuckoo_hash_compact_destroy(&fresh);
+    }
+
+  cuckoo_hash_compact_destroy(hash);
+  *hash = fresh;
+
+  return true;
+}
+
+
+struct cuckoo_hash_compact_item *
+cuckoo_hash_compact_insert(struct cuckoo_hash_compact *hash,
+                           const void *key, size_t key_len, void *value)
+{
+  if (key_len > UINT32_MAX)
+    return CUCKOO_HASH_FAILED;
+
+  uint32_t fp = fingerprint(hash, key, key_len);
+  struct cuckoo_hash_compact_item *hash_item =
+    lookup(hash, key, key_len, fp);
+  if (hash_item)
+    return hash_item;
+
+  struct entry entry = {
+    .item = { .key = key, .key_len = key_len, ._fingerprint = fp },
+    .value = value
+  };
+  while (! place(hash, &entry))
+    {
+      if (crowded(hash, fp) || ! grow_table(hash))
+        return CUCKOO_HASH_FAILED;
+    }
+
+  ++hash->count;
+
+  return NULL;
+}
+
+
+void
+cuckoo_hash_compact_remove(struct cuckoo_hash_compact *hash,
+                           const struct cuckoo_hash_compact_item *hash_item)
+{
+  if (hash_item)
+    {
+      hash->items[hash_item - hash->items]._fingerprint = 0;
+      --hash->count;
+    }
+}
+
+
+struct cuckoo_hash_compact_item *
+cuckoo_hash_compact_next(const struct cuckoo_hash_compact *hash,
+                         const struct cuckoo_hash_compact_item *hash_item)
+{
+  size_t count = slot_count(hash);
+  size_t pos = (hash_item != NULL ? hash_item - hash->items + 1 : 0);
+  for (; pos < count; ++pos)
+    {
+      if (hash->items[pos]._fingerprint != 0)
+        return &hash->items[pos];
+    }
+
+  return NULL;
+}
@@ -0,0 +1,202 @@
+/*
+  Copyright (C) 2010 Tomash Brechko.  All rights reserved.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CUCKOO_HASH_COMPACT_H
+#define _CUCKOO_HASH_COMPACT_H 1
+
+#include "cuckoo_hash.h"
+
+
+/*
+  Compact table: a cuckoo hash that trades features for memory.  A
+  slot takes 16 bytes, the key pointer, a 32-bit key length and a
+  32-bit fingerprint of the key, and values, when there are any, are
+  kept in a separate array.  That is 24 bytes per slot for a map, and
+  16 bytes for a set, against 32 bytes of struct cuckoo_hash.
+
+  Only the fingerprint is stored instead of a pair of hashes: it
+  selects the first bin of the key, and the alternate bin is the
+  current one XORed with a hash of the fingerprint (partial-key cuckoo
+  hashing), so elements can be moved and the table can grow without
+  hashing the keys again.  A bin of four slots fills a cache line.
+
+  There's no stash, incremental growth, shrinking, or any of the
+  storage options of struct cuckoo_hash.
+*/
+
+
+/*
+  Slot of the compact table.  Treat _fingerprint as opaque, zero
+  marks an empty slot.
+*/
+struct cuckoo_hash_compact_item
+{
+  const void *key;
+  uint32_t key_len;
+  uint32_t _fingerprint;
+};
+
+
+/*
+  Options for cuckoo_hash_compact_init().  Zero-initialized options
+  give the defaults.
+
+  hash_function: the hash function, NULL means cuckoo_hash_lookup3.
+
+  seed: the initial values passed to the hash function.  Zero means
+  pick a random seed.
+
+  set: don't keep values, only keys.
+*/
+struct cuckoo_hash_compact_options
+{
+  cuckoo_hash_function *hash_function;
+  uint64_t seed;
+  bool set;
+};
+
+
+struct cuckoo_hash_compact
+{
+  struct cuckoo_hash_compact_item *items;
+  void **values;
+  cuckoo_hash_function *hash_function;
+  uint32_t seed1;
+  uint32_t seed2;
+  size_t count;
+  unsigned char power;
+};
+
+
+#define CUCKOO_HASH_COMPACT_BIN_SIZE  4
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif  /* __cplusplus */
+
+
+/*
+  cuckoo_hash_compact_init(hash, power, options):
+
+  Initialize the compact hash with CUCKOO_HASH_COMPACT_BIN_SIZE << power
+  slots.  Zero power means one.  options may be NULL for the defaults.
+
+  Return true on success, false if memory is exhausted.
+*/
+bool
+cuckoo_hash_compact_init(struct cuckoo_hash_compact *hash,
+                         unsigned char power,
+                         const struct cuckoo_hash_compact_options *options);
+
+
+/*
+  cuckoo_hash_compact_destroy(hash):
+
+  Destroy the hash, i.e., free memory.
+*/
+void
+cuckoo_hash_compact_destroy(const struct cuckoo_hash_compact *hash);
+
+
+/*
+  cuckoo_hash_compact_count(hash):
+
+  Return number of elements in the hash.
+*/
+static inline
+size_t
+cuckoo_hash_compact_count(const struct cuckoo_hash_compact *hash)
+{
+  return hash->count;
+}
+
+
+/*
+  cuckoo_hash_compact_insert(hash, key, key_len, value):
+
+  Same as cuckoo_hash_insert().  value is ignored by sets.  Keys
+  longer than UINT32_MAX bytes can't be inserted, and the result for
+  them is CUCKOO_HASH_FAILED.  So is the result for a key whose two
+  bins are full of keys with the same fingerprint, which no table
+  size would separate: at most 2 * CUCKOO_HASH_COMPACT_BIN_SIZE keys
+  may share a fingerprint, which only a poor hash function, or keys
+  crafted against a known seed, make happen.
+*/
+struct cuckoo_hash_compact_item *
+cuckoo_hash_compact_insert(struct cuckoo_hash_compact *hash,
+                           const void *key, size_t key_len, void *value);
+
+
+/*
+  cuckoo_hash_compact_lookup(hash, key, key_len):
+
+  Same as cuckoo_hash_lookup().
+*/
+struct cuckoo_hash_compact_item *
+cuckoo_hash_compact_lookup(const struct cuckoo_hash_compact *hash,
+                           const void *key, size_t key_len);
+
+
+/*
+  cuckoo_hash_compact_value(hash, hash_item):
+
+  Return the pointer to the value of the element, which may be
+  assigned to, or NULL for sets.
+*/
+static inline
+void **
+cuckoo_hash_compact_value(const struct cuckoo_hash_compact *hash,
+                          const struct cuckoo_hash_compact_item *hash_item)
+{
+  return (hash->values ? &hash->values[hash_item - hash->items] : NULL);
+}
+
+
+/*
+  cuckoo_hash_compact_remove(hash, hash_item):
+
+  Same as cuckoo_hash_remove().
+*/
+void
+cuckoo_hash_compact_remove(struct cuckoo_hash_compact *hash,
+                           const struct cuckoo_hash_compact_item *hash_item);
+
+
+/*
+  cuckoo_hash_compact_next(hash, hash_item):
+  cuckoo_hash_compact_each(it, hash):
+
+  Same as cuckoo_hash_next() and cuckoo_hash_each().
+*/
+struct cuckoo_hash_compact_item *
+cuckoo_hash_compact_next(const struct cuckoo_hash_compact *hash,
+                         const struct cuckoo_hash_compact_item *hash_item);
+
+
+#define cuckoo_hash_compact_each(it, hash)              \
+  (it) = cuckoo_hash_compact_next((hash), NULL);        \
+  (it) != NULL;                                         \
+  (it) = cuckoo_hash_compact_next((hash), (it))
+
+
+#ifdef __cplusplus
+}      /* extern "C" */
+#endif  /* __cplusplus */
+
+
+#endif  /* ! _CUCKOO_HASH_COMPACT_H */
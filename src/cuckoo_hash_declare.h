@@ -0,0 +1,436 @@
+/*
+  Copyright (C) 2010 Tomash Brechko.  All rights reserved.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CUCKOO_HASH_DECLARE_H
+#define _CUCKOO_HASH_DECLARE_H 1
+
+#include "cuckoo_hash.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+  CUCKOO_HASH_DECLARE(name, key_t, value_t, hash_fn, eq_fn):
+
+  Define a cuckoo hash with keys and values of the given types stored
+  by value, and all operations inlined and specialized for them.  This
+  suits integer IDs and small structures, which would otherwise have
+  to be passed by pointer and length, hashed byte by byte and compared
+  with memcmp().  Use it at file scope:
+
+    CUCKOO_HASH_DECLARE(id_map, uint64_t, void *,
+                        cuckoo_hash_int_hash, cuckoo_hash_int_eq);
+
+  hash_fn(key, seed) should return a 64-bit hash of the key that
+  depends on the 64-bit seed; its two halves select the two bins of
+  the key.  eq_fn(a, b) should return whether two keys are equal.
+  Both may be functions or macros.  For integer keys up to 64 bits use
+  cuckoo_hash_int_hash() and cuckoo_hash_int_eq() below.
+
+  This defines
+
+    struct name_slot { key_t key; value_t value; };
+    struct name;
+
+    bool name_init(struct name *hash, unsigned char power,
+                   uint64_t seed);
+    void name_destroy(const struct name *hash);
+    size_t name_count(const struct name *hash);
+    struct name_slot *name_insert(struct name *hash,
+                                  key_t key, value_t value);
+    struct name_slot *name_lookup(const struct name *hash, key_t key);
+    void name_remove(struct name *hash, const struct name_slot *slot);
+    struct name_slot *name_next(const struct name *hash,
+                                const struct name_slot *slot);
+
+  which behave like their cuckoo_hash_* counterparts: init creates
+  (bin size << power) slots, zero seed means pick a random one, and
+  insert returns NULL on success, the slot of the existing key, or
+  CUCKOO_HASH_FAILED.  Iterate with cuckoo_hash_declare_each().
+
+  Bins have four slots, as in struct cuckoo_hash.  Instead of the
+  pair of hashes, a bitmask per bin tells which slots are occupied,
+  and hashes are recomputed when elements are moved.  Inserts place
+  elements with a bounded random walk, which is undone if it fails,
+  and the table then doubles.  Keys with equal hash_fn() values share
+  both bins in a table of any size, so an insert fails with
+  CUCKOO_HASH_FAILED rather than growing the table when both bins of
+  the key are full of such keys.  There's no stash, incremental
+  growth, shrinking, or any of the options of struct cuckoo_hash.
+
+  The random walk is a copy of the one of cuckoo_hash_compact.c rather
+  than shared with it: it has to be expanded for key_t and hash_fn to
+  be inlined, which is the point of these tables, while the compact
+  table moves fingerprints, and struct cuckoo_hash searches over the
+  stored pairs of hashes breadth-first instead.
+*/
+
+
+#define CUCKOO_HASH_DECLARE_BIN_SIZE  4
+#define CUCKOO_HASH_DECLARE_MAX_KICKS  500
+
+
+/*
+  Hash and equality of integer keys for CUCKOO_HASH_DECLARE(): the
+  splitmix64 finalizer of the key mixed with the seed.
+*/
+static inline
+uint64_t
+cuckoo_hash_int_hash(uint64_t key, uint64_t seed)
+{
+  uint64_t x = key ^ seed;
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+
+  return x;
+}
+
+
+#define cuckoo_hash_int_eq(a, b)  ((a) == (b))
+
+
+/*
+  cuckoo_hash_declare_each(name, it, hash):
+
+  Same as cuckoo_hash_each() for the tables of the given name.
+*/
+#define cuckoo_hash_declare_each(name, it, hash)        \
+  (it) = name##_next((hash), NULL);                     \
+  (it) != NULL;                                         \
+  (it) = name##_next((hash), (it))
+
+
+#ifdef __cplusplus
+extern "C"
+#endif  /* __cplusplus */
+uint64_t
+_cuckoo_hash_random_seed(const void *salt);
+
+
+#define CUCKOO_HASH_DECLARE(name, key_t, value_t, hash_fn, eq_fn)            \
+                                                                             \
+  struct name##_slot                                                         \
+  {                                                                          \
+    key_t key;                                                               \
+    value_t value;                                                           \
+  };                                                                         \
+                                                                             \
+                                                                             \
+  struct name                                                                \
+  {                                                                          \
+    struct name##_slot *slots;                                               \
+    unsigned char *used;                                                     \
+    uint64_t seed;                                                           \
+    size_t count;                                                            \
+    unsigned char power;                                                     \
+  };                                                                         \
+                                                                             \
+                                                                             \
+  static inline                                                              \
+  bool                                                                       \
+  name##_alloc(struct name *hash)                                            \
+  {                                                                          \
+    size_t bins = (size_t) 1 << hash->power;                                 \
+    hash->slots = (struct name##_slot *)                                     \
+      malloc(bins * CUCKOO_HASH_DECLARE_BIN_SIZE * sizeof(*hash->slots));    \
+    hash->used = (unsigned char *) calloc(bins, 1);                          \
+    if (! hash->slots || ! hash->used)                                       \
+      {                                                                      \
+        free(hash->slots);                                                   \
+        free(hash->used);                                                    \
+        return false;                                                        \
+      }                                                                      \
+                                                                             \
+    return true;                                                             \
+  }                                                                          \
+                                                                             \
+                                                                             \
+  static inline                                                              \
+  bool                                                                       \
+  name##_init(struct name *hash, unsigned char power, uint64_t seed)         \
+  {                                                                          \
+    hash->power = (power != 0 ? power : 1);                                  \
+    hash->seed = (seed != 0 ? seed : _cuckoo_hash_random_seed(hash));        \
+    hash->count = 0;                                                         \
+                                                                             \
+    return name##_alloc(hash);                                               \
+  }                                                                          \
+                                                                             \
+                                                                             \
+  static inline                                                              \
+  void                                                                       \
+  name##_destroy(const struct name *hash)                                    \
+  {                                                                          \
+    free(hash->slots);                                                       \
+    free(hash->used);                                                        \
+  }                                                                          \
+                                                                             \
+                                                                             \
+  static inline                                                              \
+  size_t                                                                     \
+  name##_count(const struct name *hash)                                      \
+  {                                                                          \
+    return hash->count;                                                      \
+  }                                                                          \
+                                                                             \
+                                                                             \
+  /* Store the two bins of the key, which always differ.  */                 \
+  static inline                                                              \
+  void                                                                       \
+  name##_bins(const struct name *hash, key_t key,                            \
+              uint32_t *bin1, uint32_t *bin2)                                \
+  {                                                                          \
+    uint32_t mask = (1U << hash->power) - 1;                                 \
+    uint64_t h = hash_fn(key, hash->seed);                                   \
+    *bin1 = (uint32_t) h & mask;                                             \
+    *bin2 = (uint32_t) (h >> 32) & mask;                                     \
+    if (*bin2 == *bin1)                                                      \
+      *bin2 ^= 1;                                                            \
+  }                                                                          \
+                                                                             \
+                                                                             \
+  static inline                                                              \
+  struct name##_slot *                                                       \
+  name##_lookup_bin(const struct name *hash, uint32_t bin, key_t key)        \
+  {                                                                          \
+    struct name##_slot *slots =                                              \
+      hash->slots + (size_t) bin * CUCKOO_HASH_DECLARE_BIN_SIZE;             \
+    unsigned int used = hash->used[bin];                                     \
+    for (int i = 0; i < CUCKOO_HASH_DECLARE_BIN_SIZE; ++i)                   \
+      {                                                                      \
+        if (((used >> i) & 1) && eq_fn(slots[i].key, key))                   \
+          return &slots[i];                                                  \
+      }                                                                      \
+                                                                             \
+    return NULL;                                                             \
+  }                                                                          \
+                                                                             \
+                                                                             \
+  static inline                                                              \
+  struct name##_slot *                                                       \
+  name##_lookup(const struct name *hash, key_t key)                          \
+  {                                                                          \
+    uint32_t bin1, bin2;                                                     \
+    name##_bins(hash, key, &bin1, &bin2);                                    \
+                                                                             \
+    struct name##_slot *slot = name##_lookup_bin(hash, bin1, key);           \
+    if (slot)                                                                \
+      return slot;                                                           \
+                                                                             \
+    return name##_lookup_bin(hash, bin2, key);                               \
+  }                                                                          \
+                                                                             \
+                                                                             \
+  static inline                                                              \
+  bool                                                                       \
+  name##_store_free(struct name *hash, uint32_t bin,                         \
+                    const struct name##_slot *entry)                         \
+  {                                                                          \
+    unsigned int avail = ~hash->used[bin]                                    \
+      & ((1U << CUCKOO_HASH_DECLARE_BIN_SIZE) - 1);                          \
+    if (avail == 0)                                                          \
+      return false;                                                          \
+                                                                             \
+    unsigned int i = __builtin_ctz(avail);                                   \
+    hash->slots[(size_t) bin * CUCKOO_HASH_DECLARE_BIN_SIZE + i] = *entry;   \
+    hash->used[bin] |= 1U << i;                                              \
+                                                                             \
+    return true;                                                             \
+  }                                                                          \
+                                                                             \
+                                                                             \
+  static inline                                                              \
+  void                                                                       \
+  name##_swap(struct name *hash, size_t pos, struct name##_slot *entry)      \
+  {                                                                          \
+    struct name##_slot slot = hash->slots[pos];                              \
+    hash->slots[pos] = *entry;                                               \
+    *entry = slot;                                                           \
+  }                                                                          \
+                                                                             \
+                                                                             \
+  /* Place the entry by a random walk, see cuckoo_hash_compact.c.  */        \
+  static inline                                                              \
+  bool                                                                       \
+  name##_place(struct name *hash, struct name##_slot *entry)                 \
+  {                                                                          \
+    uint32_t bin, bin2;                                                      \
+    name##_bins(hash, entry->key, &bin, &bin2);                              \
+    if (name##_store_free(hash, bin, entry)                                  \
+        || name##_store_free(hash, bin2, entry))                             \
+      return true;                                                           \
+                                                                             \
+    size_t path[CUCKOO_HASH_DECLARE_MAX_KICKS];                              \
+    int kicks;                                                               \
+    for (kicks = 0; kicks < CUCKOO_HASH_DECLARE_MAX_KICKS; ++kicks)          \
+      {                                                                      \
+        size_t pos = ((size_t) bin * CUCKOO_HASH_DECLARE_BIN_SIZE            \
+                      + ((bin2 ^ kicks) % CUCKOO_HASH_DECLARE_BIN_SIZE));    \
+        name##_swap(hash, pos, entry);                                       \
+        path[kicks] = pos;                                                   \
+                                                                             \
+        uint32_t bin1;                                                       \
+        name##_bins(hash, entry->key, &bin1, &bin2);                         \
+        bin = (bin1 == bin ? bin2 : bin1);                                   \
+        if (name##_store_free(hash, bin, entry))                             \
+          return true;                                                       \
+      }                                                                      \
+                                                                             \
+    while (kicks-- > 0)                                                      \
+      name##_swap(hash, path[kicks], entry);                                 \
+                                                                             \
+    return false;                                                            \
+  }                                                                          \
+                                                                             \
+                                                                             \
+  /* Whether the two bins of the key, which are full, hold only keys with    \
+     the same hash.  Those are in the same two bins in a table of any        \
+     size, so growing it doesn't help.  */                                   \
+  static inline                                                              \
+  bool                                                                       \
+  name##_crowded(const struct name *hash, key_t key)                         \
+  {                                                                          \
+    uint64_t h = hash_fn(key, hash->seed);                                   \
+    uint32_t bins[2];                                                        \
+    name##_bins(hash, key, &bins[0], &bins[1]);                              \
+    for (int b = 0; b < 2; ++b)                                              \
+      {                                                                      \
+        const struct name##_slot *slots =                                    \
+          hash->slots + (size_t) bins[b] * CUCKOO_HASH_DECLARE_BIN_SIZE;     \
+        for (int i = 0; i < CUCKOO_HASH_DECLARE_BIN_SIZE; ++i)               \
+          {                                                                  \
+            if (hash_fn(slots[i].key, hash->seed) != h)                      \
+              return false;                                                  \
+          }                                                                  \
+      }                                                                      \
+                                                                             \
+    return true;                                                             \
+  }                                                                          \
+                                                                             \
+                                                                             \
+  /* Place all elements of the hash into fresh.  */                          \
+  static inline                                                              \
+  bool                                                                       \
+  name##_place_all(const struct name *hash, struct name *fresh)              \
+  {                                                                          \
+    size_t bins = (size_t) 1 << hash->power;                                 \
+    for (size_t bin = 0; bin < bins; ++bin)                                  \
+      {                                                                      \
+        for (int i = 0; i < CUCKOO_HASH_DECLARE_BIN_SIZE; ++i)               \
+          {                                                                  \
+            struct name##_slot entry =                                       \
+              hash->slots[bin * CUCKOO_HASH_DECLARE_BIN_SIZE + i];           \
+            if (((hash->used[bin] >> i) & 1)                                 \
+                && ! name##_place(fresh, &entry))                            \
+              return false;                                                  \
+          }                                                                  \
+      }                                                                      \
+                                                                             \
+    return true;                                                             \
+  }                                                                          \
+                                                                             \
+                                                                             \
+  /* Double the table, or grow it further should the elements not all        \
+     fit.  On failure the hash is left intact.  */                           \
+  static inline                                                              \
+  bool                                                                       \
+  name##_grow(struct name *hash)                                             \
+  {                                                                          \
+    struct name fresh = *hash;                                               \
+    for (;;)                                                                 \
+      {                                                                      \
+        if (fresh.power >= 31)                                               \
+          return false;                                                      \
+                                                                             \
+        ++fresh.power;                                                       \
+        if (! name##_alloc(&fresh))                                          \
+          return false;                                                      \
+                                                                             \
+        if (name##_place_all(hash, &fresh))                                  \
+          break;                                                             \
+                                                                             \
+        name##_destroy(&fresh);                                              \
+      }                                                                      \
+                                                                             \
+    name##_destroy(hash);                                                    \
+    *hash = fresh;                                                           \
+                                                                             \
+    return true;                                                             \
+  }                                                                          \
+                                                                             \
+                                                                             \
+  static inline                                                              \
+  struct name##_slot *                                                       \
+  name##_insert(struct name *hash, key_t key, value_t value)                 \
+  {                                                                          \
+    struct name##_slot *slot = name##_lookup(hash, key);                     \
+    if (slot)                                                                \
+      return slot;                                                           \
+                                                                             \
+    struct name##_slot entry;                                                \
+    entry.key = key;                                                         \
+    entry.value = value;                                                     \
+    while (! name##_place(hash, &entry))                                     \
+      {                                                                      \
+        if (name##_crowded(hash, key) || ! name##_grow(hash))                \
+          return (struct name##_slot *) CUCKOO_HASH_FAILED;                  \
+      }                                                                      \
+                                                                             \
+    ++hash->count;                                                           \
+                                                                             \
+    return NULL;                                                             \
+  }                                                                          \
+                                                                             \
+                                                                             \
+  static inline                                                              \
+  void                                                                       \
+  name##_remove(struct name *hash, const struct name##_slot *slot)           \
+  {                                                                          \
+    if (slot)                                                                \
+      {                                                                      \
+        size_t pos = slot - hash->slots;                                     \
+        hash->used[pos / CUCKOO_HASH_DECLARE_BIN_SIZE] &=                    \
+          ~(1U << (pos % CUCKOO_HASH_DECLARE_BIN_SIZE));                     \
+        --hash->count;                                                       \
+      }                                                                      \
+  }                                                                          \
+                                                                             \
+                                                                             \
+  static inline                                                              \
+  struct name##_slot *                                                       \
+  name##_next(const struct name *hash, const struct name##_slot *slot)       \
+  {                                                                          \
+    size_t count = (size_t) CUCKOO_HASH_DECLARE_BIN_SIZE << hash->power;     \
+    size_t pos = (slot != NULL ? (size_t) (slot - hash->slots) + 1 : 0);     \
+    for (; pos < count; ++pos)                                               \
+      {                                                                      \
+        if ((hash->used[pos / CUCKOO_HASH_DECLARE_BIN_SIZE]                  \
+             >> (pos % CUCKOO_HASH_DECLARE_BIN_SIZE)) & 1)                   \
+          return &hash->slots[pos];                                          \
+      }                                                                      \
+                                                                             \
+    return NULL;                                                             \
+  }                                                                          \
+                                                                             \
+                                                                             \
+  struct name##_slot
+
+
+#endif  /* ! _CUCKOO_HASH_DECLARE_H */
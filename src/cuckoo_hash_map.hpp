@@ -0,0 +1,1363 @@
+// -*- C++ -*-
+/*
+  Copyright (C) 2010 Tomash Brechko.  All rights reserved.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CUCKOO_HASH_MAP_HPP
+#define _CUCKOO_HASH_MAP_HPP 1
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+
+/*
+  cuckoo::hash_map<K, V, Hash, KeyEqual, Allocator>: header-only C++17
+  container with the interface of std::unordered_map (minus buckets),
+  built on the algorithm of struct cuckoo_hash: bins of four slots,
+  two bins per key, and a pair of 32-bit hashes kept for every slot in
+  a separate array, so that inserts find the path to a free slot by a
+  breadth-first search over the hashes alone.  Elements are stored in
+  place and are moved, never copied, when they are displaced along the
+  path or when the table grows.  Growth doesn't call Hash again.
+
+  Lookups are heterogeneous when both Hash and KeyEqual have
+  is_transparent, e.g., std::string keys with cuckoo::string_hash and
+  std::equal_to<> may be looked up by std::string_view.
+
+  Like in std::unordered_map, inserts invalidate iterators and
+  references.  Unlike it, even a failed emplace may construct the
+  element (see try_emplace() for that).
+
+  Keys that Hash maps to the same value always share their two bins,
+  so at most eight of them fit: an insert of the ninth throws
+  std::length_error, as does growth past 2^31 bins.  A throw from the
+  allocator leaves the map as it was.
+*/
+
+
+namespace cuckoo
+{
+  /*
+    Transparent hash of strings for heterogeneous lookups.
+  */
+  struct string_hash
+  {
+    using is_transparent = void;
+
+    std::size_t
+    operator()(std::string_view s) const noexcept
+    {
+      return std::hash<std::string_view>()(s);
+    }
+  };
+
+
+  namespace detail
+  {
+    template<class T, class = void>
+    struct is_transparent : std::false_type
+    {
+    };
+
+
+    template<class T>
+    struct is_transparent<T, std::void_t<typename T::is_transparent> >
+      : std::true_type
+    {
+    };
+
+
+    /* splitmix64 finalizer.  */
+    inline
+    std::uint64_t
+    mix(std::uint64_t x) noexcept
+    {
+      x ^= x >> 30;
+      x *= 0xbf58476d1ce4e5b9ULL;
+      x ^= x >> 27;
+      x *= 0x94d049bb133111ebULL;
+      x ^= x >> 31;
+
+      return x;
+    }
+
+
+    inline
+    std::uint64_t
+    random_seed(const void *salt)
+    {
+      static const std::uint64_t base =
+        (static_cast<std::uint64_t>(std::random_device()()) << 32)
+        | std::random_device()();
+      static std::atomic<std::uint64_t> counter;
+
+      return mix(base ^ reinterpret_cast<std::uintptr_t>(salt)
+                 ^ mix(++counter));
+    }
+  }
+
+
+  template<class K, class V,
+           class Hash = std::hash<K>,
+           class KeyEqual = std::equal_to<K>,
+           class Allocator = std::allocator<std::pair<const K, V> > >
+  class hash_map
+  {
+  public:
+    using key_type = K;
+    using mapped_type = V;
+    using value_type = std::pair<const K, V>;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using hasher = Hash;
+    using key_equal = KeyEqual;
+    using allocator_type = Allocator;
+    using reference = value_type &;
+    using const_reference = const value_type &;
+    using pointer = value_type *;
+    using const_pointer = const value_type *;
+
+  private:
+    /*
+      hash1 selects the bin the element is in, and hash2 the other one.
+      Empty slots have equal hashes.
+    */
+    struct elem
+    {
+      std::uint32_t hash1;
+      std::uint32_t hash2;
+    };
+
+
+    struct bfs_node
+    {
+      std::uint32_t bin;
+      int parent;
+      unsigned int slot;
+    };
+
+
+    static constexpr unsigned int bin_size = 4;
+    static constexpr int max_nodes = 1024;
+    static constexpr unsigned char max_power = 31;
+    static constexpr double max_load = 0.9;
+    static constexpr size_type npos = static_cast<size_type>(-1);
+
+    using value_traits = std::allocator_traits<Allocator>;
+    using elem_allocator =
+      typename value_traits::template rebind_alloc<elem>;
+    using elem_traits = std::allocator_traits<elem_allocator>;
+    using index_allocator =
+      typename value_traits::template rebind_alloc<size_type>;
+    using index_traits = std::allocator_traits<index_allocator>;
+
+    template<class Q>
+    using enable_transparent =
+      std::enable_if_t<detail::is_transparent<Hash>::value
+                       && detail::is_transparent<KeyEqual>::value, Q>;
+
+    template<bool Const>
+    class iter
+    {
+    public:
+      using iterator_category = std::forward_iterator_tag;
+      using value_type = typename hash_map::value_type;
+      using difference_type = std::ptrdiff_t;
+      using pointer = std::conditional_t<Const, const value_type *,
+                                         value_type *>;
+      using reference = std::conditional_t<Const, const value_type &,
+                                           value_type &>;
+
+      iter() noexcept = default;
+
+      // Conversion of iterator to const_iterator.
+      template<bool C = Const, class = std::enable_if_t<C> >
+      iter(const iter<false> &other) noexcept
+        : table_(other.table_), slots_(other.slots_), pos_(other.pos_),
+          count_(other.count_)
+      {
+      }
+
+      reference
+      operator*() const noexcept
+      {
+        return slots_[pos_];
+      }
+
+      pointer
+      operator->() const noexcept
+      {
+        return &slots_[pos_];
+      }
+
+      iter &
+      operator++() noexcept
+      {
+        ++pos_;
+        skip();
+        return *this;
+      }
+
+      iter
+      operator++(int) noexcept
+      {
+        iter res = *this;
+        ++*this;
+        return res;
+      }
+
+      friend
+      bool
+      operator==(const iter &a, const iter &b) noexcept
+      {
+        return a.pos_ == b.pos_;
+      }
+
+      friend
+      bool
+      operator!=(const iter &a, const iter &b) noexcept
+      {
+        return a.pos_ != b.pos_;
+      }
+
+    private:
+      friend class hash_map;
+      friend class iter<! Const>;
+
+      iter(const elem *table, value_type *slots, size_type pos,
+           size_type count) noexcept
+        : table_(table), slots_(slots), pos_(pos), count_(count)
+      {
+      }
+
+      void
+      skip() noexcept
+      {
+        while (pos_ < count_ && table_[pos_].hash1 == table_[pos_].hash2)
+          ++pos_;
+      }
+
+      const elem *table_ = nullptr;
+      value_type *slots_ = nullptr;
+      size_type pos_ = 0;
+      size_type count_ = 0;
+    };
+
+  public:
+    using iterator = iter<false>;
+    using const_iterator = iter<true>;
+
+
+    hash_map()
+      : hash_map(0)
+    {
+    }
+
+
+    explicit
+    hash_map(size_type count, const Hash &hash = Hash(),
+             const KeyEqual &equal = KeyEqual(),
+             const Allocator &alloc = Allocator())
+      : alloc_(alloc), hash_(hash), equal_(equal),
+        seed_(detail::random_seed(this))
+    {
+      allocate(power_for(count));
+    }
+
+
+    explicit
+    hash_map(const Allocator &alloc)
+      : hash_map(0, Hash(), KeyEqual(), alloc)
+    {
+    }
+
+
+    template<class InputIt>
+    hash_map(InputIt first, InputIt last, size_type count = 0,
+             const Hash &hash = Hash(), const KeyEqual &equal = KeyEqual(),
+             const Allocator &alloc = Allocator())
+      : hash_map(count, hash, equal, alloc)
+    {
+      insert(first, last);
+    }
+
+
+    hash_map(std::initializer_list<value_type> init, size_type count = 0,
+             const Hash &hash = Hash(), const KeyEqual &equal = KeyEqual(),
+             const Allocator &alloc = Allocator())
+      : hash_map(init.begin(), init.end(), count, hash, equal, alloc)
+    {
+    }
+
+
+    hash_map(const hash_map &other)
+      : hash_map(other,
+                 value_traits::select_on_container_copy_construction(
+                   other.alloc_))
+    {
+    }
+
+
+    hash_map(const hash_map &other, const Allocator &alloc)
+      : alloc_(alloc), hash_(other.hash_), equal_(other.equal_),
+        seed_(other.seed_)
+    {
+      allocate(other.table_ ? other.power_ : 1);
+      try
+        {
+          copy_elements(other);
+        }
+      catch (...)
+        {
+          destroy();
+          throw;
+        }
+    }
+
+
+    hash_map(hash_map &&other) noexcept
+      : alloc_(std::move(other.alloc_)), hash_(std::move(other.hash_)),
+        equal_(std::move(other.equal_)), seed_(other.seed_)
+    {
+      steal(other);
+    }
+
+
+    hash_map &
+    operator=(const hash_map &other)
+    {
+      if (this != &other)
+        {
+          hash_map copy(other,
+                        value_traits::propagate_on_container_copy_assignment
+                        ::value ? other.alloc_ : alloc_);
+          swap_contents(copy);
+        }
+
+      return *this;
+    }
+
+
+    hash_map &
+    operator=(hash_map &&other)
+      noexcept(value_traits::propagate_on_container_move_assignment::value
+               || value_traits::is_always_equal::value)
+    {
+      if (this == &other)
+        return *this;
+
+      if (value_traits::propagate_on_container_move_assignment::value
+          || alloc_ == other.alloc_)
+        {
+          destroy();
+          if constexpr (value_traits::propagate_on_container_move_assignment
+                        ::value)
+            alloc_ = std::move(other.alloc_);
+          hash_ = std::move(other.hash_);
+          equal_ = std::move(other.equal_);
+          seed_ = other.seed_;
+          steal(other);
+        }
+      else
+        {
+          // Allocators differ, so elements are moved one by one.
+          clear();
+          hash_ = other.hash_;
+          equal_ = other.equal_;
+          for (auto &value : other)
+            emplace(std::move(const_cast<K &>(value.first)),
+                    std::move(value.second));
+          other.clear();
+        }
+
+      return *this;
+    }
+
+
+    ~hash_map()
+    {
+      destroy();
+    }
+
+
+    allocator_type
+    get_allocator() const noexcept
+    {
+      return alloc_;
+    }
+
+
+    hasher
+    hash_function() const
+    {
+      return hash_;
+    }
+
+
+    key_equal
+    key_eq() const
+    {
+      return equal_;
+    }
+
+
+    iterator
+    begin() noexcept
+    {
+      iterator it(table_, slots_, 0, slot_count());
+      it.skip();
+      return it;
+    }
+
+
+    const_iterator
+    begin() const noexcept
+    {
+      const_iterator it(table_, slots_, 0, slot_count());
+      it.skip();
+      return it;
+    }
+
+
+    const_iterator
+    cbegin() const noexcept
+    {
+      return begin();
+    }
+
+
+    iterator
+    end() noexcept
+    {
+      return iterator(table_, slots_, slot_count(), slot_count());
+    }
+
+
+    const_iterator
+    end() const noexcept
+    {
+      return const_iterator(table_, slots_, slot_count(), slot_count());
+    }
+
+
+    const_iterator
+    cend() const noexcept
+    {
+      return end();
+    }
+
+
+    bool
+    empty() const noexcept
+    {
+      return size_ == 0;
+    }
+
+
+    size_type
+    size() const noexcept
+    {
+      return size_;
+    }
+
+
+    float
+    load_factor() const noexcept
+    {
+      return (size_ ? static_cast<float>(size_) / slot_count() : 0);
+    }
+
+
+    void
+    clear() noexcept
+    {
+      size_type count = slot_count();
+      for (size_type pos = 0; pos < count; ++pos)
+        {
+          if (occupied(pos))
+            erase_at(pos);
+        }
+    }
+
+
+    std::pair<iterator, bool>
+    insert(const value_type &value)
+    {
+      return emplace(value);
+    }
+
+
+    std::pair<iterator, bool>
+    insert(value_type &&value)
+    {
+      return emplace(std::move(value));
+    }
+
+
+    template<class P,
+             class = std::enable_if_t<std::is_constructible_v<value_type,
+                                                              P &&> > >
+    std::pair<iterator, bool>
+    insert(P &&value)
+    {
+      return emplace(std::forward<P>(value));
+    }
+
+
+    template<class InputIt>
+    void
+    insert(InputIt first, InputIt last)
+    {
+      for (; first != last; ++first)
+        emplace(*first);
+    }
+
+
+    void
+    insert(std::initializer_list<value_type> init)
+    {
+      insert(init.begin(), init.end());
+    }
+
+
+    template<class M>
+    std::pair<iterator, bool>
+    insert_or_assign(const K &key, M &&obj)
+    {
+      return assign(key, std::forward<M>(obj));
+    }
+
+
+    template<class M>
+    std::pair<iterator, bool>
+    insert_or_assign(K &&key, M &&obj)
+    {
+      return assign(std::move(key), std::forward<M>(obj));
+    }
+
+
+    /*
+      The element is constructed before the lookup, as the key has to be
+      extracted from it.  Prefer try_emplace().
+    */
+    template<class... Args>
+    std::pair<iterator, bool>
+    emplace(Args &&...args)
+    {
+      value_type value(std::forward<Args>(args)...);
+      auto [h1, h2] = hash_pair(value.first);
+      size_type pos = find_hashed(value.first, h1, h2);
+      if (pos != npos)
+        return { make_iterator(pos), false };
+
+      pos = make_room(h1, h2);
+      construct(pos, std::move(const_cast<K &>(value.first)),
+                std::move(value.second));
+      return { make_iterator(pos), true };
+    }
+
+
+    template<class... Args>
+    std::pair<iterator, bool>
+    try_emplace(const K &key, Args &&...args)
+    {
+      return try_emplace_key(key, std::forward<Args>(args)...);
+    }
+
+
+    template<class... Args>
+    std::pair<iterator, bool>
+    try_emplace(K &&key, Args &&...args)
+    {
+      return try_emplace_key(std::move(key), std::forward<Args>(args)...);
+    }
+
+
+    iterator
+    erase(const_iterator pos)
+    {
+      erase_at(pos.pos_);
+      iterator it(table_, slots_, pos.pos_ + 1, slot_count());
+      it.skip();
+      return it;
+    }
+
+
+    iterator
+    erase(iterator pos)
+    {
+      return erase(const_iterator(pos));
+    }
+
+
+    size_type
+    erase(const K &key)
+    {
+      return erase_key(key);
+    }
+
+
+    template<class Q, class = enable_transparent<Q> >
+    size_type
+    erase(const Q &key)
+    {
+      return erase_key(key);
+    }
+
+
+    void
+    swap(hash_map &other)
+      noexcept(value_traits::propagate_on_container_swap::value
+               || value_traits::is_always_equal::value)
+    {
+      if constexpr (value_traits::propagate_on_container_swap::value)
+        std::swap(alloc_, other.alloc_);
+      swap_contents(other);
+    }
+
+
+    iterator
+    find(const K &key)
+    {
+      return make_iterator(find_key(key));
+    }
+
+
+    const_iterator
+    find(const K &key) const
+    {
+      return make_iterator(find_key(key));
+    }
+
+
+    template<class Q, class = enable_transparent<Q> >
+    iterator
+    find(const Q &key)
+    {
+      return make_iterator(find_key(key));
+    }
+
+
+    template<class Q, class = enable_transparent<Q> >
+    const_iterator
+    find(const Q &key) const
+    {
+      return make_iterator(find_key(key));
+    }
+
+
+    size_type
+    count(const K &key) const
+    {
+      return find_key(key) != npos;
+    }
+
+
+    template<class Q, class = enable_transparent<Q> >
+    size_type
+    count(const Q &key) const
+    {
+      return find_key(key) != npos;
+    }
+
+
+    bool
+    contains(const K &key) const
+    {
+      return find_key(key) != npos;
+    }
+
+
+    template<class Q, class = enable_transparent<Q> >
+    bool
+    contains(const Q &key) const
+    {
+      return find_key(key) != npos;
+    }
+
+
+    V &
+    at(const K &key)
+    {
+      return slots_[checked_find(key)].second;
+    }
+
+
+    const V &
+    at(const K &key) const
+    {
+      return slots_[checked_find(key)].second;
+    }
+
+
+    V &
+    operator[](const K &key)
+    {
+      return try_emplace(key).first->second;
+    }
+
+
+    V &
+    operator[](K &&key)
+    {
+      return try_emplace(std::move(key)).first->second;
+    }
+
+
+    /*
+      Grow the table so that it holds count elements without growing.
+    */
+    void
+    reserve(size_type count)
+    {
+      unsigned char power = power_for(count);
+      if (power > power_)
+        rehash_to(power);
+    }
+
+
+    /*
+      Rebuild the table into the smallest one that holds its elements.
+    */
+    void
+    shrink_to_fit()
+    {
+      unsigned char power = power_for(size_);
+      if (power < power_)
+        rehash_to(power);
+    }
+
+  private:
+    /*
+      A moved-from map has no table, and allocates one on the next
+      insert.
+    */
+    size_type
+    slot_count() const noexcept
+    {
+      return (table_ ? static_cast<size_type>(bin_size) << power_ : 0);
+    }
+
+
+    bool
+    occupied(size_type pos) const noexcept
+    {
+      return table_[pos].hash1 != table_[pos].hash2;
+    }
+
+
+    iterator
+    make_iterator(size_type pos) noexcept
+    {
+      return iterator(table_, slots_, pos == npos ? slot_count() : pos,
+                      slot_count());
+    }
+
+
+    const_iterator
+    make_iterator(size_type pos) const noexcept
+    {
+      return const_iterator(table_, slots_, pos == npos ? slot_count() : pos,
+                            slot_count());
+    }
+
+
+    static
+    unsigned char
+    power_for(size_type count) noexcept
+    {
+      unsigned char power = 1;
+      while (power < max_power
+             && (static_cast<double>(bin_size) * (size_type(1) << power)
+                 * max_load) < count)
+        ++power;
+
+      return power;
+    }
+
+
+    template<class Q>
+    std::pair<std::uint32_t, std::uint32_t>
+    hash_pair(const Q &key) const
+    {
+      std::uint64_t h =
+        detail::mix(static_cast<std::uint64_t>(hash_(key)) ^ seed_);
+      std::uint32_t h1 = static_cast<std::uint32_t>(h);
+      std::uint32_t h2 = static_cast<std::uint32_t>(h >> 32);
+      if (h1 == h2)
+        h2 = ~h2;
+
+      return { h1, h2 };
+    }
+
+
+    template<class Q>
+    size_type
+    find_hashed(const Q &key, std::uint32_t h1, std::uint32_t h2) const
+    {
+      if (size_ == 0)
+        return npos;
+
+      std::uint32_t mask = (std::uint32_t(1) << power_) - 1;
+
+      size_type base = static_cast<size_type>(h1 & mask) * bin_size;
+      for (unsigned int i = 0; i < bin_size; ++i)
+        {
+          const elem &e = table_[base + i];
+          if (e.hash1 == h1 && e.hash2 == h2
+              && equal_(slots_[base + i].first, key))
+            return base + i;
+        }
+
+      base = static_cast<size_type>(h2 & mask) * bin_size;
+      for (unsigned int i = 0; i < bin_size; ++i)
+        {
+          const elem &e = table_[base + i];
+          if (e.hash1 == h2 && e.hash2 == h1
+              && equal_(slots_[base + i].first, key))
+            return base + i;
+        }
+
+      return npos;
+    }
+
+
+    template<class Q>
+    size_type
+    find_key(const Q &key) const
+    {
+      auto [h1, h2] = hash_pair(key);
+      return find_hashed(key, h1, h2);
+    }
+
+
+    size_type
+    checked_find(const K &key) const
+    {
+      size_type pos = find_key(key);
+      if (pos == npos)
+        throw std::out_of_range("cuckoo::hash_map::at");
+
+      return pos;
+    }
+
+
+    template<class KK, class... Args>
+    std::pair<iterator, bool>
+    try_emplace_key(KK &&key, Args &&...args)
+    {
+      auto [h1, h2] = hash_pair(key);
+      size_type pos = find_hashed(key, h1, h2);
+      if (pos != npos)
+        return { make_iterator(pos), false };
+
+      pos = make_room(h1, h2);
+      construct(pos, std::piecewise_construct,
+                std::forward_as_tuple(std::forward<KK>(key)),
+                std::forward_as_tuple(std::forward<Args>(args)...));
+      return { make_iterator(pos), true };
+    }
+
+
+    template<class KK, class M>
+    std::pair<iterator, bool>
+    assign(KK &&key, M &&obj)
+    {
+      auto res = try_emplace_key(std::forward<KK>(key), std::forward<M>(obj));
+      if (! res.second)
+        res.first->second = std::forward<M>(obj);
+
+      return res;
+    }
+
+
+    template<class Q>
+    size_type
+    erase_key(const Q &key)
+    {
+      size_type pos = find_key(key);
+      if (pos == npos)
+        return 0;
+
+      erase_at(pos);
+      return 1;
+    }
+
+
+    void
+    erase_at(size_type pos) noexcept
+    {
+      value_traits::destroy(alloc_, &slots_[pos]);
+      table_[pos].hash1 = table_[pos].hash2 = 0;
+      --size_;
+    }
+
+
+    /*
+      Construct the element in the slot pos, whose hashes make_room()
+      has already set.
+    */
+    template<class... Args>
+    void
+    construct(size_type pos, Args &&...args)
+    {
+      try
+        {
+          value_traits::construct(alloc_, &slots_[pos],
+                                  std::forward<Args>(args)...);
+        }
+      catch (...)
+        {
+          table_[pos].hash1 = table_[pos].hash2 = 0;
+          throw;
+        }
+      ++size_;
+    }
+
+
+    /*
+      Move the value from slot from to the empty slot to.  The hashes
+      are moved by move_along().
+    */
+    void
+    move_slot(size_type to, size_type from)
+    {
+      value_type &value = slots_[from];
+      value_traits::construct(alloc_, &slots_[to],
+                              std::move(const_cast<K &>(value.first)),
+                              std::move(value.second));
+      value_traits::destroy(alloc_, &value);
+    }
+
+
+    static
+    bool
+    on_path(const bfs_node *nodes, int node, std::uint32_t bin) noexcept
+    {
+      for (; node >= 0; node = nodes[node].parent)
+        {
+          if (nodes[node].bin == bin)
+            return true;
+        }
+
+      return false;
+    }
+
+
+    /*
+      Free a slot in one of the bins of the key with hashes h1 and h2,
+      moving elements along the shortest path found by a breadth-first
+      search, as insert() of struct cuckoo_hash does, and set its
+      hashes.  Grow the table if there's no path.  Throw
+      std::length_error if growing can't help: when both bins are full
+      of elements with the very same hashes, which the seed doesn't
+      change as it is mixed in after Hash, or when the table is as
+      large as it gets.
+    */
+    size_type
+    make_room(std::uint32_t h1, std::uint32_t h2)
+    {
+      if (! table_)
+        allocate(1);
+
+      for (;;)
+        {
+          size_type pos = find_path(table_, power_, h1, h2,
+                                    [this](size_type to, size_type from)
+                                    {
+                                      move_slot(to, from);
+                                    });
+          if (pos != npos)
+            return pos;
+
+          if (crowded(h1, h2))
+            throw std::length_error("cuckoo::hash_map: too many keys"
+                                    " with equal hashes");
+
+          rehash_to(power_ + 1);
+        }
+    }
+
+
+    /*
+      Whether the bins of the key with hashes h1 and h2, which are
+      full, hold only elements with the same hashes.  Then they'd be in
+      the same two bins in a table of any size.
+    */
+    bool
+    crowded(std::uint32_t h1, std::uint32_t h2) const noexcept
+    {
+      std::uint32_t mask = (std::uint32_t(1) << power_) - 1;
+      if ((h1 & mask) == (h2 & mask))
+        return false;
+
+      for (std::uint32_t h : { h1, h2 })
+        {
+          size_type base = static_cast<size_type>(h & mask) * bin_size;
+          for (unsigned int i = 0; i < bin_size; ++i)
+            {
+              const elem &e = table_[base + i];
+              if (! (e.hash1 == h1 && e.hash2 == h2)
+                  && ! (e.hash1 == h2 && e.hash2 == h1))
+                return false;
+            }
+        }
+
+      return true;
+    }
+
+
+    /*
+      Find a free slot for the key with hashes h1 and h2 in table of
+      2^power bins, as make_room() describes, and return it, or npos if
+      there's no path.  move(to, from) moves whatever goes along with
+      the hashes of a slot.
+    */
+    template<class Move>
+    size_type
+    find_path(elem *table, unsigned char power,
+              std::uint32_t h1, std::uint32_t h2, Move move)
+    {
+      bfs_node nodes[max_nodes];
+      std::uint32_t mask = (std::uint32_t(1) << power) - 1;
+      size_type limit = static_cast<size_type>(bin_size) << power;
+      if (limit > static_cast<size_type>(max_nodes))
+        limit = max_nodes;
+
+      size_type count = 0;
+      nodes[count++] = { h1 & mask, -1, 0 };
+      if ((h2 & mask) != (h1 & mask))
+        nodes[count++] = { h2 & mask, -1, 0 };
+
+      for (size_type i = 0; i < count; ++i)
+        {
+          size_type base = static_cast<size_type>(nodes[i].bin) * bin_size;
+          for (unsigned int j = 0; j < bin_size; ++j)
+            {
+              const elem &e = table[base + j];
+              if (e.hash1 == e.hash2)
+                return move_along(table, nodes, static_cast<int>(i),
+                                  base + j, h1, h2, mask, move);
+            }
+
+          for (unsigned int j = 0; j < bin_size && count < limit; ++j)
+            {
+              std::uint32_t alt = table[base + j].hash2 & mask;
+              if (on_path(nodes, static_cast<int>(i), alt))
+                continue;
+
+              nodes[count++] = { alt, static_cast<int>(i), j };
+            }
+        }
+
+      return npos;
+    }
+
+
+    template<class Move>
+    static
+    size_type
+    move_along(elem *table, const bfs_node *nodes, int node, size_type free,
+               std::uint32_t h1, std::uint32_t h2, std::uint32_t mask,
+               Move move)
+    {
+      for (; nodes[node].parent >= 0; node = nodes[node].parent)
+        {
+          size_type from =
+            (static_cast<size_type>(nodes[nodes[node].parent].bin) * bin_size
+             + nodes[node].slot);
+          move(free, from);
+          table[free].hash1 = table[from].hash2;
+          table[free].hash2 = table[from].hash1;
+          table[from].hash1 = table[from].hash2 = 0;
+          free = from;
+        }
+
+      if ((h1 & mask) == nodes[node].bin)
+        table[free] = { h1, h2 };
+      else
+        table[free] = { h2, h1 };
+
+      return free;
+    }
+
+
+    /*
+      Allocate the arrays of a table of 2^power bins, all slots empty.
+      Nothing is allocated should either allocation throw.
+    */
+    void
+    allocate(unsigned char power, elem *&table, value_type *&slots)
+    {
+      size_type count = static_cast<size_type>(bin_size) << power;
+      elem_allocator elem_alloc(alloc_);
+      elem *new_table = elem_traits::allocate(elem_alloc, count);
+      try
+        {
+          slots = value_traits::allocate(alloc_, count);
+        }
+      catch (...)
+        {
+          elem_traits::deallocate(elem_alloc, new_table, count);
+          throw;
+        }
+      std::memset(static_cast<void *>(new_table), 0, count * sizeof(elem));
+      table = new_table;
+    }
+
+
+    /*
+      Allocate the table of a map that has none.
+    */
+    void
+    allocate(unsigned char power)
+    {
+      allocate(power, table_, slots_);
+      power_ = power;
+      size_ = 0;
+    }
+
+
+    void
+    deallocate(elem *table, value_type *slots, unsigned char power) noexcept
+    {
+      size_type count = static_cast<size_type>(bin_size) << power;
+      elem_allocator elem_alloc(alloc_);
+      elem_traits::deallocate(elem_alloc, table, count);
+      value_traits::deallocate(alloc_, slots, count);
+    }
+
+
+    void
+    destroy() noexcept
+    {
+      if (! table_)
+        return;
+
+      clear();
+      deallocate(table_, slots_, power_);
+      table_ = nullptr;
+      slots_ = nullptr;
+    }
+
+
+    /*
+      Move all elements to a table of 2^power bins, or of more should
+      it fail to take them all, using their stored hashes.  The hashes
+      are laid out in the new table first, and the elements are moved
+      there only once all have fit, and only if that can't throw,
+      otherwise they are copied.  So a throw leaves the map as it was,
+      unless K or V can be neither copied nor moved without throwing.
+    */
+    void
+    rehash_to(unsigned char power)
+    {
+      for (;; ++power)
+        {
+          if (power > max_power)
+            throw std::length_error("cuckoo::hash_map: too many keys");
+
+          size_type count = static_cast<size_type>(bin_size) << power;
+          elem *table;
+          value_type *slots;
+          allocate(power, table, slots);
+          index_allocator index_alloc(alloc_);
+          size_type *index;
+          try
+            {
+              index = index_traits::allocate(index_alloc, count);
+            }
+          catch (...)
+            {
+              deallocate(table, slots, power);
+              throw;
+            }
+
+          bool fit = lay_out(table, index, power);
+          if (fit)
+            {
+              try
+                {
+                  relocate(table, slots, index, count);
+                }
+              catch (...)
+                {
+                  index_traits::deallocate(index_alloc, index, count);
+                  deallocate(table, slots, power);
+                  throw;
+                }
+            }
+          index_traits::deallocate(index_alloc, index, count);
+
+          if (fit)
+            {
+              size_type size = size_;
+              destroy();
+              table_ = table;
+              slots_ = slots;
+              power_ = power;
+              size_ = size;
+              return;
+            }
+
+          deallocate(table, slots, power);
+        }
+    }
+
+
+    /*
+      Lay out the hashes of all elements in table of 2^power bins, and
+      set index[pos] to the slot of the element that goes to slot pos.
+      Return false if some didn't fit.
+    */
+    bool
+    lay_out(elem *table, size_type *index, unsigned char power) noexcept
+    {
+      size_type count = slot_count();
+      for (size_type pos = 0; pos < count; ++pos)
+        {
+          if (! occupied(pos))
+            continue;
+
+          size_type to = find_path(table, power, table_[pos].hash1,
+                                   table_[pos].hash2,
+                                   [index](size_type to, size_type from)
+                                   {
+                                     index[to] = index[from];
+                                   });
+          if (to == npos)
+            return false;
+
+          index[to] = pos;
+        }
+
+      return true;
+    }
+
+
+    /*
+      Construct the elements of the laid out table from those of the
+      map, moved with std::move_if_noexcept().  Should that throw,
+      destroy those constructed so far.
+    */
+    void
+    relocate(const elem *table, value_type *slots, const size_type *index,
+             size_type count)
+    {
+      size_type pos = 0;
+      try
+        {
+          for (; pos < count; ++pos)
+            {
+              if (table[pos].hash1 == table[pos].hash2)
+                continue;
+
+              value_type &value = slots_[index[pos]];
+              value_traits::construct(
+                alloc_, &slots[pos],
+                std::move_if_noexcept(const_cast<K &>(value.first)),
+                std::move_if_noexcept(value.second));
+            }
+        }
+      catch (...)
+        {
+          while (pos-- > 0)
+            {
+              if (table[pos].hash1 != table[pos].hash2)
+                value_traits::destroy(alloc_, &slots[pos]);
+            }
+          throw;
+        }
+    }
+
+
+    void
+    copy_elements(const hash_map &other)
+    {
+      size_type count = other.slot_count();
+      for (size_type pos = 0; pos < count; ++pos)
+        {
+          if (other.occupied(pos))
+            {
+              table_[pos] = other.table_[pos];
+              construct(pos, other.slots_[pos]);
+            }
+        }
+    }
+
+
+    void
+    steal(hash_map &other) noexcept
+    {
+      table_ = other.table_;
+      slots_ = other.slots_;
+      size_ = other.size_;
+      power_ = other.power_;
+      other.table_ = nullptr;
+      other.slots_ = nullptr;
+      other.size_ = 0;
+    }
+
+
+    void
+    swap_contents(hash_map &other) noexcept
+    {
+      std::swap(hash_, other.hash_);
+      std::swap(equal_, other.equal_);
+      std::swap(seed_, other.seed_);
+      std::swap(table_, other.table_);
+      std::swap(slots_, other.slots_);
+      std::swap(size_, other.size_);
+      std::swap(power_, other.power_);
+    }
+
+
+    Allocator alloc_;
+    Hash hash_;
+    KeyEqual equal_;
+    std::uint64_t seed_;
+    elem *table_ = nullptr;
+    value_type *slots_ = nullptr;
+    size_type size_ = 0;
+    unsigned char power_ = 0;
+  };
+
+
+  template<class K, class V, class H, class E, class A>
+  inline
+  void
+  swap(hash_map<K, V, H, E, A> &a, hash_map<K, V, H, E, A> &b)
+    noexcept(noexcept(a.swap(b)))
+  {
+    a.swap(b);
+  }
+}
+
+
+#endif  // ! _CUCKOO_HASH_MAP_HPP
@@ -0,0 +1,423 @@
+/*
+  Copyright (C) 2010 Tomash Brechko.  All rights reserved.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cuckoo_hash_sharded.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+
+/*
+  Number of keys the batch functions hash and sort by shard at a time,
+  and how many keys ahead of the current one they prefetch.
+*/
+#define BATCH_GROUP  512
+#define PREFETCH_AHEAD  8
+
+
+static inline
+void
+shard_lock(struct _cuckoo_hash_shard *shard)
+{
+  while (__atomic_test_and_set(&shard->_lock, __ATOMIC_ACQUIRE))
+    sched_yield();
+}
+
+
+static inline
+void
+shard_unlock(struct _cuckoo_hash_shard *shard)
+{
+  __atomic_clear(&shard->_lock, __ATOMIC_RELEASE);
+}
+
+
+/*
+  Hash the key as the shards do, so that they can use the hash value
+  as long as they keep the seed they were given.
+*/
+static inline
+struct cuckoo_hash_hashval
+hash_key(const struct cuckoo_hash_sharded *hash,
+         const void *key, size_t key_len)
+{
+  /* cuckoo_hash_hash() reads only these.  */
+  struct cuckoo_hash hasher;
+  hasher.hash_function = hash->hash_function;
+  hasher.seed1 = hash->seed1;
+  hasher.seed2 = hash->seed2;
+  hasher.choices = hash->choices;
+
+  return cuckoo_hash_hash(&hasher, key, key_len);
+}
+
+
+/*
+  Shards take the high bits of the first hash, and their bins the low
+  ones.
+*/
+static inline
+unsigned int
+shard_index(const struct cuckoo_hash_sharded *hash,
+            struct cuckoo_hash_hashval hashval)
+{
+  if (hash->shard_bits == 0)
+    return 0;
+
+  return hashval._h1 >> (32 - hash->shard_bits);
+}
+
+
+bool
+cuckoo_hash_sharded_init(struct cuckoo_hash_sharded *hash,
+                         unsigned int shard_bits, unsigned char power,
+                         const struct cuckoo_hash_options *options)
+{
+  extern uint64_t _cuckoo_hash_random_seed(const void *salt);
+
+  static const struct cuckoo_hash_options default_options;
+  if (! options)
+    options = &default_options;
+
+  if (shard_bits > CUCKOO_HASH_SHARDED_MAX_BITS || options->concurrent)
+    return false;
+
+  struct cuckoo_hash_options shard_options = *options;
+  if (shard_options.seed == 0)
+    shard_options.seed = _cuckoo_hash_random_seed(hash);
+
+  size_t shards = (size_t) 1 << shard_bits;
+  void *ptr;
+  if (posix_memalign(&ptr, __alignof__(*hash->shards),
+                     shards * sizeof(*hash->shards)) != 0)
+    return false;
+
+  hash->shards = ptr;
+  for (size_t i = 0; i < shards; ++i)
+    {
+      if (! cuckoo_hash_init_with(&hash->shards[i].hash, power,
+                                  &shard_options))
+        {
+          while (i-- > 0)
+            cuckoo_hash_destroy(&hash->shards[i].hash);
+          free(hash->shards);
+
+          return false;
+        }
+      hash->shards[i]._lock = false;
+    }
+
+  const struct cuckoo_hash *first = &hash->shards[0].hash;
+  hash->hash_function = first->hash_function;
+  hash->seed1 = first->seed1;
+  hash->seed2 = first->seed2;
+  hash->choices = first->choices;
+  hash->shard_bits = shard_bits;
+
+  return true;
+}
+
+
+void
+cuckoo_hash_sharded_destroy(const struct cuckoo_hash_sharded *hash)
+{
+  size_t shards = (size_t) 1 << hash->shard_bits;
+  for (size_t i = 0; i < shards; ++i)
+    cuckoo_hash_destroy(&hash->shards[i].hash);
+  free(hash->shards);
+}
+
+
+size_t
+cuckoo_hash_sharded_count(const struct cuckoo_hash_sharded *hash)
+{
+  size_t count = 0;
+  size_t shards = (size_t) 1 << hash->shard_bits;
+  for (size_t i = 0; i < shards; ++i)
+    count += __atomic_load_n(&hash->shards[i].hash.count, __ATOMIC_RELAXED);
+
+  return count;
+}
+
+
+struct cuckoo_hash_item *
+cuckoo_hash_sharded_insert(struct cuckoo_hash_sharded *hash,
+                           const void *key, size_t key_len, void *value,
+                           struct cuckoo_hash_item *hash_item)
+{
+  struct cuckoo_hash_hashval hashval = hash_key(hash, key, key_len);
+  struct _cuckoo_hash_shard *shard =
+    &hash->shards[shard_index(hash, hashval)];
+
+  shard_lock(shard);
+  struct cuckoo_hash_item *res =
+    cuckoo_hash_insert_hashed(&shard->hash, key, key_len, value, hashval);
+  if (res != NULL && res != CUCKOO_HASH_FAILED)
+    {
+      if (hash_item)
+        {
+          *hash_item = *res;
+          res = hash_item;
+        }
+      else
+        {
+          res = CUCKOO_HASH_SHARDED_EXISTS;
+        }
+    }
+  shard_unlock(shard);
+
+  return res;
+}
+
+
+bool
+cuckoo_hash_sharded_lookup(struct cuckoo_hash_sharded *hash,
+                           const void *key, size_t key_len,
+                           struct cuckoo_hash_item *hash_item)
+{
+  struct cuckoo_hash_hashval hashval = hash_key(hash, key, key_len);
+  struct _cuckoo_hash_shard *shard =
+    &hash->shards[shard_index(hash, hashval)];
+
+  shard_lock(shard);
+  struct cuckoo_hash_item *res =
+    cuckoo_hash_lookup_hashed(&shard->hash, key, key_len, hashval);
+  if (res)
+    *hash_item = *res;
+  shard_unlock(shard);
+
+  return (res != NULL);
+}
+
+
+bool
+cuckoo_hash_sharded_remove(struct cuckoo_hash_sharded *hash,
+                           const void *key, size_t key_len,
+                           struct cuckoo_hash_item *hash_item)
+{
+  struct cuckoo_hash_hashval hashval = hash_key(hash, key, key_len);
+  struct _cuckoo_hash_shard *shard =
+    &hash->shards[shard_index(hash, hashval)];
+
+  shard_lock(shard);
+  struct cuckoo_hash_item *res =
+    cuckoo_hash_lookup_hashed(&shard->hash, key, key_len, hashval);
+  if (res && hash_item)
+    *hash_item = *res;
+  cuckoo_hash_remove(&shard->hash, res);
+  shard_unlock(shard);
+
+  return (res != NULL);
+}
+
+
+bool
+cuckoo_hash_sharded_upsert_with(struct cuckoo_hash_sharded *hash,
+                                const void *key, size_t key_len,
+                                cuckoo_hash_update_function *fn, void *ctx)
+{
+  struct cuckoo_hash_hashval hashval = hash_key(hash, key, key_len);
+  struct _cuckoo_hash_shard *shard =
+    &hash->shards[shard_index(hash, hashval)];
+
+  shard_lock(shard);
+  bool res = true;
+  struct cuckoo_hash_item *item =
+    cuckoo_hash_lookup_hashed(&shard->hash, key, key_len, hashval);
+  if (item)
+    {
+      fn(&item->value, true, ctx);
+    }
+  else
+    {
+      void *value = NULL;
+      if (fn(&value, false, ctx))
+        res = (cuckoo_hash_insert_hashed(&shard->hash, key, key_len, value,
+                                         hashval) == NULL);
+    }
+  shard_unlock(shard);
+
+  return res;
+}
+
+
+/*
+  Keys of a batch group, hashed and sorted by shard: the keys of shard
+  s are keys[order[i]] for i from start[s] to start[s + 1].
+*/
+struct group
+{
+  struct cuckoo_hash_hashval hashvals[BATCH_GROUP];
+  uint16_t order[BATCH_GROUP];
+  uint16_t start[(1U << CUCKOO_HASH_SHARDED_MAX_BITS) + 1];
+};
+
+
+static
+void
+sort_group(const struct cuckoo_hash_sharded *hash, struct group *group,
+           const void *const keys[], const size_t key_lens[], size_t n)
+{
+  unsigned int shards = 1U << hash->shard_bits;
+  uint8_t index[BATCH_GROUP];
+
+  memset(group->start, 0, (shards + 1) * sizeof(group->start[0]));
+  for (size_t i = 0; i < n; ++i)
+    {
+      group->hashvals[i] = hash_key(hash, keys[i], key_lens[i]);
+      index[i] = shard_index(hash, group->hashvals[i]);
+      ++group->start[index[i] + 1];
+    }
+
+  for (unsigned int s = 0; s < shards; ++s)
+    group->start[s + 1] += group->start[s];
+
+  /* Place keys at the ends of their shards, then shift back.  */
+  for (size_t i = 0; i < n; ++i)
+    group->order[group->start[index[i]]++] = i;
+  for (unsigned int s = shards; s > 0; --s)
+    group->start[s] = group->start[s - 1];
+  group->start[0] = 0;
+}
+
+
+/*
+  Lookup the keys into items, or insert them with values when items is
+  NULL.  Return the number of keys found or inserted, and set *failed
+  if some couldn't be inserted.
+*/
+static
+size_t
+batch(struct cuckoo_hash_sharded *hash, const void *const keys[],
+      const size_t key_lens[], void *const values[], size_t n,
+      struct cuckoo_hash_item items[], bool *failed)
+{
+  struct group group;
+  unsigned int shards = 1U << hash->shard_bits;
+  size_t done = 0;
+  for (size_t base = 0; base < n; base += BATCH_GROUP)
+    {
+      size_t count = (n - base < BATCH_GROUP ? n - base : BATCH_GROUP);
+      sort_group(hash, &group, keys + base, key_lens + base, count);
+
+      for (unsigned int s = 0; s < shards; ++s)
+        {
+          unsigned int beg = group.start[s], end = group.start[s + 1];
+          if (beg == end)
+            continue;
+
+          struct cuckoo_hash *shard = &hash->shards[s].hash;
+          shard_lock(&hash->shards[s]);
+          for (unsigned int j = beg; j < end && j < beg + PREFETCH_AHEAD;
+               ++j)
+            cuckoo_hash_prefetch_hashed(shard,
+                                        group.hashvals[group.order[j]]);
+          for (unsigned int j = beg; j < end; ++j)
+            {
+              if (j + PREFETCH_AHEAD < end)
+                cuckoo_hash_prefetch_hashed(
+                  shard, group.hashvals[group.order[j + PREFETCH_AHEAD]]);
+
+              size_t i = group.order[j];
+              const void *key = keys[base + i];
+              size_t key_len = key_lens[base + i];
+              if (items)
+                {
+                  struct cuckoo_hash_item *res =
+                    cuckoo_hash_lookup_hashed(shard, key, key_len,
+                                              group.hashvals[i]);
+                  if (res)
+                    {
+                      items[base + i] = *res;
+                      ++done;
+                    }
+                  else
+                    {
+                      items[base + i].key = NULL;
+                    }
+                }
+              else
+                {
+                  struct cuckoo_hash_item *res =
+                    cuckoo_hash_insert_hashed(shard, key, key_len,
+                                              values[base + i],
+                                              group.hashvals[i]);
+                  if (res == NULL)
+                    ++done;
+                  else if (res == CUCKOO_HASH_FAILED)
+                    *failed = true;
+                }
+            }
+          shard_unlock(&hash->shards[s]);
+        }
+    }
+
+  return done;
+}
+
+
+size_t
+cuckoo_hash_sharded_lookup_batch(struct cuckoo_hash_sharded *hash,
+                                 const void *const keys[],
+                                 const size_t key_lens[], size_t n,
+                                 struct cuckoo_hash_item items[])
+{
+  bool failed = false;
+
+  return batch(hash, keys, key_lens, NULL, n, items, &failed);
+}
+
+
+size_t
+cuckoo_hash_sharded_insert_batch(struct cuckoo_hash_sharded *hash,
+                                 const void *const keys[],
+                                 const size_t key_lens[],
+                                 void *const values[], size_t n)
+{
+  bool failed = false;
+  size_t inserted = batch(hash, keys, key_lens, values, n, NULL, &failed);
+
+  return (failed ? SIZE_MAX : inserted);
+}
+
+
+bool
+cuckoo_hash_sharded_visit(struct cuckoo_hash_sharded *hash,
+                          bool (*fn)(struct cuckoo_hash_item *hash_item,
+                                     void *ctx),
+                          void *ctx)
+{
+  size_t shards = (size_t) 1 << hash->shard_bits;
+  for (size_t i = 0; i < shards; ++i)
+    {
+      struct _cuckoo_hash_shard *shard = &hash->shards[i];
+      shard_lock(shard);
+      struct cuckoo_hash_item *it;
+      for (cuckoo_hash_each(it, &shard->hash))
+        {
+          if (! fn(it, ctx))
+            {
+              shard_unlock(shard);
+              return false;
+            }
+        }
+      shard_unlock(shard);
+    }
+
+  return true;
+}
@@ -0,0 +1,222 @@
+/*
+  Copyright (C) 2010 Tomash Brechko.  All rights reserved.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CUCKOO_HASH_SHARDED_H
+#define _CUCKOO_HASH_SHARDED_H 1
+
+#include "cuckoo_hash.h"
+
+
+/*
+  Sharded table: 2^shard_bits independent struct cuckoo_hash tables,
+  each with a lock of its own, that may be used from any number of
+  threads.  The key is hashed once, its shard is picked by the high
+  bits of the hash, and the shard is passed the same hash through the
+  *_hashed() functions.  Writers of different shards don't wait for
+  each other, and every shard grows by itself, so a shard that grows
+  holds up only the keys of that shard, for a 2^shard_bits part of the
+  time the whole table would take to grow.
+
+  This is simpler than the concurrent mode of struct cuckoo_hash, and
+  scales writers as well as readers, but lookups take the lock of the
+  shard too.  Results are copies of the elements, as the shard may
+  change once its lock is released.
+
+  A shard that reseeds, which it does only when keys collide while it
+  is mostly empty (see the seed option), no longer matches the hash
+  value computed for shard selection, so every operation on it hashes
+  the key a second time from then on.  Reseeding is kept, as it is
+  what defends a shard against keys crafted to collide.
+*/
+
+
+/*
+  Shard: the table and its lock, on cache lines of their own.  Treat
+  it as opaque.
+*/
+struct _cuckoo_hash_shard
+{
+  struct cuckoo_hash hash;
+  bool _lock;
+} __attribute__((__aligned__(64)));
+
+
+struct cuckoo_hash_sharded
+{
+  struct _cuckoo_hash_shard *shards;
+  cuckoo_hash_function *hash_function;
+  uint32_t seed1;
+  uint32_t seed2;
+  unsigned char choices;
+  unsigned char shard_bits;
+};
+
+
+#define CUCKOO_HASH_SHARDED_MAX_BITS  8
+
+
+/*
+  Result of cuckoo_hash_sharded_insert() for a key that is already in
+  the hash when hash_item is NULL.
+*/
+#define CUCKOO_HASH_SHARDED_EXISTS  ((void *) -2)
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif  /* __cplusplus */
+
+
+/*
+  cuckoo_hash_sharded_init(hash, shard_bits, power, options):
+
+  Initialize the hash with 2^shard_bits shards, at most
+  CUCKOO_HASH_SHARDED_MAX_BITS, each as cuckoo_hash_init_with(shard,
+  power, options) would.  options may be NULL for the defaults.  All
+  shards get the same seed, which is picked at random when the seed
+  option is zero.  The concurrent option can't be used, as shards are
+  locked anyway.
+
+  Return true on success, false if initialization failed (memory
+  exhausted, or invalid options).
+*/
+bool
+cuckoo_hash_sharded_init(struct cuckoo_hash_sharded *hash,
+                         unsigned int shard_bits, unsigned char power,
+                         const struct cuckoo_hash_options *options);
+
+
+/*
+  cuckoo_hash_sharded_destroy(hash):
+
+  Destroy the hash, i.e., free memory.
+*/
+void
+cuckoo_hash_sharded_destroy(const struct cuckoo_hash_sharded *hash);
+
+
+/*
+  cuckoo_hash_sharded_count(hash):
+
+  Return number of elements in the hash, the sum of those of the
+  shards.  Shards aren't locked, so while other threads change the
+  hash the result is only approximate.
+*/
+size_t
+cuckoo_hash_sharded_count(const struct cuckoo_hash_sharded *hash);
+
+
+/*
+  cuckoo_hash_sharded_insert(hash, key, key_len, value, hash_item):
+  cuckoo_hash_sharded_lookup(hash, key, key_len, hash_item):
+  cuckoo_hash_sharded_remove(hash, key, key_len, hash_item):
+
+  Same as cuckoo_hash_insert_shared(), cuckoo_hash_lookup_shared() and
+  cuckoo_hash_remove_shared(), each done under the lock of the shard
+  of the key: the element is copied to *hash_item rather than
+  returned.  hash_item may be NULL for inserts and removes, and an
+  insert of an existing key then returns CUCKOO_HASH_SHARDED_EXISTS.
+  Keys and values of removed elements may be freed right away, and
+  with the copy_keys option the key of the copy of a removed element
+  is already freed.
+*/
+struct cuckoo_hash_item *
+cuckoo_hash_sharded_insert(struct cuckoo_hash_sharded *hash,
+                           const void *key, size_t key_len, void *value,
+                           struct cuckoo_hash_item *hash_item);
+
+
+bool
+cuckoo_hash_sharded_lookup(struct cuckoo_hash_sharded *hash,
+                           const void *key, size_t key_len,
+                           struct cuckoo_hash_item *hash_item);
+
+
+bool
+cuckoo_hash_sharded_remove(struct cuckoo_hash_sharded *hash,
+                           const void *key, size_t key_len,
+                           struct cuckoo_hash_item *hash_item);
+
+
+/*
+  cuckoo_hash_sharded_upsert_with(hash, key, key_len, fn, ctx):
+
+  Same as cuckoo_hash_upsert_with(), fn is called with the shard of
+  the key locked.
+*/
+bool
+cuckoo_hash_sharded_upsert_with(struct cuckoo_hash_sharded *hash,
+                                const void *key, size_t key_len,
+                                cuckoo_hash_update_function *fn, void *ctx);
+
+
+/*
+  cuckoo_hash_sharded_lookup_batch(hash, keys, key_lens, n, items):
+  cuckoo_hash_sharded_insert_batch(hash, keys, key_lens, values, n):
+
+  Lookup or insert n keys at once.  keys[i] and key_lens[i] give the
+  i-th key, and values[i] its value.  Keys are hashed a group at a
+  time and sorted by shard, and then every shard is locked once for
+  all keys of the group that go to it, which are prefetched ahead of
+  the lookups or inserts.
+
+  cuckoo_hash_sharded_lookup_batch() copies the element of the i-th
+  key to items[i], or sets items[i].key to NULL if the key isn't in
+  the hash, and returns the number of keys found.
+  cuckoo_hash_sharded_insert_batch() leaves the keys that are already
+  in the hash alone, and returns the number of keys inserted, or
+  SIZE_MAX if some couldn't be inserted (memory exhausted), in which
+  case the others are still inserted.
+*/
+size_t
+cuckoo_hash_sharded_lookup_batch(struct cuckoo_hash_sharded *hash,
+                                 const void *const keys[],
+                                 const size_t key_lens[], size_t n,
+                                 struct cuckoo_hash_item items[]);
+
+
+size_t
+cuckoo_hash_sharded_insert_batch(struct cuckoo_hash_sharded *hash,
+                                 const void *const keys[],
+                                 const size_t key_lens[],
+                                 void *const values[], size_t n);
+
+
+/*
+  cuckoo_hash_sharded_visit(hash, fn, ctx):
+
+  Call fn(hash_item, ctx) for the elements of the hash, one shard at a
+  time, with the shard locked, until fn returns false.  fn may assign
+  to hash_item->value, but must not call any cuckoo_hash_sharded_*
+  function.  Elements inserted or removed by other threads meanwhile
+  may or may not be visited, but no element is visited twice.
+
+  Return false if fn did, true otherwise.
+*/
+bool
+cuckoo_hash_sharded_visit(struct cuckoo_hash_sharded *hash,
+                          bool (*fn)(struct cuckoo_hash_item *hash_item,
+                                     void *ctx),
+                          void *ctx);
+
+
+#ifdef __cplusplus
+}      /* extern "C" */
+#endif  /* __cplusplus */
+
+
+#endif  /* ! _CUCKOO_HASH_SHARDED_H */
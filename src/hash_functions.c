@@ -0,0 +1,287 @@
+/*
+  Copyright (C) 2010 Tomash Brechko.  All rights reserved.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cuckoo_hash.h"
+#ifdef HAVE_CONFIG_H
+#include "autoconfig.h"
+#endif
+#include <stdint.h>
+#include <string.h>
+#if defined(HAVE_X86_SIMD) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_CRC32C_SSE42  1
+#endif
+
+
+void
+cuckoo_hash_lookup3(const void *key, size_t key_len,
+                    uint32_t *h1, uint32_t *h2)
+{
+  extern void hashlittle2(const void *key, size_t length,
+                          uint32_t *pc, uint32_t *pb);
+
+  hashlittle2(key, key_len, h1, h2);
+}
+
+
+static inline
+uint64_t
+read8(const unsigned char *p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+
+static inline
+uint64_t
+read4(const unsigned char *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+
+/*
+  Read the last len (< 8) bytes of the key zero padded.
+*/
+static inline
+uint64_t
+read_tail(const unsigned char *p, size_t len)
+{
+  uint64_t v = 0;
+  memcpy(&v, p, len);
+  return v;
+}
+
+
+/* Finalization mix of MurmurHash3, a bijection on 32-bit values.  */
+static inline
+uint32_t
+fmix32(uint32_t h)
+{
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+
+  return h;
+}
+
+
+/*
+  CRC32C (Castagnoli) hash.
+
+  The key is fed to two CRC lanes, the second one seeing every 64-bit
+  word with its halves swapped.  CRC is linear, and two lanes that
+  differ only in the initial value would always differ by the same
+  constant for keys of equal length.  Feeding the lanes different data
+  makes the two hashes independent enough for cuckoo hashing, and the
+  final mix breaks the linearity.
+
+  SSE4.2 crc32 instruction is used when available, and a bitwise
+  software implementation producing the same values otherwise.
+*/
+
+#define CRC32C_POLY  0x82f63b78
+
+
+static
+uint32_t
+crc32c_u64_soft(uint32_t crc, uint64_t v)
+{
+  for (int i = 0; i < 8; ++i)
+    {
+      crc ^= (uint8_t) (v >> (i * 8));
+      for (int k = 0; k < 8; ++k)
+        crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+    }
+
+  return crc;
+}
+
+
+static inline
+uint64_t
+swap_halves(uint64_t v)
+{
+  return (v << 32) | (v >> 32);
+}
+
+
+static inline __attribute__((__always_inline__))
+void
+crc32c_with(const void *key, size_t key_len, uint32_t *h1, uint32_t *h2,
+            uint32_t (*crc32c_u64)(uint32_t crc, uint64_t v))
+{
+  const unsigned char *p = key;
+  uint32_t c1 = *h1, c2 = *h2;
+
+  size_t len = key_len;
+  while (len >= 8)
+    {
+      uint64_t v = read8(p);
+      c1 = crc32c_u64(c1, v);
+      c2 = crc32c_u64(c2, swap_halves(v));
+      p += 8;
+      len -= 8;
+    }
+  if (len > 0)
+    {
+      uint64_t v = read_tail(p, len);
+      c1 = crc32c_u64(c1, v);
+      c2 = crc32c_u64(c2, swap_halves(v));
+    }
+
+  *h1 = fmix32(c1 ^ (uint32_t) key_len);
+  *h2 = fmix32(c2 + (uint32_t) key_len);
+}
+
+
+static
+void
+crc32c_soft(const void *key, size_t key_len, uint32_t *h1, uint32_t *h2)
+{
+  crc32c_with(key, key_len, h1, h2, crc32c_u64_soft);
+}
+
+
+#ifdef HAVE_CRC32C_SSE42
+
+__attribute__((__target__("sse4.2")))
+static inline
+uint32_t
+crc32c_u64_sse42(uint32_t crc, uint64_t v)
+{
+  return _mm_crc32_u64(crc, v);
+}
+
+
+__attribute__((__target__("sse4.2")))
+static
+void
+crc32c_sse42(const void *key, size_t key_len, uint32_t *h1, uint32_t *h2)
+{
+  crc32c_with(key, key_len, h1, h2, crc32c_u64_sse42);
+}
+
+
+static cuckoo_hash_function *crc32c = crc32c_soft;
+
+
+static __attribute__((__constructor__))
+void
+select_crc32c(void)
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2"))
+    crc32c = crc32c_sse42;
+}
+
+#else  /* ! HAVE_CRC32C_SSE42 */
+
+#define crc32c  crc32c_soft
+
+#endif  /* ! HAVE_CRC32C_SSE42 */
+
+
+void
+cuckoo_hash_crc32c(const void *key, size_t key_len,
+                   uint32_t *h1, uint32_t *h2)
+{
+  crc32c(key, key_len, h1, h2);
+}
+
+
+/*
+  Multiply-mix hash in the style of wyhash: 64-bit words are combined
+  with the full 128-bit product of their multiplication, folded back
+  to 64 bits.  Keys of up to 16 bytes take a single multiplication
+  round.  The 64-bit result is split into the two hashes.
+*/
+
+#define MIX64_P0  0xa0761d6478bd642fULL
+#define MIX64_P1  0xe7037ed1a0b428dbULL
+
+
+static inline
+uint64_t
+mum(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+  unsigned __int128 r = (unsigned __int128) a * b;
+  return (uint64_t) r ^ (uint64_t) (r >> 64);
+#else
+  uint64_t ha = a >> 32, la = (uint32_t) a;
+  uint64_t hb = b >> 32, lb = (uint32_t) b;
+  uint64_t hh = ha * hb, hl = ha * lb, lh = la * hb, ll = la * lb;
+  uint64_t t = ll + (hl << 32);
+  uint64_t lo = t + (lh << 32);
+  uint64_t hi = hh + (hl >> 32) + (lh >> 32) + (t < ll) + (lo < t);
+  return lo ^ hi;
+#endif
+}
+
+
+void
+cuckoo_hash_mix64(const void *key, size_t key_len,
+                  uint32_t *h1, uint32_t *h2)
+{
+  const unsigned char *p = key;
+  uint64_t seed = (((uint64_t) *h1 << 32) | *h2) ^ MIX64_P0;
+  uint64_t a, b;
+
+  if (key_len <= 16)
+    {
+      if (key_len >= 4)
+        {
+          size_t off = (key_len >> 3) << 2;
+          a = (read4(p) << 32) | read4(p + off);
+          b = (read4(p + key_len - 4) << 32) | read4(p + key_len - 4 - off);
+        }
+      else if (key_len > 0)
+        {
+          a = (((uint64_t) p[0] << 16) | ((uint64_t) p[key_len >> 1] << 8)
+               | p[key_len - 1]);
+          b = 0;
+        }
+      else
+        {
+          a = b = 0;
+        }
+    }
+  else
+    {
+      size_t len = key_len;
+      while (len > 16)
+        {
+          seed = mum(read8(p) ^ MIX64_P1, read8(p + 8) ^ seed);
+          p += 16;
+          len -= 16;
+        }
+      a = read8(p + len - 16);
+      b = read8(p + len - 8);
+    }
+
+  uint64_t h = mum(MIX64_P1 ^ key_len, mum(a ^ MIX64_P1, b ^ seed));
+
+  *h1 = (uint32_t) h;
+  *h2 = (uint32_t) (h >> 32);
+}
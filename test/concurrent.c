@@ -0,0 +1,623 @@
+/*
+  Copyright (C) 2010 Tomash Brechko.  All rights reserved.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Look keys up with cuckoo_hash_lookup_shared() from several threads
+  while the main thread inserts, removes, grows and shrinks the table,
+  and while several threads insert and remove keys or update their
+  values, then compare throughput with that of the table under a lock.
+*/
+
+#include "../src/cuckoo_hash.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "test.h"
+
+
+#define READERS  4
+#define WRITERS  4
+#define MAX_THREADS  64
+
+/* The value of every key after check_counters().  */
+#define COUNTER_TOTAL  ((WRITERS + 1) * WRITERS / 2 + WRITERS)
+
+
+static uint64_t *keys;
+static int count;
+static struct cuckoo_hash hash;
+static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile int done;
+static int inserted;
+
+
+static
+double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/*
+  The first half of the keys stays in the table all the time, keys of
+  the second half come and go, but always with the same values.
+*/
+static
+void *
+check_reader(void *arg)
+{
+  (void) arg;
+
+  struct cuckoo_hash_reader reader;
+  cuckoo_hash_reader_register(&hash, &reader);
+
+  unsigned long lookups = 0;
+  for (int i = 0; ! done; i = (i + 1) % count, ++lookups)
+    {
+      struct cuckoo_hash_item item;
+      bool found = cuckoo_hash_lookup_shared(&hash, &reader,
+                                             &keys[i], sizeof(keys[i]),
+                                             &item);
+      ok(found || i >= count / 2, ": key %d not found", i);
+      if (found)
+        ok(item.value == (void *) (uintptr_t) (i + 1)
+           && item.key_len == sizeof(keys[i])
+           && *(const uint64_t *) item.key == keys[i]);
+    }
+
+  cuckoo_hash_reader_unregister(&hash, &reader);
+
+  return (void *) lookups;
+}
+
+
+static
+void
+churn(void)
+{
+  for (int i = count / 2; i < count; ++i)
+    ok(cuckoo_hash_insert(&hash, &keys[i], sizeof(keys[i]),
+                          (void *) (uintptr_t) (i + 1)) == NULL);
+
+  for (int round = 0; round < 4; ++round)
+    {
+      for (int i = count / 2 + round % 2; i < count; i += 2)
+        cuckoo_hash_remove(&hash,
+                           cuckoo_hash_lookup(&hash, &keys[i],
+                                              sizeof(keys[i])));
+      for (int i = count / 2 + round % 2; i < count; i += 2)
+        ok(cuckoo_hash_insert(&hash, &keys[i], sizeof(keys[i]),
+                              (void *) (uintptr_t) (i + 1)) == NULL);
+    }
+
+  for (int i = count / 2; i < count; ++i)
+    cuckoo_hash_remove(&hash,
+                       cuckoo_hash_lookup(&hash, &keys[i], sizeof(keys[i])));
+  ok(cuckoo_hash_shrink_to_fit(&hash));
+  ok(cuckoo_hash_reserve(&hash, count * 2, 0.5));
+  cuckoo_hash_synchronize(&hash);
+}
+
+
+static
+void
+check(void)
+{
+  struct cuckoo_hash_options options = { .concurrent = true };
+  ok(cuckoo_hash_init_with(&hash, 1, &options));
+
+  for (int i = 0; i < count / 2; ++i)
+    ok(cuckoo_hash_insert(&hash, &keys[i], sizeof(keys[i]),
+                          (void *) (uintptr_t) (i + 1)) == NULL);
+
+  done = 0;
+  pthread_t threads[READERS];
+  for (int i = 0; i < READERS; ++i)
+    ok(pthread_create(&threads[i], NULL, check_reader, NULL) == 0);
+
+  churn();
+
+  done = 1;
+  unsigned long lookups = 0;
+  for (int i = 0; i < READERS; ++i)
+    {
+      void *res;
+      ok(pthread_join(threads[i], &res) == 0);
+      lookups += (unsigned long) res;
+    }
+  printf("  %lu lookups during changes\n", lookups);
+
+  ok(cuckoo_hash_count(&hash) == (size_t) count / 2);
+  cuckoo_hash_destroy(&hash);
+
+  options.migrate_step = 1;
+  ok(! cuckoo_hash_init_with(&hash, 1, &options));
+}
+
+
+/*
+  Every writer inserts all keys, starting at a different one, so that
+  writers often insert the same key at once.
+*/
+static
+void *
+insert_writer(void *arg)
+{
+  int id = (int) (intptr_t) arg;
+
+  struct cuckoo_hash_reader reader;
+  cuckoo_hash_reader_register(&hash, &reader);
+
+  for (int n = 0, i = id * (count / WRITERS); n < count;
+       ++n, i = (i + 1 < count ? i + 1 : 0))
+    {
+      struct cuckoo_hash_item item;
+      struct cuckoo_hash_item *res =
+        cuckoo_hash_insert_shared(&hash, &reader, &keys[i], sizeof(keys[i]),
+                                  (void *) (uintptr_t) (i + 1), &item);
+      ok(res != CUCKOO_HASH_FAILED);
+      if (res)
+        ok(res == &item && item.value == (void *) (uintptr_t) (i + 1));
+      else
+        __atomic_fetch_add(&inserted, 1, __ATOMIC_RELAXED);
+    }
+
+  cuckoo_hash_reader_unregister(&hash, &reader);
+
+  return NULL;
+}
+
+
+/*
+  Writers remove the keys of the second half, each its own ones.
+*/
+static
+void *
+remove_writer(void *arg)
+{
+  int id = (int) (intptr_t) arg;
+
+  struct cuckoo_hash_reader reader;
+  cuckoo_hash_reader_register(&hash, &reader);
+
+  for (int i = count / 2 + id; i < count; i += WRITERS)
+    {
+      struct cuckoo_hash_item item;
+      ok(cuckoo_hash_remove_shared(&hash, &reader, &keys[i], sizeof(keys[i]),
+                                   &item));
+      ok(item.value == (void *) (uintptr_t) (i + 1));
+      ok(! cuckoo_hash_remove_shared(&hash, &reader, &keys[i],
+                                     sizeof(keys[i]), NULL));
+    }
+
+  cuckoo_hash_reader_unregister(&hash, &reader);
+
+  return NULL;
+}
+
+
+static
+void
+run_writers(void *(*writer)(void *))
+{
+  done = 0;
+  pthread_t threads[READERS + WRITERS];
+  for (int i = 0; i < READERS; ++i)
+    ok(pthread_create(&threads[i], NULL, check_reader, NULL) == 0);
+  for (int i = 0; i < WRITERS; ++i)
+    ok(pthread_create(&threads[READERS + i], NULL, writer,
+                      (void *) (intptr_t) i) == 0);
+
+  for (int i = 0; i < WRITERS; ++i)
+    ok(pthread_join(threads[READERS + i], NULL) == 0);
+  done = 1;
+  for (int i = 0; i < READERS; ++i)
+    ok(pthread_join(threads[i], NULL) == 0);
+}
+
+
+static
+void
+check_writers(void)
+{
+  struct cuckoo_hash_options options = { .concurrent = true };
+  ok(cuckoo_hash_init_with(&hash, 1, &options));
+
+  /* Readers expect the first half to be there.  */
+  for (int i = 0; i < count / 2; ++i)
+    ok(cuckoo_hash_insert(&hash, &keys[i], sizeof(keys[i]),
+                          (void *) (uintptr_t) (i + 1)) == NULL);
+
+  inserted = count / 2;
+  run_writers(insert_writer);
+  ok(inserted == count);
+  ok(cuckoo_hash_count(&hash) == (size_t) count);
+
+  run_writers(remove_writer);
+  ok(cuckoo_hash_count(&hash) == (size_t) count / 2);
+  for (int i = 0; i < count; ++i)
+    ok((cuckoo_hash_lookup(&hash, &keys[i], sizeof(keys[i])) != NULL)
+       == (i < count / 2));
+  printf("  %d keys inserted and %d removed by %d writers\n",
+         count, count - count / 2, WRITERS);
+
+  cuckoo_hash_destroy(&hash);
+}
+
+
+/*
+  Every writer adds its number plus one to the counters of all keys,
+  then adds one more with compare-exchange, starting at different keys.
+*/
+static
+void *
+count_writer(void *arg)
+{
+  int id = (int) (intptr_t) arg;
+
+  struct cuckoo_hash_reader reader;
+  cuckoo_hash_reader_register(&hash, &reader);
+
+  for (int n = 0, i = id * (count / WRITERS); n < count;
+       ++n, i = (i + 1 < count ? i + 1 : 0))
+    {
+      uintptr_t old;
+      ok(cuckoo_hash_fetch_add(&hash, &reader, &keys[i], sizeof(keys[i]),
+                               id + 1, &old));
+      ok(old + id + 1 <= (uintptr_t) COUNTER_TOTAL);
+    }
+
+  for (int n = 0, i = id * (count / WRITERS); n < count;
+       ++n, i = (i + 1 < count ? i + 1 : 0))
+    {
+      void *expected = NULL;
+      while (! cuckoo_hash_compare_exchange_value(&hash, &reader, &keys[i],
+                                                  sizeof(keys[i]), &expected,
+                                                  (char *) expected + 1))
+        ok(expected != NULL);
+    }
+
+  cuckoo_hash_reader_unregister(&hash, &reader);
+
+  return NULL;
+}
+
+
+static
+bool
+insert_only(void **value, bool found, void *ctx)
+{
+  ok(! found && *value == NULL);
+  *value = ctx;
+
+  return ! found;
+}
+
+
+static
+bool
+never_insert(void **value, bool found, void *ctx)
+{
+  (void) ctx;
+  ok(! found && *value == NULL);
+
+  return false;
+}
+
+
+static
+void
+check_counters(bool concurrent)
+{
+  struct cuckoo_hash_options options = { .concurrent = concurrent };
+  ok(cuckoo_hash_init_with(&hash, 1, &options));
+
+  if (concurrent)
+    {
+      pthread_t threads[WRITERS];
+      for (int i = 0; i < WRITERS; ++i)
+        ok(pthread_create(&threads[i], NULL, count_writer,
+                          (void *) (intptr_t) i) == 0);
+      for (int i = 0; i < WRITERS; ++i)
+        ok(pthread_join(threads[i], NULL) == 0);
+    }
+  else
+    {
+      for (int i = 0; i < WRITERS; ++i)
+        count_writer((void *) (intptr_t) i);
+    }
+
+  uintptr_t total = COUNTER_TOTAL;
+  ok(cuckoo_hash_count(&hash) == (size_t) count);
+  for (int i = 0; i < count; ++i)
+    {
+      struct cuckoo_hash_item *item =
+        cuckoo_hash_lookup(&hash, &keys[i], sizeof(keys[i]));
+      ok(item && item->value == (void *) total, ": key %d", i);
+    }
+
+  struct cuckoo_hash_reader reader;
+  cuckoo_hash_reader_register(&hash, &reader);
+
+  void *expected = NULL;
+  ok(! cuckoo_hash_compare_exchange_value(&hash, &reader, &keys[0],
+                                          sizeof(keys[0]), &expected, NULL));
+  ok(expected == (void *) total);
+
+  ok(cuckoo_hash_remove_shared(&hash, &reader, &keys[0], sizeof(keys[0]),
+                               NULL));
+  ok(cuckoo_hash_upsert_with(&hash, &reader, &keys[0], sizeof(keys[0]),
+                             never_insert, NULL));
+  ok(cuckoo_hash_lookup(&hash, &keys[0], sizeof(keys[0])) == NULL);
+  ok(cuckoo_hash_upsert_with(&hash, &reader, &keys[0], sizeof(keys[0]),
+                             insert_only, &expected));
+  ok(cuckoo_hash_lookup(&hash, &keys[0], sizeof(keys[0]))->value
+     == &expected);
+  ok(cuckoo_hash_count(&hash) == (size_t) count);
+
+  cuckoo_hash_reader_unregister(&hash, &reader);
+  cuckoo_hash_destroy(&hash);
+}
+
+
+struct bench
+{
+  bool shared;
+  int lookups;
+  int offset;
+};
+
+
+static
+void *
+bench_reader(void *arg)
+{
+  const struct bench *bench = arg;
+
+  struct cuckoo_hash_reader reader;
+  cuckoo_hash_reader_register(&hash, &reader);
+
+  int found = 0;
+  for (int n = 0, i = bench->offset; n < bench->lookups;
+       ++n, i = (i + 1 < count ? i + 1 : 0))
+    {
+      if (bench->shared)
+        {
+          struct cuckoo_hash_item item;
+          found += cuckoo_hash_lookup_shared(&hash, &reader, &keys[i],
+                                             sizeof(keys[i]), &item);
+        }
+      else
+        {
+          pthread_rwlock_rdlock(&rwlock);
+          found += (cuckoo_hash_lookup(&hash, &keys[i], sizeof(keys[i]))
+                    != NULL);
+          pthread_rwlock_unlock(&rwlock);
+        }
+    }
+  ok(found == bench->lookups);
+
+  cuckoo_hash_reader_unregister(&hash, &reader);
+
+  return NULL;
+}
+
+
+/*
+  Return the throughput of nthreads threads looking up count keys
+  each, in millions of lookups per second.
+*/
+static
+double
+throughput(bool shared, int nthreads)
+{
+  pthread_t threads[MAX_THREADS];
+  struct bench benches[MAX_THREADS];
+
+  double start = now();
+  for (int i = 0; i < nthreads; ++i)
+    {
+      benches[i] = (struct bench) {
+        .shared = shared, .lookups = count, .offset = i * (count / nthreads)
+      };
+      ok(pthread_create(&threads[i], NULL, bench_reader, &benches[i]) == 0);
+    }
+  for (int i = 0; i < nthreads; ++i)
+    ok(pthread_join(threads[i], NULL) == 0);
+  double stop = now();
+
+  return (double) count * nthreads / (stop - start) / 1e6;
+}
+
+
+static
+void *
+bench_writer(void *arg)
+{
+  const struct bench *bench = arg;
+
+  struct cuckoo_hash_reader reader;
+  cuckoo_hash_reader_register(&hash, &reader);
+
+  for (int i = bench->offset; i < bench->offset + bench->lookups; ++i)
+    {
+      if (bench->shared)
+        {
+          struct cuckoo_hash_item item;
+          ok(cuckoo_hash_insert_shared(&hash, &reader, &keys[i],
+                                       sizeof(keys[i]), NULL, &item)
+             == NULL);
+        }
+      else
+        {
+          pthread_mutex_lock(&mutex);
+          ok(cuckoo_hash_insert(&hash, &keys[i], sizeof(keys[i]), NULL)
+             == NULL);
+          pthread_mutex_unlock(&mutex);
+        }
+    }
+
+  cuckoo_hash_reader_unregister(&hash, &reader);
+
+  return NULL;
+}
+
+
+static
+void *
+bench_counter(void *arg)
+{
+  const struct bench *bench = arg;
+
+  struct cuckoo_hash_reader reader;
+  cuckoo_hash_reader_register(&hash, &reader);
+
+  for (int n = 0, i = bench->offset; n < bench->lookups;
+       ++n, i = (i + 1 < count ? i + 1 : 0))
+    {
+      if (bench->shared)
+        {
+          ok(cuckoo_hash_fetch_add(&hash, &reader, &keys[i],
+                                   sizeof(keys[i]), 1, NULL));
+        }
+      else
+        {
+          pthread_mutex_lock(&mutex);
+          struct cuckoo_hash_item *item =
+            cuckoo_hash_lookup(&hash, &keys[i], sizeof(keys[i]));
+          if (item)
+            item->value = (char *) item->value + 1;
+          else
+            ok(cuckoo_hash_insert(&hash, &keys[i], sizeof(keys[i]),
+                                  (void *) 1) == NULL);
+          pthread_mutex_unlock(&mutex);
+        }
+    }
+
+  cuckoo_hash_reader_unregister(&hash, &reader);
+
+  return NULL;
+}
+
+
+/*
+  Return the throughput of nthreads threads inserting count keys in
+  all into an empty table, in millions of inserts per second.  With
+  counter, every thread instead counts all keys into it.
+*/
+static
+double
+insert_throughput(bool shared, bool counter, int nthreads)
+{
+  pthread_t threads[MAX_THREADS];
+  struct bench benches[MAX_THREADS];
+
+  struct cuckoo_hash_options options = { .concurrent = true };
+  ok(cuckoo_hash_init_with(&hash, 1, &options));
+
+  double start = now();
+  for (int i = 0; i < nthreads; ++i)
+    {
+      int beg = (int) ((long) count * i / nthreads);
+      int end = (int) ((long) count * (i + 1) / nthreads);
+      benches[i] = (struct bench) {
+        .shared = shared, .lookups = end - beg, .offset = beg
+      };
+      if (counter)
+        benches[i].lookups = count;
+      ok(pthread_create(&threads[i], NULL,
+                        counter ? bench_counter : bench_writer,
+                        &benches[i]) == 0);
+    }
+  for (int i = 0; i < nthreads; ++i)
+    ok(pthread_join(threads[i], NULL) == 0);
+  double stop = now();
+
+  ok(cuckoo_hash_count(&hash) == (size_t) count);
+  cuckoo_hash_destroy(&hash);
+
+  return (double) count * (counter ? nthreads : 1) / (stop - start) / 1e6;
+}
+
+
+static
+void
+bench(void)
+{
+  struct cuckoo_hash_options options = { .concurrent = true };
+  ok(cuckoo_hash_init_with(&hash, 1, &options));
+  for (int i = 0; i < count; ++i)
+    ok(cuckoo_hash_insert(&hash, &keys[i], sizeof(keys[i]),
+                          (void *) (uintptr_t) (i + 1)) == NULL);
+
+  int cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus > MAX_THREADS)
+    cpus = MAX_THREADS;
+  for (int nthreads = 1; nthreads <= cpus; nthreads *= 2)
+    printf("  %2d threads: %6.1f M/s shared, %6.1f M/s rwlock lookups\n",
+           nthreads, throughput(true, nthreads), throughput(false, nthreads));
+
+  cuckoo_hash_destroy(&hash);
+
+  for (int nthreads = 1; nthreads <= cpus; nthreads *= 2)
+    printf("  %2d threads: %6.1f M/s shared, %6.1f M/s mutex inserts\n",
+           nthreads, insert_throughput(true, false, nthreads),
+           insert_throughput(false, false, nthreads));
+
+  for (int nthreads = 1; nthreads <= cpus; nthreads *= 2)
+    printf("  %2d threads: %6.1f M/s shared, %6.1f M/s mutex counts\n",
+           nthreads, insert_throughput(true, true, nthreads),
+           insert_throughput(false, true, nthreads));
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  if (argc != 2)
+    {
+      fprintf(stderr, "Usage: %s COUNT\n", argv[0]);
+      exit(2);
+    }
+
+  count = atoi(argv[1]);
+  ok(count >= 2);
+
+  keys = malloc(count * sizeof(*keys));
+  ok(keys);
+  for (int i = 0; i < count; ++i)
+    keys[i] = (uint64_t) i * 0x9e3779b97f4a7c15ULL;
+
+  printf("Concurrent lookups of %d keys:\n", count);
+  check();
+  check_writers();
+  check_counters(true);
+  check_counters(false);
+  bench();
+
+  free(keys);
+
+  return 0;
+}
@@ -0,0 +1,6 @@
+#! /bin/sh
+
+COUNT=500000
+
+echo "Running the allocator test for $COUNT elements"
+./cuckoo_hash_allocator 0 $COUNT
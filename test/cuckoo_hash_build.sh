@@ -0,0 +1,6 @@
+#! /bin/sh
+
+COUNT=500000
+
+echo "Running the parallel build test for $COUNT elements"
+./cuckoo_hash_build 0 $COUNT
@@ -0,0 +1,6 @@
+#! /bin/sh
+
+COUNT=500000
+
+echo "Running the test with three choices at load 0.98 for $COUNT elements"
+./cuckoo_hash_choices3 0 $COUNT
@@ -0,0 +1,6 @@
+#! /bin/sh
+
+COUNT=500000
+
+echo "Running the test with four choices of bins of two for $COUNT elements"
+./cuckoo_hash_choices4 0 $COUNT
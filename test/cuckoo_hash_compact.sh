@@ -0,0 +1,6 @@
+#! /bin/sh
+
+COUNT=500000
+
+echo "Running the compact table test for $COUNT elements"
+./cuckoo_hash_compact 0 $COUNT
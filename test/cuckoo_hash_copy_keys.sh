@@ -0,0 +1,6 @@
+#! /bin/sh
+
+COUNT=500000
+
+echo "Running the key copying test for $COUNT elements"
+./cuckoo_hash_copy_keys 0 $COUNT
@@ -0,0 +1,6 @@
+#! /bin/sh
+
+COUNT=500000
+
+echo "Running the declared table test for $COUNT elements"
+./cuckoo_hash_declare $COUNT
@@ -0,0 +1,6 @@
+#! /bin/sh
+
+COUNT=500000
+
+echo "Running the growth policy test for $COUNT elements"
+./cuckoo_hash_growth 0 $COUNT
@@ -0,0 +1,7 @@
+#! /bin/sh
+
+COUNT=500000
+
+# Without a huge page pool this tests the fallback to normal mappings.
+echo "Running the huge page storage test for $COUNT elements"
+./cuckoo_hash_hugetlb 0 $COUNT
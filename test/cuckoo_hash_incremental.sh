@@ -0,0 +1,8 @@
+#! /bin/sh
+
+# Just below 2^18 slots, so that the last growth of the table is
+# likely still being migrated when lookups start.
+COUNT=262000
+
+echo "Running the incremental growth test for $COUNT elements"
+./cuckoo_hash_incremental 0 $COUNT
@@ -0,0 +1,6 @@
+#! /bin/sh
+
+COUNT=500000
+
+echo "Running the inline keys test for $COUNT elements"
+./cuckoo_hash_inline_keys 0 $COUNT
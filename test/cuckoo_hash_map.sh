@@ -0,0 +1,6 @@
+#! /bin/sh
+
+COUNT=500000
+
+echo "Running the C++ cuckoo::hash_map test for $COUNT elements"
+./cuckoo_hash_map 0 $COUNT
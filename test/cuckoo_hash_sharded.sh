@@ -0,0 +1,6 @@
+#! /bin/sh
+
+COUNT=500000
+
+echo "Running the sharded table test for $COUNT elements"
+./cuckoo_hash_sharded $COUNT
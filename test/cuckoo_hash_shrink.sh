@@ -0,0 +1,6 @@
+#! /bin/sh
+
+COUNT=500000
+
+echo "Running the shrinking table test for $COUNT elements"
+./cuckoo_hash_shrink 0 $COUNT
@@ -0,0 +1,184 @@
+/*
+  Copyright (C) 2010 Tomash Brechko.  All rights reserved.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Compare the table declared with CUCKOO_HASH_DECLARE() for 64-bit
+  integer keys with struct cuckoo_hash holding the same keys.
+*/
+
+#include "../src/cuckoo_hash_declare.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "test.h"
+
+
+CUCKOO_HASH_DECLARE(id_map, uint64_t, uint64_t,
+                    cuckoo_hash_int_hash, cuckoo_hash_int_eq);
+
+
+/* Hash that puts all keys into the same two bins.  */
+#define constant_hash(key, seed)  ((void) (key), (void) (seed), 1ULL)
+
+
+CUCKOO_HASH_DECLARE(same_map, uint64_t, uint64_t,
+                    constant_hash, cuckoo_hash_int_eq);
+
+
+static
+double
+ns_per_op(clock_t start, clock_t stop, int count)
+{
+  return (double) (stop - start) / CLOCKS_PER_SEC * 1e9 / count;
+}
+
+
+static
+void
+declared(const uint64_t *keys, int count)
+{
+  struct id_map map;
+  ok(id_map_init(&map, 1, 0));
+
+  clock_t start = clock();
+  for (int i = 0; i < count; ++i)
+    ok(id_map_insert(&map, keys[i], i) == NULL);
+  clock_t stop = clock();
+  printf("  declared insert: %.1f ns\n", ns_per_op(start, stop, count));
+
+  ok(id_map_insert(&map, keys[0], 0) == id_map_lookup(&map, keys[0]));
+  ok(id_map_count(&map) == (size_t) count);
+
+  /* Odd keys were not inserted.  */
+  int found = 0;
+  start = clock();
+  for (int i = 0; i < count; ++i)
+    {
+      struct id_map_slot *slot = id_map_lookup(&map, keys[i]);
+      ok(slot && slot->value == (uint64_t) i);
+      found += (id_map_lookup(&map, keys[i] | 1) != NULL);
+    }
+  stop = clock();
+  ok(found == 0);
+  printf("  declared lookup: %.1f ns\n", ns_per_op(start, stop, count * 2));
+
+  uint64_t sum = 0;
+  struct id_map_slot *it;
+  for (cuckoo_hash_declare_each(id_map, it, &map))
+    sum += it->value;
+  ok(sum == (uint64_t) count * (count - 1) / 2);
+
+  for (int i = 0; i < count; i += 2)
+    id_map_remove(&map, id_map_lookup(&map, keys[i]));
+  ok(id_map_count(&map) == (size_t) count / 2);
+  for (int i = 0; i < count; ++i)
+    {
+      bool odd = (i & 1);
+      ok((id_map_lookup(&map, keys[i]) != NULL) == odd);
+    }
+
+  id_map_destroy(&map);
+}
+
+
+/*
+  Keys with equal hashes fill their two bins, and then fail without
+  growing the table.
+*/
+static
+void
+colliding(const uint64_t *keys, int count)
+{
+  int n = 2 * CUCKOO_HASH_DECLARE_BIN_SIZE;
+  if (count <= n)
+    return;
+
+  struct same_map map;
+  ok(same_map_init(&map, 1, 0));
+
+  for (int i = 0; i < n; ++i)
+    ok(same_map_insert(&map, keys[i], i) == NULL);
+  ok(same_map_insert(&map, keys[n], n) == CUCKOO_HASH_FAILED);
+  ok(map.power == 1);
+  for (int i = 0; i < n; ++i)
+    ok(same_map_lookup(&map, keys[i]) != NULL);
+
+  same_map_remove(&map, same_map_lookup(&map, keys[0]));
+  ok(same_map_insert(&map, keys[n], n) == NULL);
+  ok(same_map_count(&map) == (size_t) n);
+
+  same_map_destroy(&map);
+}
+
+
+static
+void
+generic(const uint64_t *keys, int count)
+{
+  struct cuckoo_hash hash;
+  ok(cuckoo_hash_init(&hash, 1));
+
+  clock_t start = clock();
+  for (int i = 0; i < count; ++i)
+    ok(cuckoo_hash_insert(&hash, &keys[i], sizeof(keys[i]),
+                          (void *) (uintptr_t) i) == NULL);
+  clock_t stop = clock();
+  printf("  cuckoo_hash insert: %.1f ns\n", ns_per_op(start, stop, count));
+
+  int found = 0;
+  start = clock();
+  for (int i = 0; i < count; ++i)
+    {
+      uint64_t miss = keys[i] | 1;
+      ok(cuckoo_hash_lookup(&hash, &keys[i], sizeof(keys[i])) != NULL);
+      found += (cuckoo_hash_lookup(&hash, &miss, sizeof(miss)) != NULL);
+    }
+  stop = clock();
+  ok(found == 0);
+  printf("  cuckoo_hash lookup: %.1f ns\n", ns_per_op(start, stop, count * 2));
+
+  cuckoo_hash_destroy(&hash);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  if (argc != 2)
+    {
+      fprintf(stderr, "Usage: %s COUNT\n", argv[0]);
+      exit(2);
+    }
+
+  int count = atoi(argv[1]);
+
+  /* Distinct even keys.  */
+  uint64_t *keys = malloc(count * sizeof(*keys));
+  ok(keys);
+  for (int i = 0; i < count; ++i)
+    keys[i] = ((uint64_t) i * 0x9e3779b97f4a7c15ULL) << 1;
+
+  printf("%d 64-bit integer keys:\n", count);
+  declared(keys, count);
+  colliding(keys, count);
+  generic(keys, count);
+
+  free(keys);
+
+  return 0;
+}
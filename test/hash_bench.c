@@ -0,0 +1,358 @@
+/*
+  Copyright (C) 2010 Tomash Brechko.  All rights reserved.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Compare built-in hash functions: throughput on short keys, and
+  distribution of the hashes over bins for structured key sets.  Also
+  check that a table copes with keys colliding under its seed, first
+  with the stash, and then by reseeding.
+*/
+
+#include "../src/cuckoo_hash.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include "test.h"
+
+
+#define BIN_POWER  16
+#define BIN_COUNT  (1U << BIN_POWER)
+#define KEY_MAX  32
+
+
+struct function
+{
+  const char *name;
+  cuckoo_hash_function *hash_function;
+};
+
+
+static const struct function functions[] = {
+  { "lookup3", cuckoo_hash_lookup3 },
+  { "crc32c", cuckoo_hash_crc32c },
+  { "mix64", cuckoo_hash_mix64 }
+};
+
+
+/*
+  Key sets.  Keys are stored KEY_MAX bytes apart.
+*/
+static
+size_t
+make_decimal_keys(char *keys, size_t *key_lens, int count)
+{
+  for (int i = 0; i < count; ++i)
+    key_lens[i] = sprintf(keys + (size_t) i * KEY_MAX, "k%d", i);
+
+  return count;
+}
+
+
+static
+size_t
+make_binary_keys(char *keys, size_t *key_lens, int count, size_t len)
+{
+  for (int i = 0; i < count; ++i)
+    {
+      uint64_t v = i;
+      char *key = keys + (size_t) i * KEY_MAX;
+      memset(key, 0, len);
+      memcpy(key, &v, sizeof(v) < len ? sizeof(v) : len);
+      key_lens[i] = len;
+    }
+
+  return count;
+}
+
+
+static
+double
+chi_square(const unsigned int *bins, int count)
+{
+  double expected = (double) count / BIN_COUNT;
+  double chi2 = 0;
+  for (unsigned int i = 0; i < BIN_COUNT; ++i)
+    {
+      double d = bins[i] - expected;
+      chi2 += d * d / expected;
+    }
+
+  return chi2;
+}
+
+
+static
+void
+quality(const struct function *f, const char *set,
+        const char *keys, const size_t *key_lens, int count)
+{
+  unsigned int *bins1 = calloc(BIN_COUNT, sizeof(*bins1));
+  unsigned int *bins2 = calloc(BIN_COUNT, sizeof(*bins2));
+  ok(bins1 && bins2);
+
+  int same_bin = 0;
+  for (int i = 0; i < count; ++i)
+    {
+      uint32_t h1 = 0x3ac5d673, h2 = 0x6d7839d0;
+      f->hash_function(keys + (size_t) i * KEY_MAX, key_lens[i], &h1, &h2);
+      ++bins1[h1 & (BIN_COUNT - 1)];
+      ++bins2[h2 & (BIN_COUNT - 1)];
+      if (((h1 ^ h2) & (BIN_COUNT - 1)) == 0)
+        ++same_bin;
+    }
+
+  double chi2_1 = chi_square(bins1, count);
+  double chi2_2 = chi_square(bins2, count);
+  double same_expected = (double) count / BIN_COUNT;
+
+  printf("  %-8s %-10s chi2(h1)/bins: %.3f  chi2(h2)/bins: %.3f"
+         "  same bin: %d (expected %.1f)\n",
+         f->name, set, chi2_1 / BIN_COUNT, chi2_2 / BIN_COUNT,
+         same_bin, same_expected);
+
+  /* Allow eight standard deviations of the chi-square statistic.  */
+  double bound = BIN_COUNT + 8 * sqrt(2.0 * BIN_COUNT);
+  ok(chi2_1 < bound, " for %s on %s keys", f->name, set);
+  ok(chi2_2 < bound, " for %s on %s keys", f->name, set);
+  ok(same_bin < same_expected + 8 * sqrt(same_expected) + 8,
+     " for %s on %s keys", f->name, set);
+
+  free(bins1);
+  free(bins2);
+}
+
+
+static
+void
+throughput(const struct function *f, char *keys, size_t *key_lens,
+           int count, int repeat)
+{
+  printf("  %-8s", f->name);
+  for (size_t len = 8; len <= KEY_MAX; len += 8)
+    {
+      make_binary_keys(keys, key_lens, count, len);
+
+      uint32_t sum = 0;
+      clock_t start = clock();
+      for (int j = 0; j < repeat; ++j)
+        {
+          for (int i = 0; i < count; ++i)
+            {
+              uint32_t h1 = 0x3ac5d673, h2 = 0x6d7839d0;
+              f->hash_function(keys + (size_t) i * KEY_MAX, len, &h1, &h2);
+              sum += h1 ^ h2;
+            }
+        }
+      clock_t stop = clock();
+
+      /* Use the sum so that the loop is not optimized away.  */
+      printf(" %2zu bytes: %5.2f ns%s", len,
+             (double) (stop - start) / CLOCKS_PER_SEC * 1e9
+             / ((double) count * repeat),
+             sum == 0 ? "!" : "");
+    }
+  printf("\n");
+}
+
+
+static
+void
+table(const struct function *f, const char *keys, const size_t *key_lens,
+      int count)
+{
+  struct cuckoo_hash_options options = {
+    .hash_function = f->hash_function
+  };
+  struct cuckoo_hash hash;
+  ok(cuckoo_hash_init_with(&hash, 1, &options));
+
+  for (int i = 0; i < count; ++i)
+    ok(cuckoo_hash_insert(&hash, keys + (size_t) i * KEY_MAX, key_lens[i],
+                          (void *) (uintptr_t) i) == NULL);
+
+  for (int i = 0; i < count; ++i)
+    {
+      struct cuckoo_hash_item *item =
+        cuckoo_hash_lookup(&hash, keys + (size_t) i * KEY_MAX, key_lens[i]);
+      ok(item && item->value == (void *) (uintptr_t) i);
+    }
+
+  printf("  %-8s load factor: %.3f\n", f->name,
+         (double) cuckoo_hash_count(&hash)
+         / ((size_t) hash.bin_size << hash.power));
+
+  cuckoo_hash_destroy(&hash);
+}
+
+
+/*
+  Hash function that maps all keys to bins 0 and 1 under the seed
+  BAD_SEED, the way keys crafted against a known seed would collide.
+*/
+#define BAD_SEED  0x5eedU
+
+
+static
+void
+bad_seed_hash(const void *key, size_t key_len, uint32_t *h1, uint32_t *h2)
+{
+  bool bad = (*h1 == BAD_SEED && *h2 == 0);
+  cuckoo_hash_mix64(key, key_len, h1, h2);
+  if (bad)
+    {
+      *h1 = (*h1 << 16) | 0;
+      *h2 = (*h2 << 16) | 1;
+    }
+}
+
+
+static
+void
+stash(const char *keys, const size_t *key_lens)
+{
+  struct cuckoo_hash_options options = {
+    .hash_function = bad_seed_hash,
+    .seed = BAD_SEED
+  };
+  struct cuckoo_hash hash;
+  ok(cuckoo_hash_init_with(&hash, 4, &options));
+
+  /* Two bins are filled, and the rest goes to the stash.  */
+  int count = 2 * hash.bin_size + CUCKOO_HASH_STASH_SIZE;
+  for (int i = 0; i < count; ++i)
+    ok(cuckoo_hash_insert(&hash, keys + (size_t) i * KEY_MAX, key_lens[i],
+                          (void *) (uintptr_t) i) == NULL);
+  ok(hash.stash_count == CUCKOO_HASH_STASH_SIZE);
+  ok(hash.power == 4);
+
+  int n = 0;
+  struct cuckoo_hash_item *it;
+  for (cuckoo_hash_each(it, &hash))
+    ++n;
+  ok(n == count);
+
+  for (int i = 0; i < count; i += 2)
+    cuckoo_hash_remove(&hash,
+                       cuckoo_hash_lookup(&hash, keys + (size_t) i * KEY_MAX,
+                                          key_lens[i]));
+  ok(cuckoo_hash_count(&hash) == (size_t) count / 2);
+  ok(hash.stash_count == CUCKOO_HASH_STASH_SIZE / 2);
+
+  for (int i = 0; i < count; ++i)
+    {
+      struct cuckoo_hash_item *item =
+        cuckoo_hash_lookup(&hash, keys + (size_t) i * KEY_MAX, key_lens[i]);
+      if (i % 2 == 0)
+        ok(item == NULL);
+      else
+        ok(item && item->value == (void *) (uintptr_t) i);
+    }
+
+  cuckoo_hash_destroy(&hash);
+}
+
+
+static
+void
+reseed(const char *keys, const size_t *key_lens, int count)
+{
+  struct cuckoo_hash_options options = {
+    .hash_function = bad_seed_hash,
+    .seed = BAD_SEED
+  };
+  struct cuckoo_hash hash;
+  ok(cuckoo_hash_init_with(&hash, 4, &options));
+
+  struct cuckoo_hash_hashval hashval =
+    cuckoo_hash_hash(&hash, keys, key_lens[0]);
+
+  for (int i = 0; i < count; ++i)
+    ok(cuckoo_hash_insert(&hash, keys + (size_t) i * KEY_MAX, key_lens[i],
+                          (void *) (uintptr_t) i) == NULL);
+
+  for (int i = 0; i < count; ++i)
+    {
+      struct cuckoo_hash_item *item =
+        cuckoo_hash_lookup(&hash, keys + (size_t) i * KEY_MAX, key_lens[i]);
+      ok(item && item->value == (void *) (uintptr_t) i);
+    }
+
+  /* The hash value computed under the old seed still works.  */
+  ok(cuckoo_hash_lookup_hashed(&hash, keys, key_lens[0], hashval) != NULL);
+
+  printf("  load factor: %.3f\n",
+         (double) cuckoo_hash_count(&hash)
+         / ((size_t) hash.bin_size << hash.power));
+  ok(hash.bin_size == 4);
+  ok(cuckoo_hash_count(&hash) * 16 > ((size_t) hash.bin_size << hash.power));
+
+  cuckoo_hash_destroy(&hash);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  if (argc < 2 || argc > 3)
+    {
+      fprintf(stderr, "Usage: %s COUNT [REPEAT]\n", argv[0]);
+      exit(2);
+    }
+
+  int count = atoi(argv[1]);
+  int repeat = (argc == 3 ? atoi(argv[2]) : 1);
+
+  char *keys = malloc((size_t) count * KEY_MAX);
+  size_t *key_lens = malloc(count * sizeof(*key_lens));
+  ok(keys && key_lens);
+
+  size_t nfunctions = sizeof(functions) / sizeof(*functions);
+
+  printf("throughput:\n");
+  for (size_t i = 0; i < nfunctions; ++i)
+    throughput(&functions[i], keys, key_lens, count, repeat);
+
+  printf("distribution over %u bins:\n", BIN_COUNT);
+  make_decimal_keys(keys, key_lens, count);
+  for (size_t i = 0; i < nfunctions; ++i)
+    quality(&functions[i], "decimal", keys, key_lens, count);
+  make_binary_keys(keys, key_lens, count, 8);
+  for (size_t i = 0; i < nfunctions; ++i)
+    quality(&functions[i], "binary-8", keys, key_lens, count);
+  make_binary_keys(keys, key_lens, count, 32);
+  for (size_t i = 0; i < nfunctions; ++i)
+    quality(&functions[i], "binary-32", keys, key_lens, count);
+
+  printf("table:\n");
+  make_decimal_keys(keys, key_lens, count);
+  for (size_t i = 0; i < nfunctions; ++i)
+    table(&functions[i], keys, key_lens, count);
+
+  stash(keys, key_lens);
+
+  printf("reseed on colliding keys:\n");
+  reseed(keys, key_lens, count);
+
+  free(keys);
+  free(key_lens);
+
+  return 0;
+}
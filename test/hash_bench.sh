@@ -0,0 +1,6 @@
+#! /bin/sh
+
+COUNT=500000
+
+echo "Running the hash function benchmark for $COUNT keys"
+./hash_bench $COUNT
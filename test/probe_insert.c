@@ -33,6 +33,7 @@ struct depth_vector
 
 static struct depth_vector depth_vector[32] = { [0] = { .size = 0 } };
 static int depth_after_grows[32] = { 0 };
+static int stash_count = 0;
 
 
 static
@@ -112,25 +113,26 @@ report(void)
 
       fprintf(stderr, "%2zu: %10d\n", power, depth_after_grows[power]);
     }
+
+  fprintf(stderr, "stashed elements: %d\n", stash_count);
 }
 
 
 static
 void
-insert_grow_bin(const struct cuckoo_hash *hash, int phase, size_t max_depth)
+insert_stash(const struct cuckoo_hash *hash)
 {
-  UNUSED(hash && phase && max_depth);
+  UNUSED(hash);
 
-  fprintf(stderr, "bin grows happened\n");
-  abort();
+  ++stash_count;
 }
 
 
 XPROBES_MODULE(NULL, 0,
   XPROBES_PROBE("cuckoo_hash_insert_exists",
                 insert_exists, (const struct cuckoo_hash *)),
-  XPROBES_PROBE("cuckoo_hash_insert_grow_bin",
-                insert_grow_bin, (const struct cuckoo_hash *, int, size_t)),
+  XPROBES_PROBE("cuckoo_hash_insert_stash",
+                insert_stash, (const struct cuckoo_hash *)),
   XPROBES_PROBE("cuckoo_hash_insert_done",
                 insert_done, (const struct cuckoo_hash *,
                               int, size_t, size_t)));
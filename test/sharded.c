@@ -0,0 +1,382 @@
+/*
+  Copyright (C) 2010 Tomash Brechko.  All rights reserved.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Check the sharded table from one and from several threads, then
+  compare the longest insert, and the insert throughput, with those of
+  a single table.
+*/
+
+#include "../src/cuckoo_hash_sharded.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "test.h"
+
+
+#define SHARD_BITS  4
+#define WRITERS  4
+#define MAX_THREADS  64
+
+
+static uint64_t *keys;
+static int count;
+static struct cuckoo_hash_sharded sharded;
+static struct cuckoo_hash single;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static
+double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static
+bool
+sum_values(struct cuckoo_hash_item *hash_item, void *ctx)
+{
+  ok(hash_item->key_len == sizeof(uint64_t));
+  *(uintptr_t *) ctx += (uintptr_t) hash_item->value;
+
+  return true;
+}
+
+
+static
+bool
+stop_at_once(struct cuckoo_hash_item *hash_item, void *ctx)
+{
+  (void) hash_item;
+  ++*(int *) ctx;
+
+  return false;
+}
+
+
+static
+bool
+add_one(void **value, bool found, void *ctx)
+{
+  (void) ctx;
+  ok(found == (*value != NULL));
+  *value = (char *) *value + 1;
+
+  return true;
+}
+
+
+static
+void
+check(void)
+{
+  struct cuckoo_hash_options options = { .concurrent = true };
+  ok(! cuckoo_hash_sharded_init(&sharded, SHARD_BITS, 1, &options));
+  ok(! cuckoo_hash_sharded_init(&sharded, CUCKOO_HASH_SHARDED_MAX_BITS + 1,
+                                1, NULL));
+
+  ok(cuckoo_hash_sharded_init(&sharded, SHARD_BITS, 1, NULL));
+
+  /* Insert the first half one by one, and the second half at once.  */
+  for (int i = 0; i < count / 2; ++i)
+    ok(cuckoo_hash_sharded_insert(&sharded, &keys[i], sizeof(keys[i]),
+                                  (void *) (uintptr_t) (i + 1), NULL)
+       == NULL);
+
+  const void **key_ptrs = malloc(count * sizeof(*key_ptrs));
+  size_t *key_lens = malloc(count * sizeof(*key_lens));
+  void **values = malloc(count * sizeof(*values));
+  struct cuckoo_hash_item *items = malloc(count * sizeof(*items));
+  ok(key_ptrs && key_lens && values && items);
+  for (int i = 0; i < count; ++i)
+    {
+      key_ptrs[i] = &keys[i];
+      key_lens[i] = sizeof(keys[i]);
+      values[i] = (void *) (uintptr_t) (i + 1);
+    }
+  ok(cuckoo_hash_sharded_insert_batch(&sharded, key_ptrs, key_lens, values,
+                                      count)
+     == (size_t) (count - count / 2));
+  ok(cuckoo_hash_sharded_count(&sharded) == (size_t) count);
+
+  struct cuckoo_hash_item item;
+  ok(cuckoo_hash_sharded_insert(&sharded, &keys[0], sizeof(keys[0]), NULL,
+                                &item) == &item);
+  ok(item.value == (void *) 1 && *(const uint64_t *) item.key == keys[0]);
+  ok(cuckoo_hash_sharded_insert(&sharded, &keys[0], sizeof(keys[0]), NULL,
+                                NULL) == CUCKOO_HASH_SHARDED_EXISTS);
+
+  ok(cuckoo_hash_sharded_lookup_batch(&sharded, key_ptrs, key_lens, count,
+                                      items) == (size_t) count);
+  for (int i = 0; i < count; ++i)
+    ok(items[i].key == &keys[i]
+       && items[i].value == (void *) (uintptr_t) (i + 1));
+
+  uintptr_t sum = 0;
+  ok(cuckoo_hash_sharded_visit(&sharded, sum_values, &sum));
+  ok(sum == (uintptr_t) count * (count + 1) / 2);
+  int visited = 0;
+  ok(! cuckoo_hash_sharded_visit(&sharded, stop_at_once, &visited));
+  ok(visited == 1);
+
+  /* Every shard got some keys.  */
+  for (int s = 0; s < 1 << SHARD_BITS; ++s)
+    ok(cuckoo_hash_count(&sharded.shards[s].hash) > 0 || count < 1000);
+
+  for (int i = count / 2; i < count; ++i)
+    {
+      ok(cuckoo_hash_sharded_remove(&sharded, &keys[i], sizeof(keys[i]),
+                                    &item));
+      ok(item.value == (void *) (uintptr_t) (i + 1));
+      ok(! cuckoo_hash_sharded_remove(&sharded, &keys[i], sizeof(keys[i]),
+                                      NULL));
+    }
+  ok(cuckoo_hash_sharded_count(&sharded) == (size_t) count / 2);
+  ok(cuckoo_hash_sharded_lookup_batch(&sharded, key_ptrs, key_lens, count,
+                                      items) == (size_t) count / 2);
+  for (int i = 0; i < count; ++i)
+    ok((items[i].key != NULL) == (i < count / 2));
+
+  for (int i = 0; i < count; ++i)
+    ok(cuckoo_hash_sharded_upsert_with(&sharded, &keys[i], sizeof(keys[i]),
+                                       add_one, NULL));
+  for (int i = 0; i < count; ++i)
+    {
+      ok(cuckoo_hash_sharded_lookup(&sharded, &keys[i], sizeof(keys[i]),
+                                    &item));
+      ok(item.value == (void *) (uintptr_t) (i < count / 2 ? i + 2 : 1));
+    }
+
+  cuckoo_hash_sharded_destroy(&sharded);
+
+  free(items);
+  free(values);
+  free(key_lens);
+  free(key_ptrs);
+}
+
+
+static
+void *
+check_writer(void *arg)
+{
+  int id = (int) (intptr_t) arg;
+
+  for (int i = id; i < count; i += WRITERS)
+    {
+      ok(cuckoo_hash_sharded_insert(&sharded, &keys[i], sizeof(keys[i]),
+                                    (void *) (uintptr_t) (i + 1), NULL)
+         == NULL);
+
+      struct cuckoo_hash_item item;
+      ok(cuckoo_hash_sharded_lookup(&sharded, &keys[i], sizeof(keys[i]),
+                                    &item)
+         && item.value == (void *) (uintptr_t) (i + 1));
+    }
+
+  return NULL;
+}
+
+
+static
+void
+check_threads(void)
+{
+  ok(cuckoo_hash_sharded_init(&sharded, SHARD_BITS, 1, NULL));
+
+  pthread_t threads[WRITERS];
+  for (int i = 0; i < WRITERS; ++i)
+    ok(pthread_create(&threads[i], NULL, check_writer,
+                      (void *) (intptr_t) i) == 0);
+  for (int i = 0; i < WRITERS; ++i)
+    ok(pthread_join(threads[i], NULL) == 0);
+
+  ok(cuckoo_hash_sharded_count(&sharded) == (size_t) count);
+  uintptr_t sum = 0;
+  ok(cuckoo_hash_sharded_visit(&sharded, sum_values, &sum));
+  ok(sum == (uintptr_t) count * (count + 1) / 2);
+
+  cuckoo_hash_sharded_destroy(&sharded);
+}
+
+
+/*
+  Return the longest time an insert of a key into an empty table took,
+  in milliseconds.  That's the time of the last growth.
+*/
+static
+double
+longest_insert(bool sharded_table)
+{
+  if (sharded_table)
+    ok(cuckoo_hash_sharded_init(&sharded, SHARD_BITS, 1, NULL));
+  else
+    ok(cuckoo_hash_init(&single, 1));
+
+  double longest = 0;
+  for (int i = 0; i < count; ++i)
+    {
+      double start = now();
+      if (sharded_table)
+        ok(cuckoo_hash_sharded_insert(&sharded, &keys[i], sizeof(keys[i]),
+                                      NULL, NULL) == NULL);
+      else
+        ok(cuckoo_hash_insert(&single, &keys[i], sizeof(keys[i]), NULL)
+           == NULL);
+      double time = now() - start;
+      if (longest < time)
+        longest = time;
+    }
+
+  if (sharded_table)
+    cuckoo_hash_sharded_destroy(&sharded);
+  else
+    cuckoo_hash_destroy(&single);
+
+  return longest * 1e3;
+}
+
+
+struct bench
+{
+  bool sharded;
+  int offset;
+  int inserts;
+};
+
+
+static
+void *
+bench_writer(void *arg)
+{
+  const struct bench *bench = arg;
+
+  for (int i = bench->offset; i < bench->offset + bench->inserts; ++i)
+    {
+      if (bench->sharded)
+        {
+          ok(cuckoo_hash_sharded_insert(&sharded, &keys[i], sizeof(keys[i]),
+                                        NULL, NULL) == NULL);
+        }
+      else
+        {
+          pthread_mutex_lock(&mutex);
+          ok(cuckoo_hash_insert(&single, &keys[i], sizeof(keys[i]), NULL)
+             == NULL);
+          pthread_mutex_unlock(&mutex);
+        }
+    }
+
+  return NULL;
+}
+
+
+/*
+  Return the throughput of nthreads threads inserting count keys in
+  all into an empty table, in millions of inserts per second.
+*/
+static
+double
+throughput(bool sharded_table, int nthreads)
+{
+  pthread_t threads[MAX_THREADS];
+  struct bench benches[MAX_THREADS];
+
+  if (sharded_table)
+    ok(cuckoo_hash_sharded_init(&sharded, SHARD_BITS, 1, NULL));
+  else
+    ok(cuckoo_hash_init(&single, 1));
+
+  double start = now();
+  for (int i = 0; i < nthreads; ++i)
+    {
+      int beg = (int) ((long) count * i / nthreads);
+      int end = (int) ((long) count * (i + 1) / nthreads);
+      benches[i] = (struct bench) {
+        .sharded = sharded_table, .offset = beg, .inserts = end - beg
+      };
+      ok(pthread_create(&threads[i], NULL, bench_writer, &benches[i]) == 0);
+    }
+  for (int i = 0; i < nthreads; ++i)
+    ok(pthread_join(threads[i], NULL) == 0);
+  double stop = now();
+
+  if (sharded_table)
+    {
+      ok(cuckoo_hash_sharded_count(&sharded) == (size_t) count);
+      cuckoo_hash_sharded_destroy(&sharded);
+    }
+  else
+    {
+      ok(cuckoo_hash_count(&single) == (size_t) count);
+      cuckoo_hash_destroy(&single);
+    }
+
+  return (double) count / (stop - start) / 1e6;
+}
+
+
+static
+void
+bench(void)
+{
+  printf("  longest insert: %.3f ms with %d shards, %.3f ms without\n",
+         longest_insert(true), 1 << SHARD_BITS, longest_insert(false));
+
+  int cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus > MAX_THREADS)
+    cpus = MAX_THREADS;
+  for (int nthreads = 1; nthreads <= cpus; nthreads *= 2)
+    printf("  %2d threads: %6.1f M/s sharded, %6.1f M/s mutex inserts\n",
+           nthreads, throughput(true, nthreads), throughput(false, nthreads));
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  if (argc != 2)
+    {
+      fprintf(stderr, "Usage: %s COUNT\n", argv[0]);
+      exit(2);
+    }
+
+  count = atoi(argv[1]);
+  ok(count >= 2);
+
+  keys = malloc(count * sizeof(*keys));
+  ok(keys);
+  for (int i = 0; i < count; ++i)
+    keys[i] = (uint64_t) i * 0x9e3779b97f4a7c15ULL;
+
+  printf("Sharded table of %d keys:\n", count);
+  check();
+  check_threads();
+  bench();
+
+  free(keys);
+
+  return 0;
+}
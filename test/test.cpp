@@ -19,12 +19,18 @@
 #endif
 
 #include "../src/cuckoo_hash.h"
+#include "../src/cuckoo_hash_compact.h"
 #ifdef UNORDERED_MAP
 #include <unordered_map>
 #endif
+#ifdef CUCKOO_HASH_MAP
+#include "../src/cuckoo_hash_map.hpp"
+#endif
 #include <map>
 
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <sstream>
@@ -39,6 +45,179 @@
 #include "test.h"
 
 
+// Nonzero makes the cuckoo hash grow incrementally.
+#ifndef MIGRATE_STEP
+#define MIGRATE_STEP  0
+#endif
+
+// If defined, the cuckoo hash is presized for that load factor, and
+// must not grow.
+// #define RESERVE_LOAD  0.95
+
+// If defined, the cuckoo hash shrinks below that load factor.
+// #define SHRINK_LOAD  0.2
+
+// If defined, the cuckoo hash is built with cuckoo_hash_build_parallel()
+// with that many threads instead of a loop of inserts.
+// #define BUILD_PARALLEL  4
+
+// Storage of the cuckoo hash.
+#ifndef STORAGE
+#define STORAGE  CUCKOO_HASH_STORAGE_MALLOC
+#endif
+
+// If defined, the cuckoo hash allocates with a counting allocator.
+// #define ALLOCATOR
+
+// If defined, the cuckoo hash copies the keys.
+// #define COPY_KEYS
+
+// If defined, the cuckoo hash keeps inline copies of keys up to that
+// length.
+// #define INLINE_KEYS  16
+
+// If defined, the bin size and the number of choices of the cuckoo
+// hash.
+// #define BIN_SIZE  2
+// #define CHOICES  3
+
+// If defined, the growth policy of the cuckoo hash.
+// #define MAX_LOAD  0.85
+// #define MAX_DEPTH  2
+// #define GROWTH_FACTOR  4
+
+
+#ifdef ALLOCATOR
+
+// Bytes held by the cuckoo hash, and the most it held.
+static size_t allocated = 0;
+static size_t peak = 0;
+
+
+static
+void *
+counting_alloc(void *context, size_t size)
+{
+  void *ptr = std::malloc(size);
+  if (ptr)
+    *static_cast<size_t *>(context) += size;
+  peak = std::max(peak, allocated);
+
+  return ptr;
+}
+
+
+static
+void *
+counting_realloc(void *context, void *ptr, size_t old_size, size_t size)
+{
+  void *res = std::realloc(ptr, size);
+  if (res)
+    *static_cast<size_t *>(context) += size - old_size;
+  peak = std::max(peak, allocated);
+
+  return res;
+}
+
+
+static
+void
+counting_free(void *context, void *ptr, size_t size)
+{
+  std::free(ptr);
+  *static_cast<size_t *>(context) -= size;
+}
+
+
+static const cuckoo_hash_allocator counting_allocator = {
+  counting_alloc, counting_realloc, counting_free, &allocated
+};
+
+#endif  // ALLOCATOR
+
+
+#ifdef COMPACT
+
+// Hash function that gives all keys the same hashes.
+static
+void
+constant_hash_function(const void *, size_t, uint32_t *h1, uint32_t *h2)
+{
+  *h1 = 1;
+  *h2 = 1;
+}
+
+#endif  // COMPACT
+
+
+#ifdef CUCKOO_HASH_MAP
+
+// Allocations left before throwing_allocator throws, -1 for no
+// limit, and bytes it holds.
+static int allocations_left = 0;
+static size_t map_allocated = 0;
+
+
+template<class T>
+struct throwing_allocator
+{
+  using value_type = T;
+
+  throwing_allocator() = default;
+
+  template<class U>
+  throwing_allocator(const throwing_allocator<U> &) noexcept
+  {
+  }
+
+  T *
+  allocate(size_t n)
+  {
+    if (allocations_left == 0)
+      throw std::bad_alloc();
+    if (allocations_left > 0)
+      --allocations_left;
+    map_allocated += n * sizeof(T);
+
+    return std::allocator<T>().allocate(n);
+  }
+
+  void
+  deallocate(T *p, size_t n) noexcept
+  {
+    map_allocated -= n * sizeof(T);
+    std::allocator<T>().deallocate(p, n);
+  }
+
+  template<class U>
+  bool
+  operator==(const throwing_allocator<U> &) const noexcept
+  {
+    return true;
+  }
+
+  template<class U>
+  bool
+  operator!=(const throwing_allocator<U> &) const noexcept
+  {
+    return false;
+  }
+};
+
+
+// Hash that puts all keys into the same two bins.
+struct constant_hash
+{
+  size_t
+  operator()(int) const noexcept
+  {
+    return 0;
+  }
+};
+
+#endif  // CUCKOO_HASH_MAP
+
+
 struct Data
 {
   std::string key;
@@ -61,7 +240,52 @@ cuckoo_hash *
 create<cuckoo_hash>()
 {
   cuckoo_hash *hash = new cuckoo_hash;
-  if (! cuckoo_hash_init(hash, 1))
+  cuckoo_hash_options options = cuckoo_hash_options();
+  options.migrate_step = MIGRATE_STEP;
+  options.storage = STORAGE;
+#ifdef ALLOCATOR
+  options.allocator = &counting_allocator;
+#endif
+#ifdef COPY_KEYS
+  options.copy_keys = true;
+#endif
+#ifdef INLINE_KEYS
+  options.inline_keys = INLINE_KEYS;
+#endif
+#ifdef BIN_SIZE
+  options.bin_size = BIN_SIZE;
+#endif
+#ifdef CHOICES
+  options.choices = CHOICES;
+#endif
+  static struct cuckoo_hash_growth growth;
+#ifdef MAX_LOAD
+  growth.max_load = MAX_LOAD;
+#endif
+#ifdef MAX_DEPTH
+  growth.max_depth = MAX_DEPTH;
+#endif
+#ifdef GROWTH_FACTOR
+  growth.factor = GROWTH_FACTOR;
+#endif
+  options.growth = &growth;
+#ifdef SHRINK_LOAD
+  options.shrink_load = SHRINK_LOAD;
+#endif
+  if (! cuckoo_hash_init_with(hash, 1, &options))
+    throw std::bad_alloc();
+
+  return hash;
+}
+
+
+template<>
+inline
+cuckoo_hash_compact *
+create<cuckoo_hash_compact>()
+{
+  cuckoo_hash_compact *hash = new cuckoo_hash_compact;
+  if (! cuckoo_hash_compact_init(hash, 1, NULL))
     throw std::bad_alloc();
 
   return hash;
@@ -97,6 +321,17 @@ load_factor<cuckoo_hash>(cuckoo_hash *cont)
 }
 
 
+template<>
+inline
+double
+load_factor<cuckoo_hash_compact>(cuckoo_hash_compact *cont)
+{
+  return (static_cast<double>(cuckoo_hash_compact_count(cont))
+          / (static_cast<size_t>(CUCKOO_HASH_COMPACT_BIN_SIZE)
+             << cont->power));
+}
+
+
 template<class Cont>
 static inline
 void
@@ -117,6 +352,17 @@ insert<cuckoo_hash>(cuckoo_hash *cont, Data *d)
 }
 
 
+template<>
+inline
+void
+insert<cuckoo_hash_compact>(cuckoo_hash_compact *cont, Data *d)
+{
+  if (cuckoo_hash_compact_insert(cont, d->key.c_str(), d->key.size(), d)
+      == CUCKOO_HASH_FAILED)
+    throw std::bad_alloc();
+}
+
+
 template<class Cont>
 static inline
 int
@@ -144,6 +390,27 @@ lookup<cuckoo_hash>(cuckoo_hash *cont, const Data *d)
     {
       /* Let's be fair and access actual data.  */
       ok(static_cast<const Data *>(it->value)->data == d->data);
+#ifdef COPY_KEYS
+      ok(it->key != d->key.c_str());
+#endif
+      return 1;
+    }
+
+  return 0;
+}
+
+
+template<>
+inline
+int
+lookup<cuckoo_hash_compact>(cuckoo_hash_compact *cont, const Data *d)
+{
+  const cuckoo_hash_compact_item *it =
+    cuckoo_hash_compact_lookup(cont, d->key.c_str(), d->key.size());
+  if (it != NULL)
+    {
+      ok(static_cast<const Data *>(*cuckoo_hash_compact_value(cont, it))->data
+         == d->data);
       return 1;
     }
 
@@ -151,6 +418,54 @@ lookup<cuckoo_hash>(cuckoo_hash *cont, const Data *d)
 }
 
 
+template<class Cont>
+static inline
+int
+lookup_batch(Cont *cont, const Data *data, int n)
+{
+  int found = 0;
+  for (int i = 0; i < n; ++i)
+    found += lookup(cont, &data[i]);
+
+  return found;
+}
+
+
+template<>
+inline
+int
+lookup_batch<cuckoo_hash>(cuckoo_hash *cont, const Data *data, int n)
+{
+  enum { BATCH = 256 };
+
+  const void *keys[BATCH];
+  size_t key_lens[BATCH];
+  cuckoo_hash_item *items[BATCH];
+
+  int found = 0;
+  for (int beg = 0; beg < n; beg += BATCH)
+    {
+      int count = std::min(n - beg, static_cast<int>(BATCH));
+      for (int i = 0; i < count; ++i)
+        {
+          keys[i] = data[beg + i].key.c_str();
+          key_lens[i] = data[beg + i].key.size();
+        }
+
+      found += cuckoo_hash_lookup_batch(cont, keys, key_lens, count, items);
+
+      for (int i = 0; i < count; ++i)
+        {
+          if (items[i] != NULL)
+            ok(static_cast<const Data *>(items[i]->value)->data
+               == data[beg + i].data);
+        }
+    }
+
+  return found;
+}
+
+
 template<class Cont>
 static inline
 void
@@ -165,8 +480,142 @@ inline
 void
 remove<cuckoo_hash>(cuckoo_hash *cont, const Data *d)
 {
+  cuckoo_hash_hashval hashval =
+    cuckoo_hash_hash(cont, d->key.c_str(), d->key.size());
   cuckoo_hash_remove(cont,
-                     cuckoo_hash_lookup(cont, d->key.c_str(), d->key.size()));
+                     cuckoo_hash_lookup_hashed(cont,
+                                               d->key.c_str(), d->key.size(),
+                                               hashval));
+}
+
+
+template<class Cont>
+static inline
+void
+check_hashed(Cont *, Data *, int, int)
+{
+}
+
+
+// Hash function that maps all keys to the same two bins under the
+// seed BAD_SEED, so that a table with that seed soon reseeds.
+#define BAD_SEED  0x5eedU
+
+
+static
+void
+bad_seed_hash(const void *key, size_t key_len, uint32_t *h1, uint32_t *h2)
+{
+  bool bad = (*h1 == BAD_SEED && *h2 == 0);
+  cuckoo_hash_mix64(key, key_len, h1, h2);
+  if (bad)
+    {
+      *h1 = 0;
+      *h2 = 1;
+    }
+}
+
+
+// Insert by precomputed hash values, fresh and made stale by a
+// reseed.  cont holds the first count keys of data, which has total.
+template<>
+inline
+void
+check_hashed<cuckoo_hash>(cuckoo_hash *cont, Data *data, int count,
+                          int total)
+{
+  if (total > count)
+    {
+      Data *d = &data[count];
+      cuckoo_hash_hashval hashval =
+        cuckoo_hash_hash(cont, d->key.c_str(), d->key.size());
+      cuckoo_hash_prefetch_hashed(cont, hashval);
+      ok(cuckoo_hash_insert_hashed(cont, d->key.c_str(), d->key.size(), d,
+                                   hashval) == NULL);
+      cuckoo_hash_item *item =
+        cuckoo_hash_insert_hashed(cont, d->key.c_str(), d->key.size(),
+                                  &data[0], hashval);
+      ok(item != NULL && item != CUCKOO_HASH_FAILED && item->value == d);
+      ok(cuckoo_hash_lookup(cont, d->key.c_str(), d->key.size()) == item);
+      cuckoo_hash_remove(cont, item);
+    }
+
+  cuckoo_hash_options options = cuckoo_hash_options();
+  options.hash_function = bad_seed_hash;
+  options.seed = BAD_SEED;
+  cuckoo_hash hash;
+  ok(cuckoo_hash_init_with(&hash, 4, &options));
+
+  int n = std::min(total, 4 * CUCKOO_HASH_STASH_SIZE + 16);
+  std::vector<cuckoo_hash_hashval> hashvals;
+  for (int i = 0; i < n; ++i)
+    hashvals.push_back(cuckoo_hash_hash(&hash, data[i].key.c_str(),
+                                        data[i].key.size()));
+
+  // The first half is inserted with the hash values computed under the
+  // seed, which the table soon replaces.
+  for (int i = 0; i < n / 2; ++i)
+    ok(cuckoo_hash_insert_hashed(&hash, data[i].key.c_str(),
+                                 data[i].key.size(), &data[i], hashvals[i])
+       == NULL);
+  ok(hash.seed1 != BAD_SEED || n < 32);
+
+  // The second half is inserted with stale hash values.
+  for (int i = n / 2; i < n; ++i)
+    ok(cuckoo_hash_insert_hashed(&hash, data[i].key.c_str(),
+                                 data[i].key.size(), &data[i], hashvals[i])
+       == NULL);
+  for (int i = 0; i < n; ++i)
+    {
+      cuckoo_hash_item *item =
+        cuckoo_hash_insert_hashed(&hash, data[i].key.c_str(),
+                                  data[i].key.size(), NULL, hashvals[i]);
+      ok(item != NULL && item != CUCKOO_HASH_FAILED
+         && item->value == &data[i]);
+      ok(cuckoo_hash_lookup(&hash, data[i].key.c_str(), data[i].key.size())
+         == item);
+    }
+  ok(cuckoo_hash_count(&hash) == static_cast<size_t>(n));
+
+  cuckoo_hash_destroy(&hash);
+}
+
+
+template<>
+inline
+void
+remove<cuckoo_hash_compact>(cuckoo_hash_compact *cont, const Data *d)
+{
+  cuckoo_hash_compact_remove(cont,
+                             cuckoo_hash_compact_lookup(cont, d->key.c_str(),
+                                                        d->key.size()));
+}
+
+
+template<class Cont>
+static inline
+size_t
+size(Cont *cont)
+{
+  return cont->size();
+}
+
+
+template<>
+inline
+size_t
+size<cuckoo_hash>(cuckoo_hash *cont)
+{
+  return cuckoo_hash_count(cont);
+}
+
+
+template<>
+inline
+size_t
+size<cuckoo_hash_compact>(cuckoo_hash_compact *cont)
+{
+  return cuckoo_hash_compact_count(cont);
 }
 
 
@@ -198,6 +647,22 @@ traverse<cuckoo_hash>(cuckoo_hash *cont)
 }
 
 
+template<>
+inline
+size_t
+traverse<cuckoo_hash_compact>(cuckoo_hash_compact *cont)
+{
+  size_t sum = 0;
+  for (const cuckoo_hash_compact_item *cuckoo_hash_compact_each(it, cont))
+    {
+      void *value = *cuckoo_hash_compact_value(cont, it);
+      sum += static_cast<const Data *>(value)->data;
+    }
+
+  return sum;
+}
+
+
 #if defined(MAP)
 
 typedef std::map<std::string, int> cont_type;
@@ -219,6 +684,15 @@ typedef
 
 #endif  // USE_CACHE
 
+#elif defined(COMPACT)
+
+typedef cuckoo_hash_compact cont_type;
+
+#elif defined(CUCKOO_HASH_MAP)
+
+typedef cuckoo::hash_map<std::string, int,
+                         cuckoo::string_hash, std::equal_to<> > cont_type;
+
 #else
 
 typedef cuckoo_hash cont_type;
@@ -283,7 +757,33 @@ main(int argc, char *argv[])
   struct mallinfo before = mallinfo();
 #endif
 
+#ifdef RESERVE_LOAD
+  ok(cuckoo_hash_reserve(cont, count, RESERVE_LOAD));
+  size_t capacity = static_cast<size_t>(cont->bin_size) << cont->power;
+#endif
+
   size_t sum = 0;
+#ifdef BUILD_PARALLEL
+  // Every tenth key comes twice, the first copy has to be kept.
+  std::vector<cuckoo_hash_item> items;
+  for (int i = 0; i < count; ++i)
+    {
+      items.push_back({ data[i].key.c_str(), data[i].key.size(), &data[i] });
+      if (i % 10 == 0)
+        items.push_back({ data[i].key.c_str(), data[i].key.size(),
+                          &data[total - 1] });
+      sum += data[i].data;
+    }
+  start = clock();
+  ok(cuckoo_hash_build_parallel(cont, items.data(), items.size(),
+                                BUILD_PARALLEL));
+  stop = clock();
+  ok(size(cont) == static_cast<size_t>(count));
+#ifdef ALLOCATOR
+  // Scratch memory of the build came from the allocator too.
+  ok(peak >= allocated + 2 * items.size() * sizeof(size_t) || count == 0);
+#endif
+#else
   start = clock();
   for (int i = 0; i < count; ++i)
     {
@@ -291,6 +791,13 @@ main(int argc, char *argv[])
       sum += data[i].data;
     }
   stop = clock();
+#endif
+
+#ifdef RESERVE_LOAD
+  ok((static_cast<size_t>(cont->bin_size) << cont->power) == capacity);
+#endif
+
+  check_hashed(cont, data, count, total);
 
 #ifdef HAVE_MALLINFO
   struct mallinfo after = mallinfo();
@@ -300,6 +807,22 @@ main(int argc, char *argv[])
 #endif
 
   std::cout << "load factor: " << load_factor(cont) << std::endl;
+#ifdef ALLOCATOR
+  std::cout << "allocator memory: " << allocated << std::endl;
+  ok(allocated >= (static_cast<size_t>(cont->bin_size) << cont->power)
+                  * sizeof(cuckoo_hash_item));
+#endif
+#ifdef MAX_LOAD
+  ok(load_factor(cont) <= MAX_LOAD);
+  ok(cuckoo_hash_growth_policy(cont)->max_load == MAX_LOAD);
+#endif
+#ifdef GROWTH_FACTOR
+  ok(cuckoo_hash_growth_policy(cont)->factor == GROWTH_FACTOR);
+#endif
+#if MIGRATE_STEP > 0
+  std::cout << "bins to migrate: " << cuckoo_hash_migrate(cont, 0)
+            << std::endl;
+#endif
   std::cout << "insert: "
             << static_cast<double>(stop - start) / CLOCKS_PER_SEC << " sec"
             << std::endl;
@@ -317,6 +840,17 @@ main(int argc, char *argv[])
             << static_cast<double>(stop - start) / CLOCKS_PER_SEC << " sec"
             << std::endl;
 
+  start = clock();
+  for (int j = 0; j < repeat; ++j)
+    {
+      int found = lookup_batch(cont, data, total);
+      ok(found == count);
+    }
+  stop = clock();
+  std::cout << "lookup batch (x " << repeat << "): "
+            << static_cast<double>(stop - start) / CLOCKS_PER_SEC << " sec"
+            << std::endl;
+
   start = clock();
   for (int j = 0; j < repeat; ++j)
     {
@@ -332,9 +866,202 @@ main(int argc, char *argv[])
   for (int i = 0; i < count; ++i)
     remove(cont, &data[i]);
   stop = clock();
+  ok(size(cont) == 0);
   std::cout << "remove: "
             << static_cast<double>(stop - start) / CLOCKS_PER_SEC << " sec"
             << std::endl;
 
+#ifdef SHRINK_LOAD
+  // The first insert into the emptied table shrinks it.
+  int small = count / 10;
+  for (int i = 0; i < small; ++i)
+    insert(cont, &data[i]);
+  ok(load_factor(cont) > SHRINK_LOAD);
+  std::cout << "load factor after shrink: " << load_factor(cont) << std::endl;
+
+  for (int i = small / 2; i < small; ++i)
+    remove(cont, &data[i]);
+  ok(cuckoo_hash_shrink_to_fit(cont));
+  std::cout << "load factor after shrink to fit: " << load_factor(cont)
+            << std::endl;
+
+  int found = 0;
+  for (int i = 0; i < small; ++i)
+    found += lookup(cont, &data[i]);
+  ok(found == small / 2);
+  ok(size(cont) == static_cast<size_t>(small / 2));
+#endif
+
+#ifdef COMPACT
+  // A set keeps no values.
+  cuckoo_hash_compact set;
+  cuckoo_hash_compact_options options = cuckoo_hash_compact_options();
+  options.set = true;
+  ok(cuckoo_hash_compact_init(&set, 1, &options));
+  for (int i = 0; i < count; ++i)
+    ok(cuckoo_hash_compact_insert(&set, data[i].key.c_str(),
+                                  data[i].key.size(), NULL) == NULL);
+  int found = 0;
+  for (int i = 0; i < total; ++i)
+    {
+      const cuckoo_hash_compact_item *it =
+        cuckoo_hash_compact_lookup(&set, data[i].key.c_str(),
+                                   data[i].key.size());
+      if (it != NULL)
+        {
+          ok(cuckoo_hash_compact_value(&set, it) == NULL);
+          ++found;
+        }
+    }
+  ok(found == count);
+  std::cout << "set load factor: " << load_factor(&set) << std::endl;
+  cuckoo_hash_compact_destroy(&set);
+
+  // Keys with the same fingerprint fill their two bins, and then fail
+  // without growing the table.
+  options.hash_function = constant_hash_function;
+  ok(cuckoo_hash_compact_init(&set, 1, &options));
+  int same = std::min(total, 2 * CUCKOO_HASH_COMPACT_BIN_SIZE + 1);
+  for (int i = 0; i < same; ++i)
+    {
+      cuckoo_hash_compact_item *it =
+        cuckoo_hash_compact_insert(&set, data[i].key.c_str(),
+                                   data[i].key.size(), NULL);
+      ok(it == (i < 2 * CUCKOO_HASH_COMPACT_BIN_SIZE
+                ? NULL : CUCKOO_HASH_FAILED));
+    }
+  ok(set.power == 1);
+  for (int i = 0; i < same; ++i)
+    ok((cuckoo_hash_compact_lookup(&set, data[i].key.c_str(),
+                                   data[i].key.size()) != NULL)
+       == (i < 2 * CUCKOO_HASH_COMPACT_BIN_SIZE));
+  cuckoo_hash_compact_remove(&set,
+                             cuckoo_hash_compact_lookup(&set,
+                                                        data[0].key.c_str(),
+                                                        data[0].key.size()));
+  ok(cuckoo_hash_compact_insert(&set, data[same - 1].key.c_str(),
+                                data[same - 1].key.size(), NULL) == NULL
+     || same <= 2 * CUCKOO_HASH_COMPACT_BIN_SIZE);
+  cuckoo_hash_compact_destroy(&set);
+#endif
+
+#ifdef CUCKOO_HASH_MAP
+  {
+    // Lookup by std::string_view, and move-only values.
+    cuckoo::hash_map<std::string, std::unique_ptr<int>,
+                     cuckoo::string_hash, std::equal_to<> > map;
+    for (int i = 0; i < count; ++i)
+      ok(map.try_emplace(data[i].key, new int(data[i].data)).second);
+    ok(! map.try_emplace(data[0].key, nullptr).second);
+    ok(map.size() == static_cast<size_t>(count));
+
+    int found = 0;
+    for (int i = 0; i < total; ++i)
+      {
+        auto it = map.find(std::string_view(data[i].key));
+        if (it != map.end())
+          {
+            ok(*it->second == data[i].data);
+            ++found;
+          }
+      }
+    ok(found == count);
+
+    ok(! map.insert_or_assign(data[0].key, std::make_unique<int>(-1)).second);
+    ok(*map.at(data[0].key) == -1);
+
+    auto moved = std::move(map);
+    ok(map.empty() && moved.size() == static_cast<size_t>(count));
+    map[data[0].key].reset(new int(1));
+    ok(map.size() == 1 && moved.contains(std::string_view(data[1].key)));
+  }
+
+  // An allocator that throws on growth, be it on the allocation of
+  // the hashes, of the elements, or of the index of the rehash, leaves
+  // the map as it was.
+  for (int budget = 2; budget <= 4; ++budget)
+    {
+      typedef cuckoo::hash_map<int, std::string, std::hash<int>,
+                               std::equal_to<int>,
+                               throwing_allocator<std::pair<const int,
+                                                            std::string> > >
+        map_type;
+      allocations_left = budget;
+      map_type map;
+      int inserted = 0;
+      try
+        {
+          for (; inserted < count; ++inserted)
+            map.emplace(inserted, data[inserted].key);
+        }
+      catch (const std::bad_alloc &)
+        {
+        }
+      ok(inserted < count || count < 16);
+      ok(map.size() == static_cast<size_t>(inserted));
+      ok(static_cast<size_t>(std::distance(map.begin(), map.end()))
+         == map.size());
+      for (int i = 0; i < inserted; ++i)
+        ok(map.at(i) == data[i].key);
+      ok(map.find(inserted) == map.end());
+
+      allocations_left = -1;
+      for (int i = inserted; i < count; ++i)
+        ok(map.emplace(i, data[i].key).second);
+      ok(map.size() == static_cast<size_t>(count));
+
+      allocations_left = budget - 2;
+      try
+        {
+          map.reserve(4 * static_cast<size_t>(count));
+          ok(false);
+        }
+      catch (const std::bad_alloc &)
+        {
+        }
+      ok(map.size() == static_cast<size_t>(count));
+      for (int i = 0; i < count; ++i)
+        ok(map.at(i) == data[i].key);
+
+      try
+        {
+          map_type copy(map);
+          ok(false);
+        }
+      catch (const std::bad_alloc &)
+        {
+        }
+    }
+  ok(map_allocated == 0);
+
+  {
+    // Keys with equal hashes fill their two bins, and then throw.
+    allocations_left = -1;
+    cuckoo::hash_map<int, int, constant_hash, std::equal_to<int>,
+                     throwing_allocator<std::pair<const int, int> > > map;
+    for (int i = 0; i < 8; ++i)
+      ok(map.emplace(i, i).second);
+    try
+      {
+        map.emplace(8, 8);
+        ok(false);
+      }
+    catch (const std::length_error &)
+      {
+      }
+    ok(map.size() == 8 && map.count(8) == 0);
+    for (int i = 0; i < 8; ++i)
+      ok(map.at(i) == i);
+    ok(! map.emplace(0, 0).second && map.erase(0) == 1);
+    ok(map.emplace(8, 8).second && map.at(8) == 8);
+  }
+  ok(map_allocated == 0);
+#endif
+
+#ifdef ALLOCATOR
+  cuckoo_hash_destroy(cont);
+  ok(allocated == 0);
+#endif
+
   return 0;
 }